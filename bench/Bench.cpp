@@ -0,0 +1,525 @@
+#include <getopt.h>
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Emulator.h"
+#include "Netplay.h"
+#include "Observation.h"
+#include "RamSearch.h"
+#include "RomBuilder.h"
+
+using namespace std;
+using namespace NebulaEmu;
+
+namespace {
+
+// CPU cycles per NTSC frame, used to size the per-step benchmarks
+constexpr uint64_t CPU_CYCLES_PER_FRAME = 29781;
+constexpr uint64_t PPU_CYCLES_PER_FRAME = 341 * 262;
+
+struct Result {
+    string name;
+    // "op", "cycle" or "frame"
+    string unit;
+    uint64_t iterations;
+    double ns;
+    // 0 if the benchmark is not frame based
+    uint64_t cyclesPerFrame = 0;
+    uint64_t frames = 0;
+};
+
+vector<Result> results;
+string filter;
+uint64_t frames = 120;
+
+bool enabled(const string& name) { return filter.empty() || name.find(filter) != string::npos; }
+
+template <typename F>
+double measure(F&& f) {
+    auto begin = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count();
+}
+
+void insertCartridge(RomBuilder& rom) {
+    string path = rom.write("NebulaEmuBench.nes");
+    init();
+    powerOn(path);
+}
+
+// SEI, CLD, stack, APU frame IRQ off and zero page filled with $02 so every indirect pointer lands in $0202
+void emitReset(RomBuilder& rom) {
+    rom.label("reset");
+    rom.emit({0x78, 0xD8});      // SEI; CLD
+    rom.emit(0xA2, 0xFF);        // LDX #$FF
+    rom.emit({0x9A});            // TXS
+    rom.emit(0xA9, 0x40);        // LDA #$40
+    rom.emitWord(0x8D, 0x4017);  // STA $4017
+    rom.emit(0xA2, 0x00);        // LDX #0
+    rom.emit(0xA9, 0x02);        // LDA #2
+    rom.label("fillZeroPage");
+    rom.emit(0x95, 0x00);              // STA $00,X
+    rom.emit({0xE8});                  // INX
+    rom.branch(0xD0, "fillZeroPage");  // BNE
+    rom.emit(0xA0, 0x00);              // LDY #0
+    rom.emit(0xA9, 0x00);              // LDA #0
+}
+
+// tile 1 is a busy pattern so every pixel goes through the whole background/sprite path
+void fillPatterns(RomBuilder& rom) {
+    for (int table = 0; table < 2; table++) {
+        for (int i = 0; i < 8; i++) {
+            rom.CHR()[table * 0x1000 + 16 + i] = 0x55 << (i & 1);
+            rom.CHR()[table * 0x1000 + 24 + i] = 0x33 << (i & 1);
+        }
+    }
+}
+
+void writePPU(uint16_t addr, uint8_t data) { cpu->write(addr, data); }
+
+// palette, nametables and OAM are filled through the CPU bus like a game would do
+void setupScene(uint8_t mask) {
+    writePPU(0x2001, 0);
+    cpu->readByte(0x2002);
+    writePPU(0x2006, 0x3F);
+    writePPU(0x2006, 0x00);
+    for (int i = 0; i < 0x20; i++) {
+        writePPU(0x2007, (i * 7) & 0x3F);
+    }
+    writePPU(0x2006, 0x20);
+    writePPU(0x2006, 0x00);
+    for (int i = 0; i < 0x800; i++) {
+        // 960 tiles then 64 attribute bytes per nametable
+        writePPU(0x2007, (i & 0x3FF) < 960 ? 1 : 0xE4);
+    }
+    writePPU(0x2003, 0);
+    for (int i = 0; i < 64; i++) {
+        writePPU(0x2004, (i * 13) % 224);  // Y
+        writePPU(0x2004, 1);               // tile
+        writePPU(0x2004, i & 0x23);        // palette and priority
+        writePPU(0x2004, (i * 37) % 248);  // X
+    }
+    writePPU(0x2005, 0);
+    writePPU(0x2005, 0);
+    writePPU(0x2000, 0x08);  // sprites from $1000
+    writePPU(0x2001, mask);
+}
+
+// bytes of an official opcode, grouped the same way as CPU::executeCommon decodes them
+int instructionLength(uint8_t opcode) {
+    // implied and accumulator opcodes
+    static const set<uint8_t> oneByte = {0x08, 0x28, 0x48, 0x68, 0x88, 0xA8, 0xC8, 0xE8, 0x18, 0x38, 0x58, 0x78, 0x98,
+                                         0xB8, 0xD8, 0xF8, 0x8A, 0x9A, 0xAA, 0xBA, 0xCA, 0xEA, 0x0A, 0x2A, 0x4A, 0x6A};
+    if (oneByte.count(opcode)) {
+        return 1;
+    }
+    switch (opcode & 0x1F) {
+        case 0x0C:
+        case 0x0D:
+        case 0x0E:
+        case 0x19:
+        case 0x1C:
+        case 0x1D:
+        case 0x1E:
+            return 3;
+        default:
+            return 2;
+    }
+}
+
+// control flow is measured by the loop around every other opcode
+bool benchmarkableOpcode(uint8_t opcode) {
+    switch (opcode) {
+        case 0x00:  // BRK
+        case 0x20:  // JSR
+        case 0x40:  // RTI
+        case 0x4C:  // JMP
+        case 0x60:  // RTS
+        case 0x6C:  // JMP indirect
+            return false;
+        default:
+            break;
+    }
+    // branches and unofficial opcodes
+    return CPU::getOperationCycles(opcode) && (opcode & 0x1F) != 0x10 && (opcode & 0x03) != 0x03;
+}
+
+void benchmarkBus() {
+    RomBuilder rom;
+    emitReset(rom);
+    rom.label("loop").jump(0x4C, "loop");
+    rom.setVectors("reset", "reset", "reset");
+    insertCartridge(rom);
+
+    const uint64_t iterations = 1 << 24;
+    volatile uint8_t sink = 0;
+    if (enabled("cpu.readByte.ram")) {
+        double ns = measure([&] {
+            for (uint64_t i = 0; i < iterations; i++) {
+                sink = cpu->readByte(i & 0x1FFF);
+            }
+        });
+        results.push_back({"cpu.readByte.ram", "op", iterations, ns});
+    }
+    if (enabled("cpu.readByte.prg")) {
+        double ns = measure([&] {
+            for (uint64_t i = 0; i < iterations; i++) {
+                sink = cpu->readByte(0x8000 | (i & 0x7FFF));
+            }
+        });
+        results.push_back({"cpu.readByte.prg", "op", iterations, ns});
+    }
+    if (enabled("cpu.write.ram")) {
+        double ns = measure([&] {
+            for (uint64_t i = 0; i < iterations; i++) {
+                cpu->write(0x200 | (i & 0x5FF), i);
+            }
+        });
+        results.push_back({"cpu.write.ram", "op", iterations, ns});
+    }
+    (void)sink;
+}
+
+void benchmarkOpcodes() {
+    for (int opcode = 0; opcode < 0x100; opcode++) {
+        char name[32];
+        snprintf(name, sizeof(name), "cpu.opcode.%02X", opcode);
+        if (!benchmarkableOpcode(opcode) || !enabled(name)) {
+            continue;
+        }
+
+        RomBuilder rom;
+        emitReset(rom);
+        rom.label("body");
+        for (int i = 0; i < 64; i++) {
+            switch (instructionLength(opcode)) {
+                case 1:
+                    rom.emit({(uint8_t)opcode});
+                    break;
+                case 2:
+                    // immediate and zero page use $20, indirect modes go through the pointer at $40
+                    rom.emit(opcode, (opcode & 0x1F) == 0x01 || (opcode & 0x1F) == 0x11 ? 0x40 : 0x20);
+                    break;
+                default:
+                    rom.emitWord(opcode, 0x0300);
+                    break;
+            }
+        }
+        rom.jump(0x4C, "body");
+        rom.setVectors("reset", "reset", "reset");
+        insertCartridge(rom);
+
+        // leave the reset routine before measuring, then drop the events so nothing ends the batch
+        step(2500);
+        scheduler->reset();
+        uint64_t cycles = CPU_CYCLES_PER_FRAME * frames;
+        double ns = measure([&] { cpu->run(cpu->getCycles() + cycles); });
+        results.push_back({name, "cycle", cycles, ns});
+    }
+}
+
+void benchmarkPPU() {
+    const pair<const char*, uint8_t> scenes[] = {
+        {"ppu.frame.background", 0x0A},
+        {"ppu.frame.sprites", 0x14},
+        {"ppu.frame.both", 0x1E},
+    };
+    for (auto& scene : scenes) {
+        if (!enabled(scene.first)) {
+            continue;
+        }
+        RomBuilder rom;
+        fillPatterns(rom);
+        emitReset(rom);
+        rom.label("loop").jump(0x4C, "loop");
+        rom.setVectors("reset", "reset", "reset");
+        insertCartridge(rom);
+        setupScene(scene.second);
+
+        uint64_t cycles = PPU_CYCLES_PER_FRAME * frames;
+        double ns = measure([&] {
+            for (uint64_t i = 0; i < cycles; i++) {
+                ppu->step();
+            }
+        });
+        results.push_back({scene.first, "cycle", cycles, ns, PPU_CYCLES_PER_FRAME, frames});
+    }
+}
+
+void benchmarkAPU() {
+    if (!enabled("apu.step")) {
+        return;
+    }
+    RomBuilder rom;
+    emitReset(rom);
+    rom.label("loop").jump(0x4C, "loop");
+    rom.setVectors("reset", "reset", "reset");
+    insertCartridge(rom);
+
+    // every channel playing with envelopes and sweeps running
+    const pair<uint16_t, uint8_t> writes[] = {
+        {0x4015, 0x0F}, {0x4000, 0xBF}, {0x4001, 0x9A}, {0x4002, 0xFD}, {0x4003, 0x08}, {0x4004, 0x7F},
+        {0x4005, 0x00}, {0x4006, 0x80}, {0x4007, 0x09}, {0x4008, 0xFF}, {0x400A, 0x40}, {0x400B, 0x08},
+        {0x400C, 0x1F}, {0x400E, 0x04}, {0x400F, 0x08},
+    };
+    for (auto& w : writes) {
+        cpu->write(w.first, w.second);
+    }
+    uint64_t cycles = CPU_CYCLES_PER_FRAME / 2 * frames;
+    double ns = measure([&] {
+        for (uint64_t i = 0; i < cycles; i++) {
+            scheduler->advance(2);
+            apu->step();
+        }
+    });
+    results.push_back({"apu.step", "cycle", cycles, ns, CPU_CYCLES_PER_FRAME / 2, frames});
+}
+
+// a game-like frame: a busy main loop, NMI with OAM DMA, background, sprites and audio on
+void insertGameLoop() {
+    RomBuilder rom;
+    fillPatterns(rom);
+    emitReset(rom);
+    rom.emit(0xA9, 0x80);        // LDA #$80
+    rom.emitWord(0x8D, 0x2000);  // STA $2000, NMI on
+    rom.label("loop");
+    rom.emit(0xE6, 0x00);        // INC $00
+    rom.emit(0xA5, 0x00);        // LDA $00
+    rom.emit(0x69, 0x03);        // ADC #3
+    rom.emitWord(0x9D, 0x0200);  // STA $0200,X
+    rom.emit({0xE8});            // INX
+    rom.branch(0xD0, "loop");    // BNE
+    rom.jump(0x4C, "loop");
+    rom.label("nmi");
+    rom.emit({0x48});            // PHA
+    rom.emitWord(0xAD, 0x2002);  // LDA $2002
+    rom.emit(0xA9, 0x02);        // LDA #2
+    rom.emitWord(0x8D, 0x4014);  // STA $4014, OAM DMA
+    rom.emit({0x68, 0x40});      // PLA; RTI
+    rom.label("irq").emit({0x40});
+    rom.setVectors("nmi", "reset", "irq");
+    insertCartridge(rom);
+    setupScene(0x1E);
+    cpu->write(0x4015, 0x0F);
+}
+
+void benchmarkFrame() {
+    if (!enabled("frame.headless")) {
+        return;
+    }
+    insertGameLoop();
+
+    stepFrame();
+    uint64_t begin = cpu->getCycles();
+    double ns = measure([&] {
+        for (uint64_t i = 0; i < frames; i++) {
+            stepFrame();
+        }
+    });
+    results.push_back({"frame.headless", "frame", frames, ns, (cpu->getCycles() - begin) / frames, frames});
+}
+
+// snapshots, their hash and the worst rollback of netplay: load the oldest state and run MAX_ROLLBACK frames again
+// without composing pixels, saving the state before each, which has to fit in a host frame along with the visible frame
+void benchmarkState() {
+    if (!enabled("state.save") && !enabled("state.load") && !enabled("state.hash") && !enabled("netplay.rollback")) {
+        return;
+    }
+    insertGameLoop();
+    stepFrame();
+    // each benchmark can run alone, so the state they load and hash is saved up front
+    State state;
+    saveState(state);
+    const uint64_t iterations = 10000;
+    if (enabled("state.save")) {
+        double ns = measure([&] {
+            for (uint64_t i = 0; i < iterations; i++) {
+                saveState(state);
+            }
+        });
+        results.push_back({"state.save", "op", iterations, ns});
+    }
+    if (enabled("state.load")) {
+        double ns = measure([&] {
+            for (uint64_t i = 0; i < iterations; i++) {
+                loadState(state);
+            }
+        });
+        results.push_back({"state.load", "op", iterations, ns});
+    }
+    if (enabled("state.hash")) {
+        StateHash hash;
+        double ns = measure([&] {
+            for (uint64_t i = 0; i < iterations; i++) {
+                hashState(state, hash);
+            }
+        });
+        results.push_back({"state.hash", "op", iterations, ns});
+    }
+    if (enabled("netplay.rollback")) {
+        vector<State> states(Netplay::MAX_ROLLBACK);
+        uint64_t rollbacks = max<uint64_t>(1, frames / Netplay::MAX_ROLLBACK);
+        double ns = measure([&] {
+            for (uint64_t i = 0; i < rollbacks; i++) {
+                loadState(state);
+                setRender(false);
+                for (auto& frameState : states) {
+                    saveState(frameState);
+                    stepFrame();
+                }
+                setRender(true);
+            }
+        });
+        results.push_back({"netplay.rollback", "op", rollbacks, ns});
+    }
+}
+
+// observations for learning agents against the RGBA conversion they replace, on the frame of the game loop
+void benchmarkObservation() {
+    const struct {
+        const char* name;
+        Observation::Mode mode;
+        uint32_t width, height;
+    } observations[] = {
+        {"observation.grey84x84", Observation::Grey, 84, 84},
+        {"observation.grey128x120", Observation::Grey, 128, 120},
+        {"observation.index84x84", Observation::Index, 84, 84},
+    };
+    bool any = enabled("screen.rgba");
+    for (auto& o : observations) {
+        any |= enabled(o.name);
+    }
+    if (!any) {
+        return;
+    }
+    insertGameLoop();
+    stepFrame();
+    const uint64_t iterations = 1000;
+    if (enabled("screen.rgba")) {
+        vector<uint32_t> rgba(SCREEN_WIDTH * SCREEN_HEIGHT);
+        double ns = measure([&] {
+            for (uint64_t i = 0; i < iterations; i++) {
+                ppu->convertScreen(rgba.data());
+            }
+        });
+        results.push_back({"screen.rgba", "op", iterations, ns});
+    }
+    for (auto& o : observations) {
+        if (!enabled(o.name)) {
+            continue;
+        }
+        Observation observation(o.mode, o.width, o.height, 4);
+        double ns = measure([&] {
+            for (uint64_t i = 0; i < iterations; i++) {
+                observation.update();
+            }
+        });
+        results.push_back({o.name, "op", iterations, ns});
+    }
+}
+
+// one filter of a RAM search, snapshot included, with the word compares that need the most lanes
+void benchmarkRamSearch() {
+    if (!enabled("ram.search")) {
+        return;
+    }
+    insertGameLoop();
+    stepFrame();
+    RamSearch search(currentSession());
+    RamSearch::Predicate changed;
+    changed.compare = RamSearch::NotEqual;
+    changed.previous = true;
+    changed.size = RamSearch::Word;
+    const uint64_t iterations = 10000;
+    double ns = measure([&] {
+        for (uint64_t i = 0; i < iterations; i++) {
+            search.filter(changed);
+        }
+    });
+    results.push_back({"ram.search", "op", iterations, ns});
+}
+
+string toJSON() {
+    ostringstream out;
+    out << fixed << setprecision(2);
+    out << "{\n  \"frames\": " << frames << ",\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        auto& r = results[i];
+        out << (i ? "," : "") << "\n    {\"name\": \"" << r.name << "\", \"unit\": \"" << r.unit << "\", \"iterations\": " << r.iterations
+            << ", \"ns_total\": " << (uint64_t)r.ns << ", \"ns_per_iteration\": " << r.ns / r.iterations;
+        if (r.frames) {
+            out << ", \"cycles_per_frame\": " << r.cyclesPerFrame << ", \"ns_per_frame\": " << r.ns / r.frames;
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+    return out.str();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    string output;
+    const struct option table[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"frames", required_argument, NULL, 'f'},
+        {"filter", required_argument, NULL, 'F'},
+        {"output", required_argument, NULL, 'o'},
+        {0, 0, NULL, 0},
+    };
+
+    auto displayHelpMessage = [&]() {
+        printf("Usage: %s [OPTION...]\n\n", argv[0]);
+        printf("\t-h,--help\t\tDisplay available options\n");
+        printf("\t-f,--frames N\t\tEmulated frames per benchmark (default 120)\n");
+        printf("\t-F,--filter NAME\tOnly run benchmarks whose name contains NAME\n");
+        printf("\t-o,--output FILE\tWrite the JSON report to FILE instead of stdout\n");
+        printf("\n");
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hf:F:o:", table, NULL)) != -1) {
+        switch (opt) {
+            case 'h':
+                displayHelpMessage();
+                return 0;
+            case 'f':
+                frames = stoull(optarg);
+                break;
+            case 'F':
+                filter = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                return 1;
+        }
+    }
+
+    init();
+
+    benchmarkBus();
+    benchmarkOpcodes();
+    benchmarkPPU();
+    benchmarkAPU();
+    benchmarkFrame();
+    benchmarkState();
+    benchmarkObservation();
+    benchmarkRamSearch();
+
+    if (output.empty()) {
+        cout << toJSON();
+    } else {
+        ofstream(output) << toJSON();
+    }
+    return 0;
+}
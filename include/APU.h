@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
-#include <vector>
+
+#include "State.h"
 
 namespace NebulaEmu {
 
@@ -13,7 +15,15 @@ public:
 
     void step();
 
-    std::vector<uint8_t> &getBuffer() { return _buffer; }
+    // ring of 8-bit samples owned by the session, size is a power of two
+    void setBuffer(uint8_t *buffer, size_t size) {
+        _buffer = buffer;
+        _bufferSize = size;
+    }
+
+    const uint8_t *getBuffer() { return _buffer; }
+
+    size_t getBufferSize() { return _bufferSize; }
 
     uint64_t getSampleIndex() { return _sampleIndex; }
 
@@ -55,6 +65,14 @@ public:
 
     void writeFrameCounter(uint8_t data);
 
+    // scheduled events, time is when they were due
+    void frameCounterStep(uint64_t time);
+
+    void clockDMC(uint64_t time);
+
+    // the audio ring is output and not saved, the sample index is so re-simulated frames overwrite their samples
+    void serialize(State& state);
+
 private:
     struct Envelope {
         bool start;
@@ -126,7 +144,7 @@ private:
         uint8_t lengthCounter;
 
         uint16_t timer;
-        uint8_t shiftReg;
+        uint16_t shiftReg;  // 15 bits
 
         Envelope envelope;
 
@@ -137,9 +155,20 @@ private:
         bool IRQenable;
         bool loop;
         uint8_t frequency;
-        uint8_t loadCounter;
-        uint8_t sampleAddress;
-        uint8_t sampleLength;
+        uint8_t output;  // 7-bit output level
+        uint16_t sampleAddress;
+        uint16_t sampleLength;
+
+        // memory reader
+        uint16_t currentAddress;
+        uint16_t bytesRemaining;
+        uint8_t sampleBuffer;
+        bool sampleBufferEmpty;
+
+        // output unit
+        uint8_t shiftReg;
+        uint8_t bitsRemaining;
+        bool silence;
     } _DMC;
 
     union {
@@ -171,19 +200,36 @@ private:
 
     uint8_t calculateDMC();
 
+    // refill the sample buffer through the CPU bus if it is empty and the sample is not finished
+    void fetchDMCSample();
+
+    void acknowledgeDMCIRQ();
+
     void quarterFrameClock();
 
     void halfFrameClock();
 
     void sample();
 
-    uint64_t _cycles = 0;
+    // restart the frame counter sequence at time
+    void startFrameCounter(uint64_t time);
+
+    int _frameStep = 0;
+    uint64_t _frameStart = 0;
+
+    // APU cycles until the next audio sample
+    int _sampleTimer = 0;
+    int _samplePeriod = 20;
+
+    // region timing, chosen at reset
+    const uint16_t *_noiseTimerPeriod;
+    const uint16_t *_frameCounterSteps;
+    const uint16_t *_DMCRateTable;
 
     uint64_t _sampleIndex = 0;
 
-    std::vector<uint8_t> _buffer;
-    std::vector<float> _pulseTable;
-    std::vector<float> _tndTable;
+    uint8_t *_buffer = nullptr;
+    size_t _bufferSize = 0;
 };
 
 }  // namespace NebulaEmu
\ No newline at end of file
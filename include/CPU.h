@@ -2,6 +2,9 @@
 
 #include <cstdint>
 
+#include "State.h"
+#include "Variant.h"
+
 namespace NebulaEmu {
 
 enum InterruptType {
@@ -10,37 +13,100 @@ enum InterruptType {
     BRK_I  // triggered by software
 };
 
+// the devices that can pull the IRQ line, each holds its own bit
+enum IRQSource {
+    FrameCounterIRQ = 1,
+    DMCIRQ = 2,
+    MapperIRQ = 4,
+};
+
 class CPU {
 public:
+    // A = X = Y = 0, SP = $FD, P = $24 and the cycle count restarts after the 7 cycles of the reset sequence
+    void powerOn();
+
+    // the reset button: the registers and the cycle count stay, SP drops by 3, I is set and the 7 cycles of the
+    // sequence pass before the vector at $FFFC runs
     void reset();
 
-    void step();
+    // run instructions from the current cycle until until or the scheduler deadline, the last one may end past them
+    template <class V = DefaultVariant>
+    void run(uint64_t until);
 
     void setNMIPin() { _NMI_pin = true; }
 
-    void setIRQPin() { _IRQ_pin = true; }
+    // IRQ is level triggered: a source holds its bit until it is acknowledged, and the CPU takes an interrupt at every
+    // instruction boundary where some bit is set and I is clear
+    void setIRQ(IRQSource source) { _IRQLines |= source; }
 
-private:
-    uint8_t* getPagePtr(uint16_t addr);
+    void clearIRQ(IRQSource source) { _IRQLines &= ~source; }
+
+    // halt the CPU while a DMA uses the bus (DMC sample fetches)
+    void stall(uint32_t cycles) { _cycles += cycles; }
+
+    // cycles a DMC sample fetch asking for the bus on cycle takes from the CPU, 1 to 4 depending on the access the
+    // instruction run over that cycle makes
+    uint32_t getDMCHaltCycles(uint64_t cycle);
+
+    // the cycle the next instruction starts on
+    uint64_t getCycles() { return _cycles; }
+
+    uint16_t getPC() { return _PC; }
+
+    uint8_t getSP() { return _SP; }
+
+    uint8_t getA() { return _A; }
 
+    uint8_t getX() { return _X; }
+
+    uint8_t getY() { return _Y; }
+
+    uint8_t getP() { return _P.value; }
+
+    // read without side effects, registers read as 0
+    uint8_t peek(uint16_t addr);
+
+    // the 2 KB of internal RAM, $0000-$07FF
+    const uint8_t* getRAM() { return _RAM; }
+
+    // 0 for opcodes that are not implemented
+    static uint32_t getOperationCycles(uint8_t opcode);
+
+    // the debug instances report every access to the debugger, the profile ones count the register accesses
+    template <bool Debug = false, bool Profile = false>
     uint8_t readByte(uint16_t addr);
 
+    template <bool Debug = false, bool Profile = false>
     uint16_t readWord(uint16_t addr);
 
+    template <bool Debug = false, bool Profile = false>
     void write(uint16_t addr, uint8_t data);
 
+    void serialize(State& state);
+
+private:
+    uint8_t* getPagePtr(uint16_t addr);
+
+    template <bool Debug, bool Profile>
     void pushStack(uint8_t data);
 
+    template <bool Debug, bool Profile>
     uint8_t popStack();
 
     void setZN(uint8_t result);
 
     void addSkipCyclesIfPageCrossed(uint16_t cur, uint16_t next);
 
+    template <bool Debug, bool Profile>
     void executeInterrupt(InterruptType type);
 
+    void traceInstruction();
+
+    template <bool Debug, bool Profile>
     bool executeImplied(uint8_t opcode);
+    template <bool Debug, bool Profile>
     bool executeBranch(uint8_t opcode);
+    template <bool Debug, bool Profile>
     bool executeCommon(uint8_t opcode);
 
     uint16_t _PC;
@@ -64,10 +130,21 @@ private:
 
     uint8_t _RAM[0x800];
 
+    // cached at power-on and reset, PRG reads index its banks directly
+    Mapper* _mapper;
+
     bool _NMI_pin;
-    bool _IRQ_pin;
+    // IRQSource bits
+    uint8_t _IRQLines;
 
     uint64_t _cycles = 0;
+    // the last instruction or interrupt (as BRK), which a DMC fetch may land in
+    uint64_t _instructionStart = 0;
+    uint64_t _instructionEnd = 0;
+    uint8_t _instructionOpcode = 0;
+    bool _OAMDMA = false;
+    // page crossings, taken branches and OAM DMA of the current instruction, added to _cycles once it is done so its
+    // accesses all happen on its first cycle
     uint64_t _skipCycles = 0;
 };
 
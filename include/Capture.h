@@ -0,0 +1,124 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Cartridge.h"
+
+namespace NebulaEmu {
+
+// FIFO holding at most capacity items, shared by any number of producers and consumers
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : _capacity(capacity) {}
+
+    // waits while the queue is full
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _notFull.wait(lock, [&] { return _items.size() < _capacity; });
+        _items.push_back(std::move(item));
+        _notEmpty.notify_one();
+    }
+
+    // waits while the queue is empty, false once it is closed and drained
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _notEmpty.wait(lock, [&] { return !_items.empty() || _closed; });
+        if (_items.empty()) {
+            return false;
+        }
+        item = std::move(_items.front());
+        _items.pop_front();
+        _notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        _notEmpty.notify_all();
+    }
+
+private:
+    size_t _capacity;
+    std::deque<T> _items;
+    bool _closed = false;
+    std::mutex _mutex;
+    std::condition_variable _notEmpty;
+    std::condition_variable _notFull;
+};
+
+// Writes the frames and the audio of a headless run. The video is a Y4M file (4:4:4, BT.601) or a PNG sequence, the
+// audio an 8-bit mono WAV at the APU sample rate. The emulation thread only compares and copies: a frame identical to
+// the previous one is not copied again (a Y4M repeats its last frame, a PNG sequence skips the file, the numbers in the
+// names keep the timing), and conversion, compression and writes run on background threads. The queues are bounded by
+// a pool of frame buffers, the emulation thread only waits when the writers are that many frames behind.
+class Capture {
+public:
+    // video ends with .y4m or .png (frames go to NAME_000000.png, NAME_000001.png...), audio with .wav, either can be
+    // empty. threads compress PNG frames in parallel. nullptr and an error message if a file can not be opened.
+    static std::unique_ptr<Capture> open(const std::string& video, const std::string& audio, Region region,
+                                         uint32_t threads);
+
+    // drains the queues and completes the files
+    ~Capture();
+
+    Capture(const Capture&) = delete;
+    Capture& operator=(const Capture&) = delete;
+
+    // the frame the PPU just finished, RGBA8888
+    void frame(const uint32_t* pixels);
+
+    // the samples of the APU ring written since the last call
+    void audio(const uint8_t* ring, size_t size, uint64_t sampleIndex);
+
+    uint64_t getFrames() { return _frames; }
+
+    uint64_t getDuplicates() { return _duplicates; }
+
+    static constexpr size_t QUEUE_FRAMES = 32;
+
+private:
+    // an empty frame repeats the previous one
+    struct Frame {
+        uint64_t number;
+        std::vector<uint32_t> pixels;
+    };
+
+    Capture() = default;
+
+    void writeY4M();
+
+    void writePNG();
+
+    void writeWAV();
+
+    Region _region = NTSC;
+
+    // emulation thread side
+    std::vector<uint32_t> _previous;
+    uint64_t _frames = 0;
+    uint64_t _duplicates = 0;
+    uint64_t _sampleIndex = 0;
+
+    FILE* _video = nullptr;
+    std::string _pattern;  // PNG path without the extension
+    BoundedQueue<Frame> _queue{QUEUE_FRAMES};
+    BoundedQueue<std::vector<uint32_t>> _free{QUEUE_FRAMES};
+    std::vector<std::thread> _videoThreads;
+
+    FILE* _audio = nullptr;
+    uint64_t _audioBytes = 0;
+    BoundedQueue<std::vector<uint8_t>> _chunks{256};
+    std::thread _audioThread;
+};
+
+}  // namespace NebulaEmu
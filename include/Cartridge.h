@@ -1,30 +1,70 @@
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "Mapper.h"
+#include "RomCache.h"
+#include "SaveFile.h"
 
 namespace NebulaEmu {
 
 #define DeclareFriend(Mapper) friend class Mapper
 
+// NES 2.0 CPU/PPU timing
+enum Region { NTSC, PAL, MultiRegion, Dendy };
+
+// host nanoseconds of a frame, 60.0988 and 50.007 frames per second
+inline uint64_t frameNanoseconds(Region region) { return region == PAL ? 19997194 : 16639267; }
+
 class Cartridge {
 public:
+    ~Cartridge();
+
+    // a cartridge already loaded is released first, its save written back
     void load(std::string path);
 
     Mapper* getMapper() { return _mapper; }
 
+    Region getRegion() { return _region; }
+
+    // $6000-$7FFF, at least 8 KB
+    const uint8_t* getPRGRAM() { return _PRG_RAM; }
+
+    uint32_t getPRGRAMSize() { return _PRG_RAM_size; }
+
+    // PRG RAM, CHR RAM and the mapper registers
+    void serialize(State& state);
+
     DeclareFriend(Mapper);
     DeclareFriend(MapperNROM);
+    DeclareFriend(MapperMMC1);
+    DeclareFriend(MapperUxROM);
+    DeclareFriend(MapperCNROM);
+    DeclareFriend(MapperMMC3);
 
 private:
+    // the mapper, PRG RAM, save file and image of the loaded game
+    void release();
+
     NameTableMirroring _mirroring;
-    uint8_t* _battery_backed_RAM = nullptr;
-    uint8_t* _trainer = nullptr;
-    std::vector<uint8_t> _PRG_ROM;  // 16384 * x bytes
-    std::vector<uint8_t> _CHR_ROM;  // 8192 * y bytes
+    bool _battery = false;
+    uint32_t _mapperNumber = 0;
+    uint8_t _submapper = 0;
+    Region _region = NTSC;
+
+    // $6000-$7FFF, points into _save if this cartridge owns the .sav file
+    uint8_t* _PRG_RAM = nullptr;
+    uint32_t _PRG_RAM_size = 0;
+    std::unique_ptr<SaveFile> _save;
+
+    // PRG and CHR ROM point into the mapped file, shared with every cartridge of the same game
+    std::shared_ptr<const RomImage> _image;
+    RomSpan _PRG_ROM;  // 16384 * x bytes
+    RomSpan _CHR_ROM;  // 8192 * y bytes
+    std::vector<uint8_t> _CHR_RAM;  // if the cartridge has no CHR ROM
     Mapper* _mapper = nullptr;
 };
 
-}  // namespace NebulaEmu
\ No newline at end of file
+}  // namespace NebulaEmu
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace NebulaEmu {
+
+// Game Genie codes, ROM patches and RAM freezes of a session. A patch is baked into copies of the 8 KB PRG banks it
+// hits, which the mapper maps in place of the ROM bank, so reads still index a bank pointer and sessions without
+// cheats run the same code. Freezes are a scheduler event once per frame, only pending while there are some.
+class Cheats {
+public:
+    // replace the byte read at address ($8000-$FFFF), only in banks holding compare there if it is not -1
+    struct Patch {
+        uint16_t address;
+        uint8_t value;
+        int compare = -1;
+    };
+
+    // 6 or 8 letters of APZLGITYEOXUKSVN, false if the code is not one
+    static bool decode(const std::string& code, Patch& patch);
+
+    // false and an error message if the code is invalid
+    bool addGameGenie(const std::string& code);
+
+    void addPatch(const Patch& patch);
+
+    // write value to address ($0000-$07FF RAM or $6000-$7FFF PRG RAM) every frame, false and an error message if the
+    // address is neither
+    bool addFreeze(uint16_t address, uint8_t value);
+
+    void clear();
+
+    bool empty() { return _patches.empty() && _freezes.empty(); }
+
+    // patch the banks of the loaded cartridge and start the freezes, after a power on or reset
+    void reset();
+
+    // scheduler handler, time is when the event was due
+    void freeze(uint64_t time);
+
+private:
+    struct Freeze {
+        uint16_t address;
+        uint8_t value;
+    };
+
+    // copy the banks again and restart the freezes if a cartridge is loaded
+    void update();
+
+    std::vector<Patch> _patches;
+    std::vector<Freeze> _freezes;
+
+    // the patched bank copies, owned here and mapped by the mapper
+    std::vector<std::unique_ptr<uint8_t[]>> _banks;
+};
+
+// of the current session
+extern Cheats* cheats;
+
+}  // namespace NebulaEmu
@@ -4,6 +4,8 @@
 
 #include <cstdint>
 
+#include "State.h"
+
 namespace NebulaEmu {
 
 class Controller {
@@ -15,6 +17,13 @@ public:
 
     void update(SDL_Event& e);
 
+    // buttons of joystick 0 or 1, for inputs that do not come from SDL events
+    uint8_t getButtons(int port) { return port ? _state2 : _state1; }
+
+    void setButtons(int port, uint8_t buttons) { (port ? _state2 : _state1) = buttons; }
+
+    void serialize(State& state) { state(_state1, _shift1, _state2, _shift2, _strobe); }
+
     enum Button { A = 1, B = 2, Select = 4, Start = 8, Up = 16, Down = 32, Left = 64, Right = 128 };
 
 private:
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+
+namespace NebulaEmu {
+
+// Breakpoints, watchpoints and stepping for the current session. The checks only exist in the debug variant of the
+// core (Variant::debug): CPU::run tests the next PC and the debug instances of the CPU bus accesses test the address
+// against a bitmap per kind. The session switches to that variant while a breakpoint or watchpoint is set or a step
+// command runs, and back to the shipping loops, untouched, once everything is cleared.
+//
+// A stop is found while an instruction runs and the command returns before the next instruction starts: a breakpoint
+// stops before the instruction at its address, a watchpoint after the instruction that made the access.
+class Debugger {
+public:
+    enum Bus {
+        CPUBus,
+        PPUBus,  // accesses through PPUDATA ($2007), not the fetches of the rendering
+    };
+
+    enum Access {
+        Read = 1,
+        Write = 2,
+    };
+
+    enum Reason {
+        None,
+        Breakpoint,
+        Watchpoint,
+        Step,   // step or step over done
+        Frame,  // run to frame done
+    };
+
+    struct Stop {
+        Reason reason = None;
+        uint16_t PC = 0;  // of the next instruction
+        // the access of a watchpoint
+        Bus bus = CPUBus;
+        Access access = Read;
+        uint16_t address = 0;
+    };
+
+    void setBreakpoint(uint16_t address, bool enabled = true);
+
+    // access is Read, Write or both; the mirrors of CPU RAM and PPU registers are set along, PPU addresses are taken
+    // modulo $4000
+    void setWatchpoint(Bus bus, uint16_t address, int access, bool enabled = true);
+
+    void clear();
+
+    // run one instruction, interrupts included
+    Stop step();
+
+    // like step, but a JSR returns first
+    Stop stepOver();
+
+    // run until the PPU starts frame or something stops earlier
+    Stop runToFrame(uint64_t frame);
+
+    // true once something stopped the running command or stepFrame(), which then returns early
+    bool stopped() { return _stopped; }
+
+    // forget the last stop, stepFrame() does it when it starts
+    void clearStop() { _stopped = false; }
+
+    // called by the debug variant of CPU::run at every instruction boundary, PC and SP of the next instruction
+    void instruction(uint16_t PC, uint8_t SP) {
+        if (_breakpoints[PC] || _mode != Run) {
+            check(PC, SP);
+        }
+    }
+
+    // called by the debug instances of the bus accesses
+    void access(Bus bus, uint16_t address, Access access) {
+        if ((access == Read ? _reads : _writes)[bus][address]) {
+            hit(bus, address, access);
+        }
+    }
+
+private:
+    enum Mode {
+        Run,
+        Stepping,
+        SteppingOver,
+    };
+
+    void check(uint16_t PC, uint8_t SP);
+
+    void hit(Bus bus, uint16_t address, Access access);
+
+    // run until a stop, with the debug variant while needed
+    Stop resume(Mode mode, uint64_t frame);
+
+    // the debug variant is selected while anything is set
+    void update();
+
+    std::bitset<0x10000> _breakpoints;
+    std::bitset<0x10000> _reads[2];
+    std::bitset<0x10000> _writes[2];
+
+    Mode _mode = Run;
+    // step over runs until the instruction after the JSR with the stack back where it was
+    uint16_t _returnPC = 0;
+    uint8_t _returnSP = 0;
+
+    bool _stopped = false;
+    Stop _stop;
+};
+
+// of the current session
+extern Debugger* debugger;
+
+}  // namespace NebulaEmu
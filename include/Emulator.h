@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "APU.h"
+#include "CPU.h"
+#include "Cartridge.h"
+#include "Cheats.h"
+#include "Controller.h"
+#include "Debugger.h"
+#include "PPU.h"
+#include "Scheduler.h"
+#include "State.h"
+
+namespace NebulaEmu {
+
+// RGBA8888 frame of the current session, written at the end of each frame, nullptr in compact sessions
+extern uint32_t* pixels;
+
+// palette index | emphasis << 6 of every pixel, copied at the end of each frame when a consumer allocated it
+extern uint16_t* indices;
+
+extern Cartridge* cartridge;
+extern APU* apu;
+extern CPU* cpu;
+extern PPU* ppu;
+extern Controller* controller;
+
+// Every component of one console in a single allocation: CPU, PPU with an 8-bit palette index screen, APU with its
+// audio ring, cartridge, controllers and cheats, and the RGBA frame unless the session is compact. A debugger is only
+// allocated once attached. The globals above point into the selected session, so a process can hold many consoles and
+// step them one at a time.
+struct Session;
+
+// compact sessions have no RGBA frame (pixels is nullptr, PPU::convertScreen converts on demand) and a short audio ring
+Session* createSession(bool compact = false);
+
+// points the globals at session, nullptr clears them
+void selectSession(Session* session);
+
+Session* currentSession();
+
+void destroySession(Session* session);
+
+// replace the current session with a new one
+void init(bool compact = false);
+
+// the debugger of the current session, made on first use
+Debugger* attachDebugger();
+
+// what the session needs from the core, selects one of the compiled variants
+struct SessionOptions {
+    bool render = true;    // false if nothing looks at the frame buffer
+    bool profile = false;  // run the profiler hooks, needs a build configured with NEBULA_PROFILE
+    bool trace = false;    // feed every instruction to the tracer, which has to be set
+    bool debug = false;    // check breakpoints and watchpoints, set by the debugger, without profile and trace
+};
+
+// load the cartridge, select the core variant for it and power every component on
+void powerOn(std::string path, SessionOptions options = {});
+
+// press the reset button, the cartridge stays inserted, RAM keeps its content and the CPU its registers
+void reset();
+
+// cycles APU cycles: 2 CPU cycles and 6 PPU cycles (6.4 on PAL) each, the CPU may end a few cycles ahead
+void step(uint64_t cycles = 1);
+
+// same as step() but the CPU, PPU and APU of every batch are timed for the telemetry
+void stepTimed(uint64_t cycles = 1);
+
+// run until the PPU wraps to the next frame
+void stepFrame();
+
+// Within a batch the CPU runs ahead of the PPU and APU up to the next scheduled event. It calls catchUp before it
+// touches their registers or the mapper, and rescheduleRaster after a write that can move the next PPU event.
+void catchUp(uint64_t cycle);
+
+void rescheduleRaster();
+
+// switch to the variant with or without pixel composition, e.g. for frames re-simulated by netplay that nobody sees
+void setRender(bool render);
+
+// switch to the variant checking the breakpoints and watchpoints of the debugger, which does it itself
+void setDebug(bool debug);
+
+// snapshot of every component, the cartridge has to be the one the state was saved with
+void saveState(State& state);
+
+// false and an error message if the state is not one of the loaded cartridge, the session is then unchanged
+bool loadState(State& state);
+
+// the parts of the state hashed on their own, in snapshot order; Timing is the scheduler and the PAL phase, Cartridge
+// the mapper registers with PRG and CHR RAM
+enum StateComponent { TimingState, CPUState, PPUState, APUState, InputState, CartridgeState, STATE_COMPONENTS };
+
+const char* getComponentName(int component);
+
+// 64-bit hashes of what a snapshot holds, to compare runs frame by frame without keeping their states
+struct StateHash {
+    uint64_t components[STATE_COMPONENTS];
+    uint64_t machine;  // of the component hashes
+
+    bool operator==(const StateHash& other) const { return machine == other.machine; }
+    bool operator!=(const StateHash& other) const { return machine != other.machine; }
+};
+
+// hash the current session, state is a scratch buffer kept between frames so hashing does not allocate
+void hashState(State& state, StateHash& hash);
+
+}  // namespace NebulaEmu
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace NebulaEmu {
+
+// Fast non-cryptographic 64-bit hash. The input is consumed 32 bytes at a time in 4 lanes of 64 bits with the
+// 32x32->64 multiply of xxHash3, two SSE2 registers (pmuludq) when the build has SSE2 and the same result in scalar
+// code otherwise; the tail and the final mix are xxHash64-style. The output is compatible with neither.
+uint64_t hash64(const void* data, size_t size, uint64_t seed = 0);
+
+}  // namespace NebulaEmu
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include "Emulator.h"
+
+namespace NebulaEmu {
+
+// Determinism checks: two runs fed the same joystick input are compared by their state hash after every frame, and the
+// first frame that differs is reported with the components that differ. The runs are either two sessions of this
+// process, e.g. a compact and a full one, or this run against a hash log another build wrote, which keeps 48 bytes per
+// frame instead of a snapshot.
+class Lockstep {
+public:
+    struct Divergence {
+        uint64_t frame = UINT64_MAX;  // counted from 0 when the check starts, UINT64_MAX while the runs agree
+        uint32_t components = 0;      // a bit per StateComponent that differs
+
+        bool found() const { return frame != UINT64_MAX; }
+
+        // "frame 1234 (CPU, PPU)"
+        std::string describe() const;
+    };
+
+    // the buttons of port at frame, a pseudo-random pattern held for 8 frames so games get past their menus, the same
+    // in every build
+    static uint8_t input(uint64_t seed, uint64_t frame, int port);
+
+    // run frames frames on two sessions powered on with the same cartridge, until the first divergence
+    static Divergence compare(Session* a, Session* b, uint64_t frames, uint64_t seed);
+
+    // write the hashes of the current session to a new log, nullptr and an error message if it can not be created
+    static std::unique_ptr<Lockstep> record(const std::string& path, uint64_t seed);
+
+    // compare the current session with a log, which gives the seed; nullptr and an error message if it is not one
+    static std::unique_ptr<Lockstep> check(const std::string& path);
+
+    ~Lockstep();
+
+    Lockstep(const Lockstep&) = delete;
+    Lockstep& operator=(const Lockstep&) = delete;
+
+    // set both joysticks of the current session for the next frame
+    void setInput();
+
+    // after stepFrame(), hash the current session and write or compare it; false once a check diverged
+    bool frame();
+
+    // frames recorded, or checked against the log, which may end before the run
+    uint64_t getFrames() { return _frames; }
+
+    const Divergence& getDivergence() { return _divergence; }
+
+private:
+    Lockstep() = default;
+
+    // a log record is the component hashes of a frame
+    static constexpr uint32_t RECORD_SIZE = sizeof(uint64_t) * STATE_COMPONENTS;
+
+    FILE* _file = nullptr;
+    bool _checking = false;
+    uint64_t _seed = 0;
+    // the next frame to run, and of those before it the frames written or checked
+    uint64_t _frame = 0;
+    uint64_t _frames = 0;
+    State _state;
+    Divergence _divergence;
+};
+
+}  // namespace NebulaEmu
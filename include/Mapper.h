@@ -1,35 +1,184 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
+
+#include "State.h"
 
 namespace NebulaEmu {
 
-enum NameTableMirroring { Horizontal, Vertical, SingleScreen, FourScreen };
+enum NameTableMirroring { Horizontal, Vertical, SingleScreenLower, SingleScreenUpper, FourScreen };
 
+// The CPU sees PRG through 4 banks of 8 KB ($8000-$FFFF) and the PPU sees CHR through 8 banks of 1 KB ($0000-$1FFF).
+// Reads index the bank pointers directly, a mapper only rewrites the pointers when one of its registers is written.
 class Mapper {
 public:
     static Mapper* createMapper(uint32_t num);
 
-    virtual uint8_t readPRG(uint16_t addr) = 0;
-    virtual uint8_t readCHR(uint16_t addr) = 0;
+    virtual ~Mapper() = default;
+
+    // point the banks at the power-on layout, called once the cartridge is loaded
+    virtual void reset() = 0;
 
-    virtual void wirtePRG(uint16_t addr, uint8_t data) = 0;
-    virtual void wirteCHR(uint16_t addr, uint8_t data) = 0;
+    uint8_t readPRG(uint16_t addr) { return _PRGBanks[(addr >> 13) & 0x3][addr & 0x1FFF]; }
+    uint8_t readCHR(uint16_t addr) { return _CHRBanks[addr >> 10][addr & 0x3FF]; }
+
+    // writes to $8000-$FFFF go to the mapper registers
+    virtual void writePRG(uint16_t addr, uint8_t data) = 0;
+    // CHR ROM banks redirect writes to a scratch page, so no check is needed here
+    void writeCHR(uint16_t addr, uint8_t data) { _CHRWriteBanks[addr >> 10][addr & 0x3FF] = data; }
 
     uint8_t* getSRAMPtr(uint16_t addr);
     uint8_t readSRAM(uint16_t addr);
     void writeSRAM(uint16_t addr, uint8_t data);
 
-    NameTableMirroring getNameTableMirroing();
+    NameTableMirroring getNameTableMirroing() { return _mirroring; }
+
+    // index of the 8 KB PRG ROM bank mapped at addr
+    uint32_t getPRGBank(uint16_t addr) { return _PRGBankNumbers[(addr >> 13) & 0x3]; }
+
+    uint32_t getPRGBankCount();
+
+    // the 8 KB bank of PRG ROM as in the file
+    const uint8_t* getPRGROM(uint32_t bank);
+
+    // Reads of bank while it is mapped at slot come from data instead, nullptr restores the ROM. Only bank switches
+    // look at the patches, reads stay a single index.
+    void patchPRGBank(int slot, int bank, const uint8_t* data);
+
+    void clearPRGPatches();
+
+    // true if the mapper counts rising edges of PPU A12 (MMC3 scanline counter)
+    bool watchesA12() { return _watchesA12; }
+
+    // called by the PPU once per A12 rising edge, only if watchesA12()
+    virtual void clockA12() {}
+
+    // rising edges of A12 until the one that raises the IRQ, 0 if none will
+    virtual int getIRQClocks() { return 0; }
+
+    // registers of the mapper, the banks are switched again when loading
+    virtual void serialize(State& state);
+
+protected:
+    // bank numbers wrap around the size of the ROM, negative numbers count from the last bank
+    void setPRGBank8K(int slot, int bank);
+    void setPRGBank16K(int slot, int bank);
+    void setPRGBank32K(int bank);
+
+    void setCHRBank1K(int slot, int bank);
+    void setCHRBank4K(int slot, int bank);
+    void setCHRBank8K(int bank);
+
+    // also repoints the PPU nametable pages
+    void setMirroring(NameTableMirroring mirroring);
+
+    NameTableMirroring _mirroring;
+
+    bool _watchesA12 = false;
+
+private:
+    const uint8_t* _PRGBanks[4];
+    uint32_t _PRGBankNumbers[4];
+    // by slot * bank count + bank, empty without patches
+    std::vector<const uint8_t*> _PRGPatches;
+    const uint8_t* _CHRBanks[8];
+    uint8_t* _CHRWriteBanks[8];
 };
 
+// mapper 0
 class MapperNROM : public Mapper {
 public:
-    uint8_t readPRG(uint16_t addr);
-    uint8_t readCHR(uint16_t addr);
+    void reset();
+
+    void writePRG(uint16_t addr, uint8_t data);
+};
+
+// mapper 1
+class MapperMMC1 : public Mapper {
+public:
+    void reset();
+
+    void writePRG(uint16_t addr, uint8_t data);
+
+    void serialize(State& state);
+
+private:
+    void updateBanks();
+
+    uint8_t _shift;
+    uint8_t _shiftCount;
+
+    // 43210
+    // |||++- Mirroring (0: one-screen, lower bank; 1: one-screen, upper bank; 2: vertical; 3: horizontal)
+    // |++--- PRG ROM bank mode (0, 1: switch 32 KB at $8000; 2: fix first bank at $8000 and switch 16 KB bank at
+    // |      $C000; 3: fix last bank at $C000 and switch 16 KB bank at $8000)
+    // +----- CHR ROM bank mode (0: switch 8 KB at a time; 1: switch two separate 4 KB banks)
+    uint8_t _control;
+    uint8_t _CHRBank0;
+    uint8_t _CHRBank1;
+    uint8_t _PRGBank;
+};
+
+// mapper 2
+class MapperUxROM : public Mapper {
+public:
+    void reset();
+
+    void writePRG(uint16_t addr, uint8_t data);
+
+    void serialize(State& state);
+
+private:
+    // the 16 KB bank at $8000
+    uint8_t _bank = 0;
+};
+
+// mapper 3
+class MapperCNROM : public Mapper {
+public:
+    void reset();
+
+    void writePRG(uint16_t addr, uint8_t data);
+
+    void serialize(State& state);
+
+private:
+    uint8_t _bank = 0;
+};
+
+// mapper 4
+class MapperMMC3 : public Mapper {
+public:
+    MapperMMC3() { _watchesA12 = true; }
+
+    void reset();
+
+    void writePRG(uint16_t addr, uint8_t data);
+
+    void clockA12();
+
+    int getIRQClocks();
+
+    void serialize(State& state);
+
+private:
+    void updateBanks();
+
+    // 76543210
+    // ||||||||
+    // |||||+++- Specify which bank register to update on next write to Bank Data register
+    // |+------- PRG ROM bank mode (0: $8000-$9FFF swappable, $C000-$DFFF fixed to second-last bank;
+    // |                            1: $C000-$DFFF swappable, $8000-$9FFF fixed to second-last bank)
+    // +-------- CHR A12 inversion (0: two 2 KB banks at $0000-$0FFF, four 1 KB banks at $1000-$1FFF;
+    //                              1: two 2 KB banks at $1000-$1FFF, four 1 KB banks at $0000-$0FFF)
+    uint8_t _bankSelect;
+    uint8_t _registers[8];
 
-    void wirtePRG(uint16_t addr, uint8_t data);
-    void wirteCHR(uint16_t addr, uint8_t data);
+    uint8_t _IRQLatch;
+    uint8_t _IRQCounter;
+    bool _IRQReload;
+    bool _IRQEnable;
 };
 
-}  // namespace NebulaEmu
\ No newline at end of file
+}  // namespace NebulaEmu
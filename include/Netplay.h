@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "State.h"
+
+namespace NebulaEmu {
+
+// Unreliable datagrams between the two peers. Packets may be lost, duplicated or reordered, the session resends what
+// was not acknowledged.
+class Transport {
+public:
+    virtual ~Transport() = default;
+
+    virtual void send(const void* data, size_t size) = 0;
+
+    // returns immediately, the size of the packet or 0 if none is waiting
+    virtual size_t receive(void* data, size_t capacity) = 0;
+
+    // "udp:LOCAL_PORT:HOST:PORT" or "unix:LOCAL_PATH:PEER_PATH", nullptr and an error message otherwise
+    static std::unique_ptr<Transport> open(const std::string& spec);
+};
+
+// Two player rollback netplay. Every frame the local input is sent to the peer, the remote input is predicted as the
+// last one received, and the state before the frame is saved. When a remote input arrives for a frame that was
+// already run with a different prediction, that frame's state is loaded and the frames since are run again without
+// composing pixels, all within the current host frame. A peer stops advancing when it is MAX_ROLLBACK frames ahead of
+// the last input it has from the other one.
+class Netplay {
+public:
+    static constexpr uint32_t MAX_ROLLBACK = 8;
+
+    // player is 0 or 1, the joystick the local input goes to; delay frames of local input lag shrink the rollbacks
+    Netplay(std::unique_ptr<Transport> transport, int player, uint32_t delay);
+
+    // runs the next frame with the buttons of joystick 0 as the local input, false if it waits for the peer
+    bool advance();
+
+    // frames run so far, and of these the frames re-simulated after a misprediction
+    uint64_t getFrame() { return _frame; }
+
+    uint64_t getRollbacks() { return _rollbacks; }
+
+    uint64_t getResimulated() { return _resimulated; }
+
+private:
+    static constexpr uint32_t HISTORY = 64;
+
+    void send();
+
+    void receive();
+
+    // save the state before frame, set both joysticks and run it
+    void simulate(uint64_t frame);
+
+    std::unique_ptr<Transport> _transport;
+    int _player;
+
+    // the next frame to run
+    uint64_t _frame = 0;
+
+    // inputs by frame % HISTORY; local inputs are known up to _localCount, remote ones up to _remoteCount
+    uint8_t _local[HISTORY] = {};
+    uint8_t _remote[HISTORY] = {};
+    // the remote input a frame was run with
+    uint8_t _predicted[HISTORY] = {};
+    uint64_t _localCount;
+    uint64_t _remoteCount = 0;
+    // local inputs the peer confirmed
+    uint64_t _acknowledged = 0;
+
+    // first frame run with a wrong prediction
+    uint64_t _rollbackFrom = UINT64_MAX;
+
+    // the state before frame, by frame % (MAX_ROLLBACK + 1)
+    std::vector<State> _states;
+
+    uint64_t _rollbacks = 0;
+    uint64_t _resimulated = 0;
+};
+
+}  // namespace NebulaEmu
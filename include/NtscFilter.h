@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace NebulaEmu {
+
+// Composite video of the NTSC PPU. Every pixel is 8 samples of a square wave on the colour subcarrier (12 samples per
+// cycle), decoded back to YIQ with a luma and a wider chroma window, then to RGB. Decoding is linear and the window
+// spans the previous, current and next pixel, so an output pixel is the sum of 3 precomputed contributions picked by
+// the 9-bit pixel and the subcarrier phase, added 4 pixels at a time with SSE2. Frames are filtered on a worker
+// thread and come out one frame later.
+class NtscFilter {
+public:
+    NtscFilter();
+
+    ~NtscFilter();
+
+    // the buffer the PPU fills first
+    uint16_t* input() { return _input; }
+
+    // hands over a frame of indices and its phase (PPU::getVideoPhase), returns the buffer the PPU fills next
+    uint16_t* submit(uint16_t* frame, int phase);
+
+    // the latest filtered frame, RGBA8888
+    const uint32_t* output();
+
+    // filter on the calling thread
+    void filter(const uint16_t* frame, int phase, uint32_t* out);
+
+private:
+    void workerLoop();
+
+    // [phase / 4][previous, current, next pixel][pixel] = A, B, G, R contribution (x16), the memory order of RGBA8888
+    int16_t _kernels[3][3][512][4];
+
+    // the PPU writes _input, _pending is the latest frame not taken by the worker yet, the worker reads _processing
+    std::vector<uint16_t> _inputs[3];
+    uint16_t* _input;
+    uint16_t* _pending;
+    uint16_t* _processing;
+    int _pendingPhase = 0;
+    bool _hasPending = false;
+
+    // the worker writes _back, _ready is the latest finished frame, output() returns _front
+    std::vector<uint32_t> _outputs[3];
+    uint32_t* _back;
+    uint32_t* _ready;
+    uint32_t* _front;
+    bool _hasReady = false;
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    bool _quit = false;
+    std::thread _worker;
+};
+
+}  // namespace NebulaEmu
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace NebulaEmu {
+
+// Small frames for learning agents, taken from the palette index screen of the PPU so the RGBA frame is never needed
+// and compact sessions work. Grey averages every box of the screen (luma of the palette, emphasis ignored): the luma
+// of two pixels is one lookup, the rows of a box are summed 16 pixels at a time with SSE2 and its columns in pairs or
+// from prefix sums; Index keeps the palette index at the centre of every box. The last stack frames are kept, oldest
+// first, in one contiguous buffer.
+class Observation {
+public:
+    enum Mode {
+        Grey,
+        Index,
+    };
+
+    // width 1-256, height 1-240 and stack at least 1, others are clamped; e.g. 84x84 or 128x120
+    Observation(Mode mode, uint32_t width, uint32_t height, uint32_t stack);
+
+    // downsample the screen of the current session, after stepFrame(); the first frame after a reset fills the stack
+    void update();
+
+    // stack frames of width * height bytes, the oldest first, valid until the next update
+    const uint8_t* data() { return &_frames[_head * frameSize()]; }
+
+    size_t size() { return frameSize() * _stack; }
+
+    size_t frameSize() { return _width * _height; }
+
+    // a new episode
+    void reset() { _count = 0; }
+
+private:
+    void downsample(uint8_t* out);
+
+    Mode _mode;
+    uint32_t _width;
+    uint32_t _height;
+    uint32_t _stack;
+    // the boxes are all a power of two columns wide, summed in pairs rather than from prefix sums
+    bool _paired;
+    // every box sums to less than 65536, so 16-bit prefix sums give its columns
+    bool _narrow;
+
+    // source columns and rows of every box, boxes + 1 bounds
+    std::vector<uint32_t> _columns;
+    std::vector<uint32_t> _rows;
+    // per output pixel, 2^24 / the pixels in its box
+    std::vector<uint32_t> _reciprocals;
+
+    // every frame is stored twice, at slot i and i + stack, so the stack starting at _head is contiguous
+    std::vector<uint8_t> _frames;
+    uint32_t _head = 0;
+    uint64_t _count = 0;
+};
+
+}  // namespace NebulaEmu
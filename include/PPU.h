@@ -1,19 +1,54 @@
 #pragma once
 
 #include <cstdint>
-#include <vector>
+
+#include "Mapper.h"
+#include "State.h"
+#include "Variant.h"
 
 #define SCREEN_WIDTH 256
 #define SCREEN_HEIGHT 240
 
 namespace NebulaEmu {
 
+// RGBA8888 of the 64 palette indices
+extern const uint32_t systemPalette[64];
+
 class PPU {
 public:
+    // starts at dot 0 of line 0, then resets the registers
+    void powerOn();
+
+    // the reset line clears the registers, the PPU keeps its place in the frame
     void reset();
 
+    template <class V = DefaultVariant>
     void step();
 
+    uint64_t getFrame() { return _frame; }
+
+    int getScanline() { return _scanline; }
+
+    int getDot() { return _cycles; }
+
+    // the address PPUDATA accesses next
+    uint16_t getVRAMAddress() { return _v & 0x3FFF; }
+
+    // palette index (6 bits) of every pixel of the last frame, complete between the end of line 239 and the start of
+    // the next frame, so after stepFrame()
+    const uint8_t* getScreen() { return &_screen[0][0]; }
+
+    // the screen as RGBA8888, SCREEN_WIDTH * SCREEN_HEIGHT pixels
+    void convertScreen(uint32_t* out);
+
+    // Dots to step up to and including the next one the CPU sees without reading a register: the start of vertical
+    // blanking (NMI), the end of the frame and the A12 rise on which the mapper raises its IRQ. An NTSC frame is
+    // assumed to skip its last dot, the count may be early but never late.
+    uint32_t getEventDots();
+
+    // NTSC colour subcarrier phase (0, 4 or 8 out of 12) at the first dot of the frame last copied to indices
+    int getVideoPhase() { return _videoPhase; }
+
     // address 0x2002
     uint8_t readPPUSTATUS();
 
@@ -47,14 +82,33 @@ public:
     // address 0x4014
     void OAMDMA(uint8_t* addr);
 
+    // repoint the nametable pages, called by the mapper whenever the mirroring changes
+    void setMirroring(NameTableMirroring mirroring);
+
+    // the nametable pages are repointed when the mapper state is loaded
+    void serialize(State& state);
+
 private:
     uint8_t read(uint16_t addr);
 
     void write(uint16_t addr, uint8_t data);
 
+    // $2000-$3EFF, nametable and attribute bytes
+    uint8_t& nameTable(uint16_t addr) { return _nameTables[(addr >> 10) & 0x3][addr & 0x3FF]; }
+
     uint16_t addrInc() { return _PPUCTRL.bits.I == 0 ? 1 : 32; }
 
-    bool renderEnable() { return _PPUMASK.bits.b & _PPUMASK.bits.s; }
+    // rendering runs if either the background or the sprites are enabled
+    bool renderEnable() { return _PPUMASK.bits.b || _PPUMASK.bits.s; }
+
+    // background shift registers and fetches of the visible and pre-render lines
+    void stepBackground();
+    // fetch the tile at _v into the low bytes of the shift registers and increment coarse X
+    void fetchTile();
+    // at dot 256
+    void incrementY();
+
+    void updateA12Dot();
 
     union {
         struct {
@@ -110,17 +164,46 @@ private:
 
     uint8_t _OAMADDR;
 
-    // NameTable0 begin at 0, NameTable1 begin at 0x400
-    uint8_t _VRAM[0x800];
+    // PPUDATA reads below the palette return the previous read
+    uint8_t _dataBuffer = 0;
+
+    // background shift registers, the high byte holds the tile being drawn and the low byte the next one
+    uint16_t _bgPatternLow;
+    uint16_t _bgPatternHigh;
+    // the palette bits of each tile expanded to 8 pixels
+    uint16_t _bgAttributeLow;
+    uint16_t _bgAttributeHigh;
+
+    // cached at reset, CHR fetches index its banks directly
+    Mapper* _mapper;
+
+    // dot of the rendering lines where A12 rises for the mapper, -1 if the mapper does not watch A12 or there is no
+    // rising edge with the current pattern table selection
+    int _A12Dot = -1;
+
+    // NameTable0 begin at 0, NameTable1 begin at 0x400; the upper 2 KB are the cartridge VRAM of four-screen boards
+    uint8_t _VRAM[0x1000];
+    // the 1 KB page seen at $2000, $2400, $2800 and $2C00
+    uint8_t* _nameTables[4];
     uint8_t _palette[0x20];
 
     uint8_t _OAM[0x100];
-    std::vector<uint8_t> _secondaryOAM;
-
-    uint32_t _buffer[SCREEN_HEIGHT][SCREEN_WIDTH];
+    // OAM indexes of the sprites on the next line, in OAM order
+    uint8_t _secondaryOAM[8];
+    uint8_t _spriteCount = 0;
+
+    // palette indexes, converted to RGBA only at output
+    uint8_t _screen[SCREEN_HEIGHT][SCREEN_WIDTH];
+    // colour emphasis of each line, taken at its first pixel
+    uint8_t _emphasis[SCREEN_HEIGHT];
+    // subcarrier phase at the first dot of the current frame, and of the frame last copied to indices
+    int _framePhase = 0;
+    int _videoPhase = 0;
 
     int _scanline;
     int _cycles;
+
+    uint64_t _frame = 0;
 };
 
 }  // namespace NebulaEmu
\ No newline at end of file
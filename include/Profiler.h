@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Hooks compile to nothing unless the build is configured with -DNEBULA_PROFILE=ON
+#ifdef NEBULA_PROFILE
+#define PROFILE(event) profiler->event
+#else
+#define PROFILE(event)
+#endif
+
+namespace NebulaEmu {
+
+// Counts what the emulated program makes the console do, to find out which parts of the core a game stresses.
+class Profiler {
+public:
+    Profiler();
+
+    // bank is the 8 KB PRG ROM bank of PC, -1 outside of PRG ROM
+    void instruction(uint16_t PC, uint8_t opcode, uint32_t cycles, int bank) {
+        _frame.opcodeExecutions[opcode]++;
+        _frame.opcodeCycles[opcode] += cycles;
+        _executions[PC]++;
+        if (bank >= 0) {
+            if ((size_t)bank >= _bankExecutions.size()) {
+                _bankExecutions.resize(bank + 1);
+            }
+            _bankExecutions[bank]++;
+        }
+    }
+
+    // $2000-$2007 and $4000-$401F
+    void registerRead(uint16_t addr) { _frame.registerReads[registerIndex(addr)]++; }
+
+    void registerWrite(uint16_t addr) { _frame.registerWrites[registerIndex(addr)]++; }
+
+    void OAMDMA() { _frame.OAMDMA++; }
+
+    void NMI() { _frame.NMI++; }
+
+    void IRQ() { _frame.IRQ++; }
+
+    // called by the PPU when it wraps to the next frame
+    void endFrame();
+
+    void writeJSON(std::ostream& out);
+
+    void writeReport(std::ostream& out);
+
+private:
+    struct Counters {
+        uint64_t opcodeExecutions[0x100];
+        uint64_t opcodeCycles[0x100];
+        uint64_t registerReads[0x28];
+        uint64_t registerWrites[0x28];
+        uint64_t OAMDMA;
+        uint64_t NMI;
+        uint64_t IRQ;
+
+        void add(const Counters& other);
+        uint64_t instructions() const;
+        uint64_t cycles() const;
+    };
+
+    // summary kept for every frame
+    struct FrameSummary {
+        uint64_t instructions;
+        uint64_t cycles;
+        uint64_t registerReads;
+        uint64_t registerWrites;
+        uint64_t OAMDMA;
+        uint64_t NMI;
+        uint64_t IRQ;
+    };
+
+    static uint32_t registerIndex(uint16_t addr) { return addr < 0x4000 ? addr & 0x7 : 8 + (addr & 0x1F); }
+
+    static uint16_t registerAddress(uint32_t index) { return index < 8 ? 0x2000 + index : 0x4000 + index - 8; }
+
+    void writeCounters(std::ostream& out, const Counters& counters);
+
+    Counters _frame;
+    Counters _total;
+    std::vector<FrameSummary> _frames;
+
+    // executions per CPU address and per PRG ROM bank, cumulative
+    std::vector<uint64_t> _executions;
+    std::vector<uint64_t> _bankExecutions;
+};
+
+extern Profiler* profiler;
+
+}  // namespace NebulaEmu
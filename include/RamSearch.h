@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Emulator.h"
+
+namespace NebulaEmu {
+
+// Narrows down where a game keeps a variable: every address of RAM ($0000-$07FF) and PRG RAM ($6000-$7FFF) starts as
+// a candidate, and each filter keeps those whose value compares true against a constant or against the previous
+// snapshot, e.g. "changed" is NotEqual with previous. Candidates are a byte mask over a copy of the memory, compared
+// 16 addresses at a time with SSE2. A search belongs to one session, and the batch filter runs the same predicate
+// over a whole pool, one search after the other on the calling thread since selecting a session repoints the globals.
+class RamSearch {
+public:
+    enum Size {
+        Byte,
+        Word,  // little endian at the address and the next one
+    };
+
+    enum Compare {
+        Equal,
+        NotEqual,
+        Less,
+        Greater,
+        LessEqual,
+        GreaterEqual,
+    };
+
+    struct Predicate {
+        Compare compare = Equal;
+        bool previous = false;  // against the snapshot of the last filter instead of value
+        int32_t value = 0;      // truncated to the size
+        Size size = Byte;
+        bool isSigned = false;
+    };
+
+    // takes the first snapshot of session
+    explicit RamSearch(Session* session);
+
+    // keep the candidates the predicate holds for, the memory becomes the new snapshot, returns how many are left
+    size_t filter(const Predicate& predicate);
+
+    // filter of every search, each on its own session, serially
+    static void filter(const std::vector<RamSearch*>& searches, const Predicate& predicate);
+
+    // CPU addresses in ascending order
+    std::vector<uint16_t> candidates();
+
+    size_t count();
+
+    // every address is a candidate again
+    void restart();
+
+    // the live value of a variable in RAM or PRG RAM of the session, e.g. one the search found, read from the memory
+    // rather than the bus; other addresses read as 0
+    int32_t read(uint16_t address, Size size, bool isSigned);
+
+private:
+    // copy RAM and PRG RAM of the session into out
+    void snapshot(uint8_t* out);
+
+    Session* _session;
+    // RAM then the PRG RAM window, padded for 16 byte loads
+    uint32_t _size;
+    std::vector<uint8_t> _previous;
+    std::vector<uint8_t> _current;
+    // 0xFF for a candidate
+    std::vector<uint8_t> _candidates;
+};
+
+}  // namespace NebulaEmu
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "RomImage.h"
+
+namespace NebulaEmu {
+
+// Process-wide cache of ROM images keyed by content hash. Every session of the same game shares one read-only image,
+// only its mutable state (RAM, VRAM, PRG RAM, CHR RAM, mapper registers) is per session. An image is released when
+// the last cartridge using it goes away. A path opened again with the same size and modification time gets its image
+// back without reading the file.
+class RomCache {
+public:
+    // nullptr if the file can not be opened
+    static std::shared_ptr<const RomImage> acquire(const std::string& path);
+
+    // number of distinct images alive
+    static size_t size();
+};
+
+}  // namespace NebulaEmu
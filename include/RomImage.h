@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace NebulaEmu {
+
+// A ROM file mapped read-only into memory. PRG and CHR ROM point straight into the mapping, nothing is copied.
+class RomImage {
+public:
+    // nullptr if the file can not be opened
+    static std::unique_ptr<RomImage> open(const std::string& path);
+
+    ~RomImage();
+
+    RomImage(const RomImage&) = delete;
+    RomImage& operator=(const RomImage&) = delete;
+
+    const uint8_t* data() const { return _data; }
+
+    size_t size() const { return _size; }
+
+    // hash64 of the whole file
+    uint64_t hash() const { return _hash; }
+
+private:
+    RomImage() = default;
+
+    const uint8_t* _data = nullptr;
+    size_t _size = 0;
+    uint64_t _hash = 0;
+#ifdef _WIN32
+    // no mmap on Windows, the file is read into memory
+    std::vector<uint8_t> _buffer;
+#endif
+};
+
+// read-only view of a part of a RomImage
+struct RomSpan {
+    const uint8_t* ptr = nullptr;
+    size_t length = 0;
+
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    const uint8_t& operator[](size_t i) const { return ptr[i]; }
+};
+
+}  // namespace NebulaEmu
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace NebulaEmu {
+
+// Battery backed PRG RAM mapped from a .sav file. The emulation thread only writes the memory and sets a dirty flag,
+// one background thread shared by every open save file flushes the mappings to disk at most once per
+// FLUSH_INTERVAL_MS while the flag is set. The last flush happens synchronously in the destructor.
+//
+// A file is open once per process: the first cartridge of a game owns the mapping, the others of the same game, e.g.
+// the sessions of a pool, copy it into private PRG RAM on load and are not saved.
+class SaveFile {
+public:
+    static constexpr int FLUSH_INTERVAL_MS = 1000;
+
+    // nullptr if the file can not be opened or mapped, or a cartridge of the process has it open already; a new or
+    // shorter file is zero extended to size
+    static std::unique_ptr<SaveFile> open(const std::string& path, size_t size);
+
+    // true if a cartridge of the process has the file open
+    static bool isOpen(const std::string& path);
+
+    // copy the save into data, from the memory of the cartridge that has it open or else from the file; true if the
+    // file exists or is open
+    static bool read(const std::string& path, uint8_t* data, size_t size);
+
+    ~SaveFile();
+
+    SaveFile(const SaveFile&) = delete;
+    SaveFile& operator=(const SaveFile&) = delete;
+
+    uint8_t* data() { return _data; }
+
+    size_t size() const { return _size; }
+
+    // true if the file did not exist before
+    bool created() const { return _created; }
+
+    // called on every write, only a relaxed store
+    void markDirty() { _dirty.store(true, std::memory_order_relaxed); }
+
+private:
+    SaveFile() = default;
+
+    // open and map the file, once the path is known not to be open
+    static std::unique_ptr<SaveFile> map(const std::string& path, size_t size);
+
+    // the thread flushing every open file, runs until the process exits
+    static void flusher();
+
+    void flush();
+
+    std::string _path;
+    uint8_t* _data = nullptr;
+    size_t _size = 0;
+    bool _created = false;
+#ifdef _WIN32
+    // no mmap on Windows, the whole buffer is written back on flush
+    std::vector<uint8_t> _buffer;
+#endif
+
+    std::atomic<bool> _dirty{false};
+};
+
+}  // namespace NebulaEmu
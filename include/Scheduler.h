@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+
+#include "State.h"
+
+namespace NebulaEmu {
+
+// Timeline of device events in CPU cycles since power on. Devices schedule their next event instead of comparing
+// counters on every cycle, the main loop only checks the earliest timestamp. Each kind has at most one pending event,
+// with this few kinds a slot per kind and a cached minimum beat a heap. The CPU runs in batches up to the next event,
+// the clock moves by APU cycles behind it.
+class Scheduler {
+public:
+    enum Event {
+        FrameCounter,  // APU frame counter step
+        DMC,           // DMC output clock
+        Freeze,        // RAM cheats written once per frame, only scheduled when there are some
+        Raster,        // the PPU raises NMI, ends the frame or clocks the mapper IRQ, it only stops the CPU
+        EventCount
+    };
+
+    static constexpr uint64_t NEVER = UINT64_MAX;
+
+    // drop every event and restart the clock at 0
+    void reset();
+
+    uint64_t now() { return _now; }
+
+    // replaces the pending event of the same kind
+    void schedule(Event event, uint64_t time);
+
+    void cancel(Event event);
+
+    bool pending(Event event) { return _times[event] != NEVER; }
+
+    // the first CPU cycle that sees the next event: advance(2) runs the events due up to now + 2 before the CPU runs
+    // cycles now and now + 1
+    uint64_t deadline() { return _deadline; }
+
+    void serialize(State& state) {
+        state(_now, _next, _times);
+        if (state.loading()) {
+            updateNext();
+        }
+    }
+
+    // move the clock forward and run the events that are due
+    void advance(uint32_t cycles) {
+        _now += cycles;
+        if (_now >= _next) {
+            dispatch();
+        }
+    }
+
+private:
+    void dispatch();
+
+    void updateNext();
+
+    uint64_t _now = 0;
+    uint64_t _next = NEVER;
+    uint64_t _deadline = NEVER;
+    uint64_t _times[EventCount];
+};
+
+extern Scheduler* scheduler;
+
+}  // namespace NebulaEmu
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+namespace NebulaEmu {
+
+// Snapshot of the console in a flat byte buffer. Every component lists its fields once in serialize(), which copies
+// them into the buffer when saving and back out when loading, in the same order. Pointers are never stored, they are
+// rebuilt from the registers they follow after a load, and the frame buffers are output rather than state.
+class State {
+public:
+    // the buffer keeps its capacity, so saving every frame does not allocate
+    void beginSave() {
+        _data.clear();
+        _loading = false;
+    }
+
+    void beginLoad() {
+        _offset = 0;
+        _loading = true;
+        _failed = false;
+    }
+
+    bool loading() const { return _loading; }
+
+    // a load that ran past the end of the buffer, the fields after that point were left as they were
+    bool failed() const { return _failed; }
+
+    // scalars, enums and arrays of them
+    template <class... T>
+    void operator()(T&... fields) {
+        static_assert((std::is_trivially_copyable_v<T> && ...), "only plain fields can be copied");
+        (field(&fields, sizeof(fields)), ...);
+    }
+
+    void field(void* data, size_t size) {
+        // empty vectors give no pointer to copy from or to
+        if (size == 0) {
+            return;
+        }
+        if (_loading) {
+            if (_failed || size > _data.size() - _offset) {
+                _failed = true;
+                return;
+            }
+            memcpy(data, &_data[_offset], size);
+            _offset += size;
+        } else {
+            size_t end = _data.size();
+            _data.resize(end + size);
+            memcpy(&_data[end], data, size);
+        }
+    }
+
+    const std::vector<uint8_t>& data() const { return _data; }
+
+private:
+    std::vector<uint8_t> _data;
+    size_t _offset = 0;
+    bool _loading = false;
+    bool _failed = false;
+};
+
+}  // namespace NebulaEmu
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace NebulaEmu {
+
+// Host side timing of every frame: where the time goes between two presents, how full the audio ring is and how
+// often the audio callback runs dry. Prints a periodic stats line and/or writes a Chrome trace_event timeline.
+class Telemetry {
+public:
+    enum Section { CPU, PPU, APU, FrameHandoff, TextureUpload, Present, AudioCallback, SectionCount };
+
+    Telemetry(bool stats, const std::string& tracePath);
+
+    ~Telemetry();
+
+    // nanoseconds since the telemetry was created
+    uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start)
+            .count();
+    }
+
+    // a measured span, may be called from the audio thread
+    void add(Section section, uint64_t begin, uint64_t end);
+
+    // CPU, PPU and APU of a batch between two scheduled events, too many to trace; the CPU includes the PPU and APU
+    // run when it touches their registers
+    void addBatch(Section section, uint64_t ns) { _frameBatched[section] += ns; }
+
+    void audioRing(uint64_t fill) { _audioRing = fill; }
+
+    void audioUnderrun() { _underruns++; }
+
+    void audioOverrun() { _overruns++; }
+
+    // called once per host frame, after present
+    void endFrame(uint64_t begin, uint64_t end);
+
+private:
+    void writeEvent(const char* name, int tid, uint64_t begin, uint64_t end);
+
+    static const char* sectionName(Section section);
+
+    bool _stats;
+    std::ofstream _trace;
+    bool _firstEvent = true;
+
+    std::chrono::steady_clock::time_point _start;
+
+    // accumulated since the last stats line
+    std::atomic<uint64_t> _measured[SectionCount] = {};
+    uint64_t _batched[SectionCount] = {};
+    uint64_t _frameBatched[SectionCount] = {};
+    uint64_t _frames = 0;
+    uint64_t _missedDeadlines = 0;
+    uint64_t _lastStats = 0;
+
+    std::atomic<uint64_t> _audioRing{0};
+    std::atomic<uint64_t> _underruns{0};
+    std::atomic<uint64_t> _overruns{0};
+
+    // spans recorded by the audio thread, written by the main thread at the end of the frame
+    std::mutex _pendingMutex;
+    std::vector<std::pair<uint64_t, uint64_t>> _pendingAudio;
+};
+
+// measures the enclosing scope when telemetry is enabled
+class TelemetryScope {
+public:
+    TelemetryScope(Telemetry* telemetry, Telemetry::Section section) : _telemetry(telemetry), _section(section) {
+        if (_telemetry) {
+            _begin = _telemetry->now();
+        }
+    }
+
+    ~TelemetryScope() {
+        if (_telemetry) {
+            _telemetry->add(_section, _begin, _telemetry->now());
+        }
+    }
+
+private:
+    Telemetry* _telemetry;
+    Telemetry::Section _section;
+    uint64_t _begin = 0;
+};
+
+extern Telemetry* telemetry;
+
+}  // namespace NebulaEmu
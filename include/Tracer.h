@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace NebulaEmu {
+
+// State of the CPU before an instruction executes. The binary trace is a "NBTR" magic, a uint32 record size and then
+// these records as they are in memory (little endian).
+#pragma pack(push, 1)
+struct TraceRecord {
+    uint64_t cycle;
+    uint16_t PC;
+    uint8_t bytes[3];  // opcode and the two bytes after it
+    uint8_t A;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t P;
+    uint8_t SP;
+    uint16_t scanline;
+    uint16_t dot;
+};
+#pragma pack(pop)
+
+// Where tracing starts or stops: always, when PC reaches an address, or when the PPU reaches a frame.
+struct TraceTrigger {
+    enum Kind { Never, PC, Frame } kind = Never;
+    uint64_t value = 0;
+
+    // "pc:C000" or "frame:600", false if the text is neither
+    static bool parse(const std::string& text, TraceTrigger& trigger);
+};
+
+// CPU instruction trace. The emulation thread only copies a record into a lock-free single producer/single consumer
+// ring, a writer thread formats and writes the records. The text form follows nestest.log without the memory value
+// annotations (reading them could trigger register side effects); files ending in .bin get the binary form, and a
+// trailing .gz pipes the output through gzip.
+class Tracer {
+public:
+    // nullptr and an error message if the file can not be opened
+    static std::unique_ptr<Tracer> open(const std::string& path, TraceTrigger start, TraceTrigger stop);
+
+    ~Tracer();
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // check the triggers for the instruction at PC, true if it should be recorded
+    bool active(uint16_t PC, uint64_t frame) {
+        if (!_active) {
+            _active = _start.kind == TraceTrigger::Never || (_start.kind == TraceTrigger::PC && PC == _start.value) ||
+                      (_start.kind == TraceTrigger::Frame && frame >= _start.value);
+            // once stopped the trace does not start again
+            _active = _active && !_stopped;
+        } else if ((_stop.kind == TraceTrigger::PC && PC == _stop.value) ||
+                   (_stop.kind == TraceTrigger::Frame && frame >= _stop.value)) {
+            _active = false;
+            _stopped = true;
+        }
+        return _active;
+    }
+
+    // waits for the writer if the ring is full, records are never dropped
+    void push(const TraceRecord& record) {
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        while (head - _cachedTail == CAPACITY) {
+            _cachedTail = _tail.load(std::memory_order_acquire);
+            if (head - _cachedTail == CAPACITY) {
+                std::this_thread::yield();
+            }
+        }
+        _ring[head & (CAPACITY - 1)] = record;
+        _head.store(head + 1, std::memory_order_release);
+    }
+
+    static constexpr uint64_t CAPACITY = 1 << 16;
+
+private:
+    Tracer() = default;
+
+    void writer();
+
+    void write(const TraceRecord& record);
+
+    FILE* _file = nullptr;
+    bool _pipe = false;
+    bool _binary = false;
+
+    TraceTrigger _start;
+    TraceTrigger _stop;
+    bool _active = false;
+    bool _stopped = false;
+
+    std::unique_ptr<TraceRecord[]> _ring;
+    // written by the emulation thread
+    std::atomic<uint64_t> _head{0};
+    uint64_t _cachedTail = 0;
+    // written by the writer thread
+    std::atomic<uint64_t> _tail{0};
+
+    std::atomic<bool> _quit{false};
+    std::thread _thread;
+};
+
+extern Tracer* tracer;
+
+}  // namespace NebulaEmu
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace NebulaEmu {
+
+// Scales the 256x240 frame on the CPU, for hosts without a GPU to stretch the texture. The rows are split in bands,
+// one per worker thread plus the calling thread, and every filter works on 4 pixels at a time with SSE2.
+class Upscaler {
+public:
+    enum Filter {
+        Nearest,
+        Smooth,     // Scale2x, Scale3x, or Scale2x applied twice for 4x
+        Scanlines,  // nearest with the last row of every source row at half brightness
+        CRT,        // scanlines and an RGB aperture mask
+    };
+
+    // scale is 2, 3 or 4
+    Upscaler(Filter filter, uint32_t scale, uint32_t threads);
+
+    ~Upscaler();
+
+    // dst is the locked streaming texture, SCREEN_WIDTH * scale by SCREEN_HEIGHT * scale RGBA8888 pixels, pitch in
+    // bytes. Returns once every band is written.
+    void run(const uint32_t* src, uint32_t* dst, int pitch);
+
+    static bool parse(const std::string& name, Filter& filter);
+
+private:
+    // one source to destination pass over the rows [begin, end) of the source
+    struct Pass {
+        const uint32_t* src;
+        uint32_t width;
+        uint32_t height;
+        uint32_t* dst;
+        uint32_t pitch;  // in pixels
+        uint32_t scale;
+    };
+
+    void dispatch(const Pass& pass);
+
+    void work(uint32_t band, const Pass& pass);
+
+    void workerLoop(uint32_t band);
+
+    void smooth(const Pass& pass, uint32_t begin, uint32_t end, uint32_t* lines);
+
+    void shade(const Pass& pass, uint32_t begin, uint32_t end, uint32_t* line);
+
+    Filter _filter;
+    uint32_t _scale;
+
+    // the first pass of 4x goes through this 512x480 frame
+    std::vector<uint32_t> _half;
+
+    // per output row of a scale block, 4 channel weights (x256) per output pixel, for Scanlines and CRT
+    std::vector<std::vector<uint16_t>> _weights;
+
+    // 3 padded rows per band
+    std::vector<std::vector<uint32_t>> _lines;
+
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::condition_variable _start;
+    std::condition_variable _done;
+    Pass _pass;
+    uint64_t _generation = 0;
+    uint32_t _pending = 0;
+    bool _quit = false;
+};
+
+}  // namespace NebulaEmu
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "Cartridge.h"
+
+namespace NebulaEmu {
+
+// Compile-time configuration of the hot loops (CPU::run, PPU::step and the main loop). Every shipped combination is
+// instantiated once and one is picked when the cartridge is loaded, so a disabled feature costs nothing per cycle.
+template <Region R, bool A12, bool Render, bool Profile, bool Trace, bool Debug>
+struct Variant {
+    static constexpr Region region = R;       // NTSC or PAL timing
+    static constexpr bool watchesA12 = A12;   // the mapper counts PPU A12 rising edges (MMC3)
+    static constexpr bool render = Render;    // compose pixels, off when nothing looks at the frame buffer
+    static constexpr bool profile = Profile;  // profiler hooks, only shipped in NEBULA_PROFILE builds
+    static constexpr bool trace = Trace;      // CPU instruction trace
+    static constexpr bool debug = Debug;      // breakpoints, watchpoints and stepping of the debugger
+};
+
+using DefaultVariant = Variant<NTSC, false, true, false, false, false>;
+
+// X(...) is called with every shipped variant to instantiate the templates that take one; it has to be variadic since
+// the template arguments contain commas
+#define NEBULA_VARIANTS_WITH(X, P, T, D) \
+    X(Variant<NTSC, false, true, P, T, D>)  \
+    X(Variant<NTSC, false, false, P, T, D>) \
+    X(Variant<NTSC, true, true, P, T, D>)   \
+    X(Variant<NTSC, true, false, P, T, D>)  \
+    X(Variant<PAL, false, true, P, T, D>)   \
+    X(Variant<PAL, false, false, P, T, D>)  \
+    X(Variant<PAL, true, true, P, T, D>)    \
+    X(Variant<PAL, true, false, P, T, D>)
+
+// the debug variants run without the profiler and the trace
+#ifdef NEBULA_PROFILE
+#define NEBULA_FOR_EACH_VARIANT(X)                                                              \
+    NEBULA_VARIANTS_WITH(X, false, false, false) NEBULA_VARIANTS_WITH(X, false, true, false) \
+    NEBULA_VARIANTS_WITH(X, true, false, false) NEBULA_VARIANTS_WITH(X, true, true, false)   \
+    NEBULA_VARIANTS_WITH(X, false, false, true)
+#else
+#define NEBULA_FOR_EACH_VARIANT(X)                                                              \
+    NEBULA_VARIANTS_WITH(X, false, false, false) NEBULA_VARIANTS_WITH(X, false, true, false) \
+    NEBULA_VARIANTS_WITH(X, false, false, true)
+#endif
+
+}  // namespace NebulaEmu
@@ -5,9 +5,12 @@
 #include <iostream>
 
 #include "CPU.h"
+#include "Cartridge.h"
+#include "Scheduler.h"
 
 namespace NebulaEmu {
 
+extern Cartridge* cartridge;
 extern CPU* cpu;
 
 static uint8_t lengthTable[] = {10, 254, 20, 2,  40, 4,  80, 6,  160, 8,  60, 10, 14, 12, 26, 14,
@@ -16,24 +19,88 @@ static uint8_t lengthTable[] = {10, 254, 20, 2,  40, 4,  80, 6,  160, 8,  60, 10
 static uint8_t triangleSequence[] = {15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5,  4,  3,  2,  1,  0,
                                      0,  1,  2,  3,  4,  5,  6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
 
-static uint16_t noiseTimerPeriod[] = {4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068};
+// all in CPU cycles, NTSC then PAL
+static uint16_t noiseTimerPeriod[2][16] = {
+    {4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068},
+    {4, 8, 14, 30, 60, 88, 118, 148, 188, 236, 354, 472, 708, 944, 1890, 3778},
+};
+
+static uint16_t frameCounterSteps[2][5] = {
+    {7458, 14914, 22372, 29830, 37282},
+    {8314, 16626, 24940, 33254, 41566},
+};
+
+static uint16_t DMCRateTable[2][16] = {
+    {428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54},
+    {398, 354, 316, 298, 276, 236, 210, 198, 176, 148, 132, 118, 98, 78, 66, 50},
+};
+
+// power on with every channel cleared, so two consoles start in the same state
+APU::APU() : _pulse1(), _pulse2(), _triangle(), _noise(), _DMC(), _State() {
+    // the noise shift register is loaded with 1 at power on, it would stay 0 forever otherwise
+    _noise.shiftReg = 1;
+}
 
-APU::APU() {
-    _pulseTable.push_back(0.0);
-    for (int i = 1; i < 31; i++) {
-        _pulseTable.push_back(95.52 / (8128.0 / i + 100));
-    }
-    _tndTable.push_back(0.0);
-    for (int i = 1; i < 203; i++) {
-        _tndTable.push_back(163.67 / (24329.0 / i + 100));
+// the nonlinear mixer, shared by every APU of the process
+static const struct MixerTables {
+    float pulse[31];
+    float tnd[203];
+
+    MixerTables() {
+        pulse[0] = tnd[0] = 0;
+        for (int i = 1; i < 31; i++) {
+            pulse[i] = 95.52 / (8128.0 / i + 100);
+        }
+        for (int i = 1; i < 203; i++) {
+            tnd[i] = 163.67 / (24329.0 / i + 100);
+        }
     }
+} mixerTables;
+
+void APU::reset() {
+    int PALTiming = cartridge->getRegion() == PAL;
+    _noiseTimerPeriod = noiseTimerPeriod[PALTiming];
+    _frameCounterSteps = frameCounterSteps[PALTiming];
+    _DMCRateTable = DMCRateTable[PALTiming];
+    // the PAL APU runs at 831 kHz
+    _samplePeriod = PALTiming ? 19 : 20;
+
+    _sampleTimer = 0;
+    startFrameCounter(scheduler->now());
+
+    _DMC = {};
+    _DMC.sampleAddress = 0xC000;
+    _DMC.sampleLength = 1;
+    _DMC.sampleBufferEmpty = true;
+    _DMC.bitsRemaining = 8;
+    _DMC.silence = true;
+    scheduler->cancel(Scheduler::DMC);
 }
 
-void APU::reset() { _buffer.resize(65536); }
+void APU::serialize(State& state) {
+    auto envelope = [&](Envelope& e) {
+        state(e.start, e.loop, e.constantVolume, e.volume, e.divider, e.decayLevelCounter, e.output);
+    };
+    for (PulseChannel* pulse : {&_pulse1, &_pulse2}) {
+        state(pulse->sequence, pulse->lengthCounterHalt, pulse->timer, pulse->lengthCounter);
+        envelope(pulse->envelope);
+        auto& sweep = pulse->sweep;
+        state(sweep.reload, sweep.enable, sweep.negate, sweep.period, sweep.shiftCount, sweep.divider, sweep.mute);
+        state(pulse->sequencer.timer, pulse->sequencer.sequence, pulse->sequencer.output);
+    }
+    state(_triangle.lengthCounterHalt, _triangle.counterReload, _triangle.linearCounter, _triangle.timer,
+          _triangle.lengthCounter, _triangle.sequencer.timer, _triangle.sequencer.index, _triangle.linearCounterReload);
+    state(_noise.lengthCounterHalt, _noise.mode, _noise.noisePeriod, _noise.lengthCounter, _noise.timer,
+          _noise.shiftReg);
+    envelope(_noise.envelope);
+    state(_DMC.IRQenable, _DMC.loop, _DMC.frequency, _DMC.output, _DMC.sampleAddress, _DMC.sampleLength,
+          _DMC.currentAddress, _DMC.bytesRemaining, _DMC.sampleBuffer, _DMC.sampleBufferEmpty, _DMC.shiftReg,
+          _DMC.bitsRemaining, _DMC.silence);
+    state(_State.value, _M, _I, _frameStep, _frameStart, _sampleTimer, _sampleIndex);
+}
 
+// The frame counter and the DMC are driven by the scheduler
 void APU::step() {
-    _cycles++;
-
     _pulse1.sequencer.clock(_pulse1.timer);
     _pulse2.sequencer.clock(_pulse2.timer);
 
@@ -44,42 +111,64 @@ void APU::step() {
     _noise.clock();
     _noise.clock();
 
-    if (_cycles == 3729) {
-        quarterFrameClock();
-    } else if (_cycles == 7457) {
-        quarterFrameClock();
-        halfFrameClock();
-    } else if (_cycles == 11186) {
-        quarterFrameClock();
-    } else if (_cycles == 14915) {
-        if (!_M) {
+    // With an audio sampling rate of 441 kHz, approximately one sample is taken every 20 APU cycles.
+    if (++_sampleTimer == _samplePeriod) {
+        _sampleTimer = 0;
+        sample();
+    }
+}
+
+void APU::startFrameCounter(uint64_t time) {
+    _frameStep = 0;
+    _frameStart = time;
+    scheduler->schedule(Scheduler::FrameCounter, _frameStart + _frameCounterSteps[0]);
+}
+
+void APU::frameCounterStep(uint64_t time) {
+    switch (_frameStep) {
+        case 0:
+        case 2:
+            quarterFrameClock();
+            break;
+        case 1:
             quarterFrameClock();
             halfFrameClock();
-            if (!_I) {
-                cpu->setIRQPin();
+            break;
+        case 3:
+            // the 4-step sequence ends here, the 5-step one has an empty step
+            if (!_M) {
+                quarterFrameClock();
+                halfFrameClock();
+                if (!_I) {
+                    _State.bits.F = true;
+                    cpu->setIRQ(FrameCounterIRQ);
+                }
+                startFrameCounter(time);
+                return;
             }
-            _cycles = 0;
-        }
-    } else if (_cycles == 18641) {
-        quarterFrameClock();
-        halfFrameClock();
-        _cycles = 0;
-    }
-
-    // With an audio sampling rate of 441 kHz, approximately one sample is taken every 20 APU cycles.
-    if (_cycles % 20 == 0) {
-        sample();
+            break;
+        case 4:
+            quarterFrameClock();
+            halfFrameClock();
+            startFrameCounter(time);
+            return;
     }
+    _frameStep++;
+    scheduler->schedule(Scheduler::FrameCounter, _frameStart + _frameCounterSteps[_frameStep]);
 }
 
 void APU::sample() {
-    // _buffer[_sampleIndex++ % _buffer.size()] = linearApproximationMix() * 255;
-    _buffer[_sampleIndex++ % _buffer.size()] = lookupTable() * 255;
+    // _buffer[_sampleIndex++ & (_bufferSize - 1)] = linearApproximationMix() * 255;
+    _buffer[_sampleIndex++ & (_bufferSize - 1)] = lookupTable() * 255;
 }
 
 uint8_t APU::readStatus() {
-    uint8_t ret = (_noise.lengthCounter > 0) << 3 | (_triangle.lengthCounter > 0) << 2 |
+    uint8_t ret = _State.bits.I << 7 | _State.bits.F << 6 | (_DMC.bytesRemaining > 0) << 4 |
+                  (_noise.lengthCounter > 0) << 3 | (_triangle.lengthCounter > 0) << 2 |
                   (_pulse2.lengthCounter > 0) << 1 | (_pulse1.lengthCounter > 0);
+    // reading acknowledges the frame interrupt
+    _State.bits.F = false;
+    cpu->clearIRQ(FrameCounterIRQ);
     return ret;
 }
 
@@ -206,7 +295,7 @@ void APU::writeNoiseReg0(uint8_t data) {
 
 void APU::writeNoiseReg2(uint8_t data) {
     _noise.mode = data >> 7;
-    _noise.noisePeriod = noiseTimerPeriod[data & 0x0F];
+    _noise.noisePeriod = _noiseTimerPeriod[data & 0x0F];
 }
 
 void APU::writeNoiseReg3(uint8_t data) {
@@ -218,16 +307,51 @@ void APU::writeDMCReg0(uint8_t data) {
     _DMC.IRQenable = data >> 7;
     _DMC.loop = (data >> 6) & 1;
     _DMC.frequency = data & 0x0F;
+    // If clear, the interrupt flag is cleared
+    if (!_DMC.IRQenable) {
+        acknowledgeDMCIRQ();
+    }
 }
 
-void APU::writeDMCReg1(uint8_t data) { _DMC.loadCounter = data & 0x7F; }
+void APU::writeDMCReg1(uint8_t data) { _DMC.output = data & 0x7F; }
 
-void APU::writeDMCReg2(uint8_t data) { _DMC.sampleAddress = data; }
+// Sample address = %11AAAAAA.AA000000 = $C000 + (A * 64)
+void APU::writeDMCReg2(uint8_t data) { _DMC.sampleAddress = 0xC000 | (data << 6); }
 
-void APU::writeDMCReg3(uint8_t data) { _DMC.sampleLength = data; }
+// Sample length = %LLLL.LLLL0001 = (L * 16) + 1 bytes
+void APU::writeDMCReg3(uint8_t data) { _DMC.sampleLength = (data << 4) | 1; }
 
 void APU::writeStatus(uint8_t data) {
-    _State.value = data & 0x1F;
+    // Writing to this register clears the DMC interrupt flag
+    acknowledgeDMCIRQ();
+    _State.value = (_State.value & 0xE0) | (data & 0x1F);
+
+    // disabling a channel silences it right away
+    if (!_State.bits.P1) {
+        _pulse1.lengthCounter = 0;
+    }
+    if (!_State.bits.P2) {
+        _pulse2.lengthCounter = 0;
+    }
+    if (!_State.bits.T) {
+        _triangle.lengthCounter = 0;
+    }
+    if (!_State.bits.N) {
+        _noise.lengthCounter = 0;
+    }
+
+    // If the DMC bit is clear, the DMC bytes remaining will be set to 0 and the DMC will silence when it empties.
+    // If the DMC bit is set, the DMC sample will be restarted only if its bytes remaining is 0.
+    if (!_State.bits.D) {
+        _DMC.bytesRemaining = 0;
+    } else if (_DMC.bytesRemaining == 0) {
+        _DMC.currentAddress = _DMC.sampleAddress;
+        _DMC.bytesRemaining = _DMC.sampleLength;
+        if (!scheduler->pending(Scheduler::DMC)) {
+            scheduler->schedule(Scheduler::DMC, scheduler->now() + _DMCRateTable[_DMC.frequency]);
+        }
+        fetchDMCSample();
+    }
 
     // side effects
     _pulse1.envelope.start = true;
@@ -237,6 +361,12 @@ void APU::writeStatus(uint8_t data) {
 void APU::writeFrameCounter(uint8_t data) {
     _M = data >> 7;
     _I = (data >> 6) & 1;
+    if (_I) {
+        _State.bits.F = false;
+        cpu->clearIRQ(FrameCounterIRQ);
+    }
+    // writing resets the sequence
+    startFrameCounter(scheduler->now());
     // If the mode flag is set, then both "quarter frame" and "half frame" signals are also generated
     if (_M) {
         quarterFrameClock();
@@ -251,8 +381,8 @@ float APU::linearApproximationMix() {
 }
 
 float APU::lookupTable() {
-    return _pulseTable[calculatePulse(_pulse1) + calculatePulse(_pulse2)] +
-           _tndTable[3 * calculateTriangle() + 2 * calculateNoise() + calculateDMC()];
+    return mixerTables.pulse[calculatePulse(_pulse1) + calculatePulse(_pulse2)] +
+           mixerTables.tnd[3 * calculateTriangle() + 2 * calculateNoise() + calculateDMC()];
 }
 
 uint8_t APU::calculatePulse(PulseChannel& pulse) {
@@ -276,7 +406,66 @@ uint8_t APU::calculateNoise() {
     return _noise.envelope.output;
 }
 
-uint8_t APU::calculateDMC() { return 0; }
+uint8_t APU::calculateDMC() { return _DMC.output; }
+
+void APU::clockDMC(uint64_t time) {
+    scheduler->schedule(Scheduler::DMC, time + _DMCRateTable[_DMC.frequency]);
+
+    if (!_DMC.silence) {
+        // bit 0 of the shift register raises or lowers the level by 2, unless that would leave 0-127
+        if (_DMC.shiftReg & 1) {
+            if (_DMC.output <= 125) {
+                _DMC.output += 2;
+            }
+        } else if (_DMC.output >= 2) {
+            _DMC.output -= 2;
+        }
+    }
+    _DMC.shiftReg >>= 1;
+
+    // a new output cycle starts with the content of the sample buffer
+    if (--_DMC.bitsRemaining == 0) {
+        _DMC.bitsRemaining = 8;
+        _DMC.silence = _DMC.sampleBufferEmpty;
+        if (!_DMC.sampleBufferEmpty) {
+            _DMC.shiftReg = _DMC.sampleBuffer;
+            _DMC.sampleBufferEmpty = true;
+            fetchDMCSample();
+        } else if (_DMC.bytesRemaining == 0) {
+            // nothing left to play, the level holds until a sample is restarted
+            scheduler->cancel(Scheduler::DMC);
+        }
+    }
+}
+
+void APU::fetchDMCSample() {
+    if (!_DMC.sampleBufferEmpty || _DMC.bytesRemaining == 0) {
+        return;
+    }
+    // the DMA asks for the bus on the first CPU cycle of this APU cycle
+    cpu->stall(cpu->getDMCHaltCycles(scheduler->now() - 2));
+    _DMC.sampleBuffer = cpu->readByte(_DMC.currentAddress);
+    _DMC.sampleBufferEmpty = false;
+    // the address wraps around to $8000
+    _DMC.currentAddress = _DMC.currentAddress == 0xFFFF ? 0x8000 : _DMC.currentAddress + 1;
+
+    if (--_DMC.bytesRemaining == 0) {
+        if (_DMC.loop) {
+            _DMC.currentAddress = _DMC.sampleAddress;
+            _DMC.bytesRemaining = _DMC.sampleLength;
+        } else if (_DMC.IRQenable) {
+            _State.bits.I = true;
+            cpu->setIRQ(DMCIRQ);
+        }
+    }
+}
+
+void APU::acknowledgeDMCIRQ() {
+    if (_State.bits.I) {
+        _State.bits.I = false;
+        cpu->clearIRQ(DMCIRQ);
+    }
+}
 
 void APU::Envelope::clock() {
     if (!start) {
@@ -5,8 +5,12 @@
 #include "APU.h"
 #include "Cartridge.h"
 #include "Controller.h"
+#include "Debugger.h"
+#include "Emulator.h"
 #include "Mapper.h"
 #include "PPU.h"
+#include "Profiler.h"
+#include "Tracer.h"
 namespace NebulaEmu {
 
 extern Cartridge* cartridge;
@@ -108,46 +112,174 @@ enum CommonInstruction {
     INC = 7 << 5 | 2
 };
 
-void CPU::reset() {
+uint32_t CPU::getOperationCycles(uint8_t opcode) { return operationCycles[opcode]; }
+
+void CPU::powerOn() {
+    _mapper = cartridge->getMapper();
     _A = _X = _Y = 0;
     _SP = 0XFD;
     _P.value = 0X24;
     _PC = readWord((0xFFFC));
-    _IRQ_pin = _NMI_pin = false;
-    return;
+    _NMI_pin = false;
+    _IRQLines = 0;
+    // the reset sequence runs at power-on too: 7 cycles, in which the PPU gets 21 dots ahead as in nestest.log
+    _cycles = 7;
+    _skipCycles = 0;
+    _instructionStart = _instructionEnd = 0;
+    _instructionOpcode = 0;
+    _OAMDMA = false;
 }
 
-void CPU::step() {
-    _cycles++;
+void CPU::reset() {
+    _mapper = cartridge->getMapper();
+    // the reset sequence is an interrupt whose 3 pushes are reads: the registers stay, SP drops by 3 and I is set
+    _SP -= 3;
+    _P.bits.I = true;
+    _PC = readWord((0xFFFC));
+    _NMI_pin = false;
+    _IRQLines = 0;
+    _cycles += 7;
+}
 
-    if (_skipCycles > 0) {
-        _skipCycles--;
-        return;
+void CPU::serialize(State& state) {
+    state(_PC, _SP, _A, _X, _Y, _P.value, _RAM, _NMI_pin, _IRQLines, _cycles, _skipCycles);
+    state(_instructionStart, _instructionEnd, _instructionOpcode, _OAMDMA);
+}
+
+// The DMC DMA halts the CPU on a read cycle, then takes a dummy cycle and fetches on a cycle of the parity of the
+// APU, possibly after one more: 4 cycles when it asks on a read, and when it waits for writes to finish 3 or 4 after
+// an odd or even number of them. OAM DMA lends it the bus for 2 cycles, 1 on its second-last and 3 on its last.
+uint32_t CPU::getDMCHaltCycles(uint64_t cycle) {
+    if (cycle < _instructionStart || cycle >= _instructionEnd) {
+        // the opcode fetch of the next instruction
+        return 4;
+    }
+    uint32_t position = cycle - _instructionStart;
+    uint32_t length = _instructionEnd - _instructionStart;
+    uint8_t opcode = _instructionOpcode;
+    if (_OAMDMA && position + 1 >= operationCycles[opcode]) {
+        return position + 2 == length ? 1 : position + 1 == length ? 3 : 2;
     }
+    // the first write and the number of them
+    uint32_t first = 0, writes = 0;
+    if (opcode == BRK) {
+        // the return address and P of BRK and interrupts
+        first = 2;
+        writes = 3;
+    } else if (opcode == JSR) {
+        first = 3;
+        writes = 2;
+    } else if ((opcode & 0x07) == 0x06 && (opcode >> 5) != 4 && (opcode >> 5) != 5) {
+        // ASL, ROL, LSR, ROR, DEC and INC on memory write the old value, then the new one
+        first = length - 2;
+        writes = 2;
+    } else if ((opcode & 0xE3) == STA || (opcode & 0xE5) == 0x84 || opcode == PHA || opcode == PHP) {
+        // stores (STY, STA, STX) and pushes
+        first = length - 1;
+        writes = 1;
+    }
+    if (position < first || position >= first + writes) {
+        return 4;
+    }
+    return (first + writes - position) % 2 ? 3 : 4;
+}
 
-    if (_NMI_pin) {
-        _NMI_pin = _IRQ_pin = false;
-        executeInterrupt(NMI_I);
-        // interrupt spend 7 cycles(include this cycle)
-        _skipCycles += 6;
-        return;
-    } else if (_IRQ_pin) {
-        _IRQ_pin = false;
-        executeInterrupt(IRQ_I);
-        // interrupt spend 7 cycles(include this cycle)
-        _skipCycles += 6;
-        return;
+template <class V>
+void CPU::run(uint64_t until) {
+    // the deadline is read again after each instruction, a register write can bring an event forward
+    while (_cycles < until && _cycles < scheduler->deadline()) {
+        _instructionStart = _cycles;
+        _OAMDMA = false;
+        if (_NMI_pin) {
+            _NMI_pin = false;
+            if constexpr (V::profile) {
+                PROFILE(NMI());
+            }
+            executeInterrupt<V::debug, V::profile>(NMI_I);
+            // same bus cycles as BRK
+            _instructionOpcode = BRK;
+            _cycles += 7;
+        } else if (_IRQLines && !_P.bits.I) {
+            if constexpr (V::profile) {
+                PROFILE(IRQ());
+            }
+            executeInterrupt<V::debug, V::profile>(IRQ_I);
+            _instructionOpcode = BRK;
+            _cycles += 7;
+        } else {
+            if constexpr (V::trace) {
+                if (tracer->active(_PC, ppu->getFrame())) {
+                    // the record shows where the PPU is on this cycle
+                    catchUp(_cycles);
+                    traceInstruction();
+                }
+            }
+
+            [[maybe_unused]] uint16_t PC = _PC;
+            uint8_t opcode = readByte<V::debug, V::profile>(_PC++);
+            uint32_t cycleLength = operationCycles[opcode];
+
+            if (!cycleLength || !(executeImplied<V::debug, V::profile>(opcode) ||
+                                  executeBranch<V::debug, V::profile>(opcode) ||
+                                  executeCommon<V::debug, V::profile>(opcode))) {
+                std::cerr << "unkown instruction" << std::endl;
+                exit(1);
+            }
+            cycleLength += _skipCycles;
+            _skipCycles = 0;
+            _cycles += cycleLength;
+            _instructionOpcode = opcode;
+            if constexpr (V::profile) {
+                PROFILE(instruction(PC, opcode, cycleLength, PC >= 0x8000 ? _mapper->getPRGBank(PC) : -1));
+            }
+        }
+        _instructionEnd = _cycles;
+        if constexpr (V::debug) {
+            debugger->instruction(_PC, _SP);
+            if (debugger->stopped()) {
+                return;
+            }
+        }
     }
+}
 
-    uint8_t opcode = readByte(_PC++);
-    uint32_t cycleLength = operationCycles[opcode];
+#define INSTANTIATE_RUN(...) template void CPU::run<__VA_ARGS__>(uint64_t until);
+NEBULA_FOR_EACH_VARIANT(INSTANTIATE_RUN)
 
-    if (cycleLength && (executeImplied(opcode) || executeBranch(opcode) || executeCommon(opcode))) {
-        _skipCycles += cycleLength - 1;
-    } else {
-        std::cerr << "unkown instruction" << std::endl;
-        exit(1);
+uint8_t CPU::peek(uint16_t addr) {
+    if (addr < 0x2000) {
+        return _RAM[addr & 0x7ff];
+    } else if (addr >= 0x8000) {
+        return _mapper->readPRG(addr);
+    } else if (addr >= 0x6000) {
+        return _mapper->readSRAM(addr);
     }
+    return 0;
+}
+
+void CPU::traceInstruction() {
+    TraceRecord record;
+    // the cycles completed before the instruction
+    record.cycle = _cycles;
+    record.PC = _PC;
+    record.bytes[0] = peek(_PC);
+    record.bytes[1] = peek(_PC + 1);
+    record.bytes[2] = peek(_PC + 2);
+    record.A = _A;
+    record.X = _X;
+    record.Y = _Y;
+    record.P = _P.value;
+    record.SP = _SP;
+    // the PPU steps the 6 dots of an APU cycle after both of its CPU cycles, on an odd cycle 3 of them have passed
+    int scanline = ppu->getScanline();
+    int dot = ppu->getDot() + (_cycles & 1) * 3;
+    if (dot >= 341) {
+        dot -= 341;
+        scanline = scanline == (cartridge->getRegion() == PAL ? 311 : 261) ? 0 : scanline + 1;
+    }
+    record.scanline = scanline;
+    record.dot = dot;
+    tracer->push(record);
 }
 
 uint8_t* CPU::getPagePtr(uint16_t addr) {
@@ -161,18 +293,29 @@ uint8_t* CPU::getPagePtr(uint16_t addr) {
         std::cerr << "unsupported addr" << std::endl;
         exit(2);
     } else if (addr < 0x8000) {
-        return cartridge->getMapper()->getSRAMPtr(addr);
+        return _mapper->getSRAMPtr(addr);
     } else {
         std::cerr << "DMA request should not reach here" << std::endl;
         exit(1);
     }
 }
 
+template <bool Debug, bool Profile>
 uint8_t CPU::readByte(uint16_t addr) {
+    if constexpr (Debug) {
+        debugger->access(Debugger::CPUBus, addr, Debugger::Read);
+        if ((addr & 0xE007) == 0x2007) {
+            debugger->access(Debugger::PPUBus, ppu->getVRAMAddress(), Debugger::Read);
+        }
+    }
     if (addr < 0x2000) {
         return _RAM[addr & 0x7ff];
     } else if (addr < 0x4000) {
+        catchUp(_cycles);
         addr &= 0x2007;
+        if constexpr (Profile) {
+            PROFILE(registerRead(addr));
+        }
         switch (addr) {
             case 0x2002:
                 return ppu->readPPUSTATUS();
@@ -185,6 +328,10 @@ uint8_t CPU::readByte(uint16_t addr) {
                 exit(1);
         }
     } else if (addr < 0x4020) {
+        catchUp(_cycles);
+        if constexpr (Profile) {
+            PROFILE(registerRead(addr));
+        }
         if (addr == 0x4016) {
             return controller->readJoyStick1Data();
         } else if (addr == 0x4017) {
@@ -199,26 +346,43 @@ uint8_t CPU::readByte(uint16_t addr) {
         std::cerr << "read unsupported addr" << std::endl;
         exit(2);
     } else if (addr < 0x8000) {
-        return cartridge->getMapper()->readSRAM(addr);
+        return _mapper->readSRAM(addr);
     } else {
-        return cartridge->getMapper()->readPRG(addr);
+        return _mapper->readPRG(addr);
     }
     return 0;
 }
 
-uint16_t CPU::readWord(uint16_t addr) { return (readByte(addr + 1) << 8) | readByte(addr); }
+template <bool Debug, bool Profile>
+uint16_t CPU::readWord(uint16_t addr) {
+    return (readByte<Debug, Profile>(addr + 1) << 8) | readByte<Debug, Profile>(addr);
+}
 
+template <bool Debug, bool Profile>
 void CPU::write(uint16_t addr, uint8_t data) {
+    if constexpr (Debug) {
+        debugger->access(Debugger::CPUBus, addr, Debugger::Write);
+        if ((addr & 0xE007) == 0x2007) {
+            debugger->access(Debugger::PPUBus, ppu->getVRAMAddress(), Debugger::Write);
+        }
+    }
     if (addr < 0x2000) {
         _RAM[addr & 0x7ff] = data;
     } else if (addr < 0x4000) {
+        catchUp(_cycles);
         addr &= 0x2007;
+        if constexpr (Profile) {
+            PROFILE(registerWrite(addr));
+        }
         switch (addr) {
             case 0x2000:
+                // the pattern tables move the A12 rises
                 ppu->writePPUCTRL(data);
+                rescheduleRaster();
                 break;
             case 0x2001:
                 ppu->writePPUCMASK(data);
+                rescheduleRaster();
                 break;
             case 0x2003:
                 ppu->writeOAMADDR(data);
@@ -240,6 +404,10 @@ void CPU::write(uint16_t addr, uint8_t data) {
                 exit(1);
         }
     } else if (addr < 0x4020) {
+        catchUp(_cycles);
+        if constexpr (Profile) {
+            PROFILE(registerWrite(addr));
+        }
         switch (addr) {
             case 0x4000:
                 apu->writePulseReg0(true, data);
@@ -302,8 +470,12 @@ void CPU::write(uint16_t addr, uint8_t data) {
                 apu->writeDMCReg3(data);
                 break;
             case 0x4014:
+                if constexpr (Profile) {
+                    PROFILE(OAMDMA());
+                }
                 _skipCycles += 513;
-                _skipCycles += _cycles & 1;
+                _skipCycles += (_cycles + 1) & 1;
+                _OAMDMA = true;
                 ppu->OAMDMA(getPagePtr(data));
                 break;
             case 0x4015:
@@ -323,15 +495,30 @@ void CPU::write(uint16_t addr, uint8_t data) {
         std::cerr << "write to unsupported addr" << std::endl;
         exit(2);
     } else if (addr < 0x8000) {
-        cartridge->getMapper()->writeSRAM(addr, data);
+        _mapper->writeSRAM(addr, data);
     } else {
-        cartridge->getMapper()->wirtePRG(addr, data);
+        // banks, mirroring and the IRQ counter change what the PPU does next
+        catchUp(_cycles);
+        _mapper->writePRG(addr, data);
+        rescheduleRaster();
     }
 }
 
-void CPU::pushStack(uint8_t data) { _RAM[--_SP | 0x100] = data; }
+template <bool Debug, bool Profile>
+void CPU::pushStack(uint8_t data) {
+    if constexpr (Debug) {
+        debugger->access(Debugger::CPUBus, 0x100 | (uint8_t)(_SP - 1), Debugger::Write);
+    }
+    _RAM[--_SP | 0x100] = data;
+}
 
-uint8_t CPU::popStack() { return _RAM[_SP++ | 0x100]; }
+template <bool Debug, bool Profile>
+uint8_t CPU::popStack() {
+    if constexpr (Debug) {
+        debugger->access(Debugger::CPUBus, 0x100 | _SP, Debugger::Read);
+    }
+    return _RAM[_SP++ | 0x100];
+}
 
 void CPU::setZN(uint8_t result) {
     _P.bits.Z = !result;
@@ -344,68 +531,71 @@ void CPU::addSkipCyclesIfPageCrossed(uint16_t cur, uint16_t next) {
     }
 }
 
+template <bool Debug, bool Profile>
 void CPU::executeInterrupt(InterruptType type) {
     if (_P.bits.I && type == IRQ_I) {
         return;
     }
     if (type == BRK_I) {
-        _P.bits.B = true;
         _PC++;
     }
 
-    pushStack(_PC >> 8);
-    pushStack(_PC & 0xFF);
-    pushStack(_P.value);
+    pushStack<Debug, Profile>(_PC >> 8);
+    pushStack<Debug, Profile>(_PC & 0xFF);
+    // B only exists on the stack, set by BRK and PHP
+    pushStack<Debug, Profile>(_P.value | (type == BRK_I ? 0x30 : 0x20));
     _P.bits.I = true;
     if (type == NMI_I) {
-        _PC = readWord(0xFFFA);
+        _PC = readWord<Debug, Profile>(0xFFFA);
     } else {
-        _PC = readWord(0xFFFE);
+        _PC = readWord<Debug, Profile>(0xFFFE);
     }
 }
 
+template <bool Debug, bool Profile>
 bool CPU::executeImplied(uint8_t opcode) {
     switch (opcode) {
         case BRK:
-            executeInterrupt(BRK_I);
+            executeInterrupt<Debug, Profile>(BRK_I);
             break;
         case JMP:
-            _PC = readWord(_PC);
+            _PC = readWord<Debug, Profile>(_PC);
             break;
         case JMPI: {
-            uint16_t location = readWord(_PC);
+            uint16_t location = readWord<Debug, Profile>(_PC);
             // An original 6502 has does not correctly fetch the target address if the indirect vector falls on a page
             // boundary (e.g. $xxFF where xx is any value from $00 to $FF). In this case fetches the LSB from $xxFF as
             // expected but takes the MSB from $xx00.
-            _PC = readByte(location) | readByte((location & 0xff00) | ((location + 1) & 0xff)) << 8;
+            _PC = readByte<Debug, Profile>(location) |
+                  readByte<Debug, Profile>((location & 0xff00) | ((location + 1) & 0xff)) << 8;
             break;
         }
         case JSR:
-            pushStack((_PC + 1) >> 8);
-            pushStack(_PC + 1);
-            _PC = readWord(_PC);
+            pushStack<Debug, Profile>((_PC + 1) >> 8);
+            pushStack<Debug, Profile>(_PC + 1);
+            _PC = readWord<Debug, Profile>(_PC);
             break;
         case RTI:
-            _P.value = popStack();
-            _PC = popStack();
-            _PC |= popStack() << 8;
+            _P.value = (popStack<Debug, Profile>() & 0xEF) | 0x20;
+            _PC = popStack<Debug, Profile>();
+            _PC |= popStack<Debug, Profile>() << 8;
             break;
         case RTS:
-            _PC = popStack();
-            _PC |= popStack() << 8;
+            _PC = popStack<Debug, Profile>();
+            _PC |= popStack<Debug, Profile>() << 8;
             _PC += 1;
             break;
         case PHP:
-            pushStack(_P.value);
+            pushStack<Debug, Profile>(_P.value | 0x30);
             break;
         case PLP:
-            _P.value = popStack();
+            _P.value = (popStack<Debug, Profile>() & 0xEF) | 0x20;
             break;
         case PHA:
-            pushStack(_A);
+            pushStack<Debug, Profile>(_A);
             break;
         case PLA:
-            _A = popStack();
+            _A = popStack<Debug, Profile>();
             setZN(_A);
             break;
         case DEY:
@@ -476,6 +666,7 @@ bool CPU::executeImplied(uint8_t opcode) {
     return true;
 }
 
+template <bool Debug, bool Profile>
 bool CPU::executeBranch(uint8_t opcode) {
     bool br;
     switch (opcode) {
@@ -507,7 +698,7 @@ bool CPU::executeBranch(uint8_t opcode) {
             return false;
     }
     if (br) {
-        int8_t offset = readByte(_PC++);
+        int8_t offset = readByte<Debug, Profile>(_PC++);
         _skipCycles += 1;
         addSkipCyclesIfPageCrossed(_PC, _PC + offset);
         // uint16_t and int8_t will be promoted to int
@@ -518,6 +709,7 @@ bool CPU::executeBranch(uint8_t opcode) {
     return true;
 }
 
+template <bool Debug, bool Profile>
 bool CPU::executeCommon(uint8_t opcode) {
     uint8_t addressMode = opcode & 0x1f;
     opcode = opcode & 0xe3;
@@ -525,8 +717,9 @@ bool CPU::executeCommon(uint8_t opcode) {
     switch (addressMode) {
         // indexedIndirect
         case 0 << 0 | 1: {
-            uint8_t zeroAddr = readByte(_PC++) + _X;
-            location = readByte(zeroAddr) | readByte(zeroAddr + 1) << 8;
+            uint8_t zeroAddr = readByte<Debug, Profile>(_PC++) + _X;
+            // the pointer wraps around the zero page
+            location = readByte<Debug, Profile>(zeroAddr) | readByte<Debug, Profile>((uint8_t)(zeroAddr + 1)) << 8;
             break;
         }
         // immediate
@@ -539,19 +732,19 @@ bool CPU::executeCommon(uint8_t opcode) {
         case 1 << 2 | 0:
         case 1 << 2 | 1:
         case 1 << 2 | 2:
-            location = readByte(_PC++);
+            location = readByte<Debug, Profile>(_PC++);
             break;
         // absolute
         case 3 << 2 | 0:
         case 3 << 2 | 1:
         case 3 << 2 | 2:
-            location = readWord(_PC);
+            location = readWord<Debug, Profile>(_PC);
             _PC += 2;
             break;
         // indirect indexed
         case 4 << 2 | 1: {
-            uint8_t zeroAddr = readByte(_PC++);
-            location = readByte(zeroAddr) | readByte(zeroAddr + 1) << 8;
+            uint8_t zeroAddr = readByte<Debug, Profile>(_PC++);
+            location = readByte<Debug, Profile>(zeroAddr) | readByte<Debug, Profile>((uint8_t)(zeroAddr + 1)) << 8;
             if (opcode != STA) {
                 addSkipCyclesIfPageCrossed(location, location + _Y);
             }
@@ -563,14 +756,14 @@ bool CPU::executeCommon(uint8_t opcode) {
         case 5 << 2 | 1:
         case 5 << 2 | 2:
             if (opcode == LDX || opcode == STX) {
-                location = (readByte(_PC++) + _Y) & 0xff;
+                location = (readByte<Debug, Profile>(_PC++) + _Y) & 0xff;
             } else {
-                location = (readByte(_PC++) + _X) & 0xff;
+                location = (readByte<Debug, Profile>(_PC++) + _X) & 0xff;
             }
             break;
         // absolute Y
         case 6 << 2 | 1:
-            location = readWord(_PC);
+            location = readWord<Debug, Profile>(_PC);
             _PC += 2;
             if (opcode != STA) {
                 addSkipCyclesIfPageCrossed(location, location + _Y);
@@ -580,7 +773,7 @@ bool CPU::executeCommon(uint8_t opcode) {
         // absolute X
         case 7 << 2 | 0:
         case 7 << 2 | 1:
-            location = readWord(_PC);
+            location = readWord<Debug, Profile>(_PC);
             _PC += 2;
             if (opcode != STA) {
                 addSkipCyclesIfPageCrossed(location, location + _X);
@@ -589,7 +782,7 @@ bool CPU::executeCommon(uint8_t opcode) {
             break;
         // absolute X/Y
         case 7 << 2 | 2: {
-            location = readWord(_PC);
+            location = readWord<Debug, Profile>(_PC);
             _PC += 2;
             uint8_t index;
             if (opcode == LDX) {
@@ -607,42 +800,42 @@ bool CPU::executeCommon(uint8_t opcode) {
     uint16_t operand = 0;
     switch (opcode) {
         case BIT:
-            operand = readByte(location);
+            operand = readByte<Debug, Profile>(location);
             _P.bits.Z = !(_A & operand);
             _P.bits.V = operand & 0x40;
             _P.bits.N = operand & 0x80;
             break;
         case STY:
-            write(location, _Y);
+            write<Debug, Profile>(location, _Y);
             break;
         case LDY:
-            _Y = readByte(location);
+            _Y = readByte<Debug, Profile>(location);
             setZN(_Y);
             break;
         case CPY:
-            operand = _Y - readByte(location);
+            operand = _Y - readByte<Debug, Profile>(location);
             _P.bits.C = !(operand & 0x100);
             setZN(operand);
             break;
         case CPX:
-            operand = _X - readByte(location);
+            operand = _X - readByte<Debug, Profile>(location);
             _P.bits.C = !(operand & 0x100);
             setZN(operand);
             break;
         case ORA:
-            _A |= readByte(location);
+            _A |= readByte<Debug, Profile>(location);
             setZN(_A);
             break;
         case AND:
-            _A &= readByte(location);
+            _A &= readByte<Debug, Profile>(location);
             setZN(_A);
             break;
         case EOR:
-            _A ^= readByte(location);
+            _A ^= readByte<Debug, Profile>(location);
             setZN(_A);
             break;
         case ADC: {
-            operand = readByte(location);
+            operand = readByte<Debug, Profile>(location);
             uint16_t sum = _A + operand + _P.bits.C;
             _P.bits.C = sum & 0x100;
             _P.bits.V = (_A ^ sum) & (operand ^ sum) & 0x80;
@@ -650,19 +843,19 @@ bool CPU::executeCommon(uint8_t opcode) {
             setZN(_A);
         } break;
         case STA:
-            write(location, _A);
+            write<Debug, Profile>(location, _A);
             break;
         case LDA:
-            _A = readByte(location);
+            _A = readByte<Debug, Profile>(location);
             setZN(_A);
             break;
         case CMP:
-            operand = _A - readByte(location);
+            operand = _A - readByte<Debug, Profile>(location);
             _P.bits.C = !(operand & 0x100);
             setZN(operand);
             break;
         case SBC: {
-            operand = readByte(location);
+            operand = readByte<Debug, Profile>(location);
             uint16_t sum = _A - operand - !_P.bits.C;
             _P.bits.C = !(sum & 0x100);
             _P.bits.V = (_A ^ sum) & (~operand ^ sum) & 0x80;
@@ -675,10 +868,10 @@ bool CPU::executeCommon(uint8_t opcode) {
                 _A = _A << 1;
                 setZN(_A);
             } else {
-                operand = readByte(location);
+                operand = readByte<Debug, Profile>(location);
                 _P.bits.C = operand & 0x80;
                 operand = operand << 1;
-                write(location, operand);
+                write<Debug, Profile>(location, operand);
                 setZN(operand);
             }
             break;
@@ -689,10 +882,10 @@ bool CPU::executeCommon(uint8_t opcode) {
                 _A = (_A << 1) | tmp;
                 setZN(_A);
             } else {
-                operand = readByte(location);
+                operand = readByte<Debug, Profile>(location);
                 _P.bits.C = operand & 0x80;
                 operand = (operand << 1) | tmp;
-                write(location, operand);
+                write<Debug, Profile>(location, operand);
                 setZN(operand);
             }
         } break;
@@ -702,10 +895,10 @@ bool CPU::executeCommon(uint8_t opcode) {
                 _A = _A >> 1;
                 setZN(_A);
             } else {
-                operand = readByte(location);
+                operand = readByte<Debug, Profile>(location);
                 _P.bits.C = operand & 1;
                 operand = operand >> 1;
-                write(location, operand);
+                write<Debug, Profile>(location, operand);
                 setZN(operand);
             }
             break;
@@ -716,28 +909,28 @@ bool CPU::executeCommon(uint8_t opcode) {
                 _A = (_A >> 1) | (tmp << 7);
                 setZN(_A);
             } else {
-                operand = readByte(location);
+                operand = readByte<Debug, Profile>(location);
                 _P.bits.C = operand & 1;
                 operand = (operand >> 1) | (tmp << 7);
-                write(location, operand);
+                write<Debug, Profile>(location, operand);
                 setZN(operand);
             }
         } break;
         case STX:
-            write(location, _X);
+            write<Debug, Profile>(location, _X);
             break;
         case LDX:
-            _X = readByte(location);
+            _X = readByte<Debug, Profile>(location);
             setZN(_X);
             break;
         case DEC:
-            operand = readByte(location) - 1;
-            write(location, operand);
+            operand = readByte<Debug, Profile>(location) - 1;
+            write<Debug, Profile>(location, operand);
             setZN(operand);
             break;
         case INC:
-            operand = readByte(location) + 1;
-            write(location, operand);
+            operand = readByte<Debug, Profile>(location) + 1;
+            write<Debug, Profile>(location, operand);
             setZN(operand);
             break;
         default:
@@ -745,4 +938,9 @@ bool CPU::executeCommon(uint8_t opcode) {
     }
     return true;
 }
-}  // namespace NebulaEmu
\ No newline at end of file
+// the bus accesses used outside of CPU::run
+template uint8_t CPU::readByte<false, false>(uint16_t addr);
+template uint16_t CPU::readWord<false, false>(uint16_t addr);
+template void CPU::write<false, false>(uint16_t addr, uint8_t data);
+
+}  // namespace NebulaEmu
@@ -0,0 +1,425 @@
+#include "Capture.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "PPU.h"
+
+namespace NebulaEmu {
+
+namespace {
+
+bool endsWith(const std::string& text, const char* suffix) {
+    size_t length = strlen(suffix);
+    return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+}
+
+// NTSC: 236.25 MHz / 11 / 4 PPU clock and 89341.5 dots per frame, PAL: 26.601712 MHz / 5 and 341 * 312 dots
+const char* frameRate(Region region) { return region == PAL ? "3325214:66495" : "118125000:1965513"; }
+
+// one sample every 20 APU cycles (19 on PAL)
+uint32_t sampleRate(Region region) { return region == PAL ? 43753 : 44744; }
+
+void put32(std::vector<uint8_t>& out, uint32_t value) {
+    out.push_back(value >> 24);
+    out.push_back(value >> 16);
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0) {
+    static uint32_t table[256];
+    static bool ready = [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int bit = 0; bit < 8; bit++) {
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)ready;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint32_t adler32(const uint8_t* data, size_t size) {
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < size;) {
+        // 5552 bytes keep b below 2^32 before the modulo
+        size_t end = std::min(size, i + 5552);
+        for (; i < end; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+// LSB first, Huffman codes are stored reversed
+struct BitWriter {
+    std::vector<uint8_t>& out;
+    uint64_t bits = 0;
+    int count = 0;
+
+    void put(uint32_t value, int length) {
+        bits |= (uint64_t)value << count;
+        count += length;
+        while (count >= 8) {
+            out.push_back(bits);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    void putCode(uint32_t code, int length) {
+        uint32_t reversed = 0;
+        for (int i = 0; i < length; i++) {
+            reversed |= (code >> i & 1) << (length - 1 - i);
+        }
+        put(reversed, length);
+    }
+
+    void flush() {
+        if (count > 0) {
+            out.push_back(bits);
+        }
+        bits = 0;
+        count = 0;
+    }
+};
+
+const uint16_t lengthBase[29] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t distanceBase[30] = {1,    2,    3,    4,    5,    7,     9,     13,    17,    25,
+                                   33,   49,   65,   97,   129,  193,   257,   385,   513,   769,
+                                   1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+const uint8_t distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                   6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// the fixed literal/length code of deflate
+void putSymbol(BitWriter& writer, int symbol) {
+    if (symbol < 144) {
+        writer.putCode(0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        writer.putCode(0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        writer.putCode(symbol - 256, 7);
+    } else {
+        writer.putCode(0xC0 + symbol - 280, 8);
+    }
+}
+
+// A zlib stream of one deflate block with the fixed codes. Matches are found with hash chains over 3 bytes, NES frames
+// are mostly long repeats so dynamic codes would gain little.
+std::vector<uint8_t> compress(const std::vector<uint8_t>& data) {
+    constexpr int WINDOW = 32768;
+    constexpr int HASH_BITS = 15;
+    constexpr int MAX_CHAIN = 32;
+    constexpr int MAX_MATCH = 258;
+
+    std::vector<uint8_t> out = {0x78, 0x01};
+    BitWriter writer{out};
+    writer.put(1, 1);  // last block
+    writer.put(1, 2);  // fixed codes
+
+    std::vector<int32_t> head(1 << HASH_BITS, -1);
+    std::vector<int32_t> previous(WINDOW, -1);
+    size_t size = data.size();
+    auto hash = [&](size_t i) {
+        uint32_t value = data[i] | data[i + 1] << 8 | data[i + 2] << 16;
+        return (value * 2654435761u) >> (32 - HASH_BITS);
+    };
+    auto insert = [&](size_t i) {
+        if (i + 2 < size) {
+            uint32_t h = hash(i);
+            previous[i % WINDOW] = head[h];
+            head[h] = i;
+        }
+    };
+
+    size_t i = 0;
+    while (i < size) {
+        int bestLength = 0, bestDistance = 0;
+        if (i + 2 < size) {
+            int32_t candidate = head[hash(i)];
+            int limit = std::min<size_t>(MAX_MATCH, size - i);
+            for (int chain = 0; candidate >= 0 && i - candidate <= WINDOW && chain < MAX_CHAIN; chain++) {
+                int length = 0;
+                while (length < limit && data[candidate + length] == data[i + length]) {
+                    length++;
+                }
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestDistance = i - candidate;
+                    if (length == limit) {
+                        break;
+                    }
+                }
+                int32_t next = previous[candidate % WINDOW];
+                // the slot was reused by a newer position
+                if (next >= candidate) {
+                    break;
+                }
+                candidate = next;
+            }
+        }
+        if (bestLength < 3) {
+            putSymbol(writer, data[i]);
+            insert(i++);
+            continue;
+        }
+        int code = 28;
+        while (lengthBase[code] > bestLength) {
+            code--;
+        }
+        putSymbol(writer, 257 + code);
+        writer.put(bestLength - lengthBase[code], lengthExtra[code]);
+        code = 29;
+        while (distanceBase[code] > bestDistance) {
+            code--;
+        }
+        writer.putCode(code, 5);
+        writer.put(bestDistance - distanceBase[code], distanceExtra[code]);
+        for (int end = i + bestLength; (int)i < end; i++) {
+            insert(i);
+        }
+    }
+    putSymbol(writer, 256);
+    writer.flush();
+    put32(out, adler32(data.data(), size));
+    return out;
+}
+
+// RGB PNG, each row gets the filter (none, sub or up) with the smallest sum of absolute differences
+std::vector<uint8_t> encodePNG(const uint32_t* pixels) {
+    constexpr int STRIDE = SCREEN_WIDTH * 3;
+    std::vector<uint8_t> raw((STRIDE + 1) * SCREEN_HEIGHT);
+    uint8_t rows[2][STRIDE] = {};
+    uint8_t candidates[3][STRIDE];
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        uint8_t* row = rows[y & 1];
+        const uint8_t* above = rows[~y & 1];
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            uint32_t pixel = pixels[y * SCREEN_WIDTH + x];
+            row[x * 3] = pixel >> 24;
+            row[x * 3 + 1] = pixel >> 16;
+            row[x * 3 + 2] = pixel >> 8;
+        }
+        int best = 0, bestCost = INT32_MAX;
+        for (int filter = 0; filter < 3; filter++) {
+            int cost = 0;
+            for (int i = 0; i < STRIDE; i++) {
+                uint8_t predicted = filter == 0 ? 0 : filter == 1 ? (i >= 3 ? row[i - 3] : 0) : above[i];
+                candidates[filter][i] = row[i] - predicted;
+                cost += std::abs((int8_t)candidates[filter][i]);
+            }
+            if (cost < bestCost) {
+                best = filter;
+                bestCost = cost;
+            }
+        }
+        raw[y * (STRIDE + 1)] = best;
+        memcpy(&raw[y * (STRIDE + 1) + 1], candidates[best], STRIDE);
+    }
+
+    std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    auto chunk = [&](const char* type, const std::vector<uint8_t>& data) {
+        put32(png, data.size());
+        size_t begin = png.size();
+        png.insert(png.end(), type, type + 4);
+        png.insert(png.end(), data.begin(), data.end());
+        put32(png, crc32(&png[begin], png.size() - begin));
+    };
+    std::vector<uint8_t> header;
+    put32(header, SCREEN_WIDTH);
+    put32(header, SCREEN_HEIGHT);
+    header.insert(header.end(), {8, 2, 0, 0, 0});  // 8-bit RGB, not interlaced
+    chunk("IHDR", header);
+    chunk("IDAT", compress(raw));
+    chunk("IEND", {});
+    return png;
+}
+
+void writeLE(FILE* file, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        fputc(value >> (i * 8) & 0xFF, file);
+    }
+}
+
+// the sizes are patched when the capture ends
+void writeWAVHeader(FILE* file, uint32_t rate, uint32_t dataBytes) {
+    fwrite("RIFF", 1, 4, file);
+    writeLE(file, 36 + dataBytes, 4);
+    fwrite("WAVEfmt ", 1, 8, file);
+    writeLE(file, 16, 4);
+    writeLE(file, 1, 2);     // PCM
+    writeLE(file, 1, 2);     // mono
+    writeLE(file, rate, 4);
+    writeLE(file, rate, 4);  // bytes per second
+    writeLE(file, 1, 2);     // block align
+    writeLE(file, 8, 2);     // unsigned 8-bit
+    fwrite("data", 1, 4, file);
+    writeLE(file, dataBytes, 4);
+}
+
+}  // namespace
+
+std::unique_ptr<Capture> Capture::open(const std::string& video, const std::string& audio, Region region,
+                                       uint32_t threads) {
+    std::unique_ptr<Capture> capture(new Capture());
+    capture->_region = region;
+    if (endsWith(video, ".y4m")) {
+        capture->_video = fopen(video.c_str(), "wb");
+        if (!capture->_video) {
+            std::cerr << "Failed to open video capture \"" << video << "\"" << std::endl;
+            return nullptr;
+        }
+        fprintf(capture->_video, "YUV4MPEG2 W%d H%d F%s Ip A1:1 C444\n", SCREEN_WIDTH, SCREEN_HEIGHT,
+                frameRate(region));
+    } else if (endsWith(video, ".png")) {
+        capture->_pattern = video.substr(0, video.size() - 4);
+    } else if (!video.empty()) {
+        std::cerr << "Unknown video capture format \"" << video << "\", expected .y4m or .png" << std::endl;
+        return nullptr;
+    }
+    if (!audio.empty()) {
+        capture->_audio = fopen(audio.c_str(), "wb");
+        if (!capture->_audio) {
+            std::cerr << "Failed to open audio capture \"" << audio << "\"" << std::endl;
+            return nullptr;
+        }
+        writeWAVHeader(capture->_audio, sampleRate(region), 0);
+        capture->_audioThread = std::thread(&Capture::writeWAV, capture.get());
+    }
+
+    if (!video.empty()) {
+        for (size_t i = 0; i < QUEUE_FRAMES; i++) {
+            capture->_free.push(std::vector<uint32_t>(SCREEN_WIDTH * SCREEN_HEIGHT));
+        }
+        if (capture->_video) {
+            capture->_videoThreads.emplace_back(&Capture::writeY4M, capture.get());
+        } else {
+            for (uint32_t i = 0; i < std::max(1u, threads); i++) {
+                capture->_videoThreads.emplace_back(&Capture::writePNG, capture.get());
+            }
+        }
+    }
+    return capture;
+}
+
+Capture::~Capture() {
+    _queue.close();
+    for (auto& thread : _videoThreads) {
+        thread.join();
+    }
+    if (_video) {
+        fclose(_video);
+    }
+
+    _chunks.close();
+    if (_audioThread.joinable()) {
+        _audioThread.join();
+    }
+    if (_audio) {
+        fseek(_audio, 0, SEEK_SET);
+        writeWAVHeader(_audio, sampleRate(_region), _audioBytes);
+        fclose(_audio);
+    }
+}
+
+void Capture::frame(const uint32_t* pixels) {
+    uint64_t number = _frames++;
+    if (_videoThreads.empty()) {
+        return;
+    }
+    size_t size = SCREEN_WIDTH * SCREEN_HEIGHT;
+    if (!_previous.empty() && memcmp(_previous.data(), pixels, size * sizeof(uint32_t)) == 0) {
+        _duplicates++;
+        // nothing to write in a PNG sequence
+        if (_video) {
+            _queue.push({number, {}});
+        }
+        return;
+    }
+    _previous.assign(pixels, pixels + size);
+    Frame frame{number, {}};
+    _free.pop(frame.pixels);
+    memcpy(frame.pixels.data(), pixels, size * sizeof(uint32_t));
+    _queue.push(std::move(frame));
+}
+
+void Capture::audio(const uint8_t* ring, size_t size, uint64_t sampleIndex) {
+    if (!_audio) {
+        return;
+    }
+    // samples older than the ring are lost, emulation ran too far between two calls
+    _sampleIndex = std::max(_sampleIndex, sampleIndex > size ? sampleIndex - size : 0);
+    std::vector<uint8_t> chunk;
+    chunk.reserve(sampleIndex - _sampleIndex);
+    for (; _sampleIndex < sampleIndex; _sampleIndex++) {
+        chunk.push_back(ring[_sampleIndex % size]);
+    }
+    if (!chunk.empty()) {
+        _chunks.push(std::move(chunk));
+    }
+}
+
+// frames arrive in order from a single writer, a repeat writes the last converted frame again
+void Capture::writeY4M() {
+    size_t size = SCREEN_WIDTH * SCREEN_HEIGHT;
+    std::vector<uint8_t> planes(size * 3);
+    Frame frame;
+    while (_queue.pop(frame)) {
+        if (!frame.pixels.empty()) {
+            // BT.601 limited range
+            for (size_t i = 0; i < size; i++) {
+                int r = frame.pixels[i] >> 24, g = frame.pixels[i] >> 16 & 0xFF, b = frame.pixels[i] >> 8 & 0xFF;
+                planes[i] = (66 * r + 129 * g + 25 * b + 128 + (16 << 8)) >> 8;
+                planes[size + i] = (-38 * r - 74 * g + 112 * b + 128 + (128 << 8)) >> 8;
+                planes[size * 2 + i] = (112 * r - 94 * g - 18 * b + 128 + (128 << 8)) >> 8;
+            }
+            _free.push(std::move(frame.pixels));
+        }
+        fwrite("FRAME\n", 1, 6, _video);
+        fwrite(planes.data(), 1, planes.size(), _video);
+    }
+}
+
+// any number of these run at once, every frame is its own file
+void Capture::writePNG() {
+    Frame frame;
+    while (_queue.pop(frame)) {
+        std::vector<uint8_t> png = encodePNG(frame.pixels.data());
+        _free.push(std::move(frame.pixels));
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%06llu.png", (unsigned long long)frame.number);
+        std::string path = _pattern + suffix;
+        FILE* file = fopen(path.c_str(), "wb");
+        if (!file) {
+            std::cerr << "Failed to write \"" << path << "\"" << std::endl;
+            continue;
+        }
+        fwrite(png.data(), 1, png.size(), file);
+        fclose(file);
+    }
+}
+
+void Capture::writeWAV() {
+    std::vector<uint8_t> chunk;
+    while (_chunks.pop(chunk)) {
+        fwrite(chunk.data(), 1, chunk.size(), _audio);
+        _audioBytes += chunk.size();
+    }
+}
+
+}  // namespace NebulaEmu
@@ -1,63 +1,170 @@
 #include "Cartridge.h"
 
 #include <cstring>
-#include <fstream>
 #include <iostream>
 
 using namespace std;
 
 namespace NebulaEmu {
 
+Cartridge::~Cartridge() { release(); }
+
+void Cartridge::release() {
+    delete _mapper;
+    _mapper = nullptr;
+    if (!_save) {
+        free(_PRG_RAM);
+    }
+    _PRG_RAM = nullptr;
+    _PRG_RAM_size = 0;
+    // writes the PRG RAM back and frees the file for the next cartridge, which may be the same game
+    _save.reset();
+    _image.reset();
+    _PRG_ROM = {};
+    _CHR_ROM = {};
+    _CHR_RAM.clear();
+    _battery = false;
+    _mapperNumber = 0;
+    _submapper = 0;
+    _region = NTSC;
+}
+
+// NES 2.0 ROM sizes: if the MSB nibble is $F, the LSB byte is an exponent-multiplier notation EEEEEEMM and the size is
+// 2^E * (MM * 2 + 1) bytes, otherwise the size is (MSB << 8 | LSB) units. E goes up to 63, so sizes over 2^40, which
+// no file holds, come back as UINT64_MAX instead of overflowing.
+static uint64_t NES2ROMSize(uint8_t LSB, uint8_t MSB, uint32_t unit) {
+    if (MSB == 0x0F) {
+        if ((LSB >> 2) >= 40) {
+            return UINT64_MAX;
+        }
+        return (1ull << (LSB >> 2)) * ((LSB & 0x3) * 2 + 1);
+    }
+    return (uint64_t)(MSB << 8 | LSB) * unit;
+}
+
+// NES 2.0 RAM sizes are 64 << shift bytes, 0 means none
+static uint32_t NES2RAMSize(uint8_t shift) { return shift ? 64 << shift : 0; }
+
+void Cartridge::serialize(State& state) {
+    state.field(_PRG_RAM, _PRG_RAM_size);
+    state.field(_CHR_RAM.data(), _CHR_RAM.size());
+    if (state.loading() && _save) {
+        _save->markDirty();
+    }
+    _mapper->serialize(state);
+}
+
 void Cartridge::load(string path) {
-    ifstream file(path, ios::binary);
-    if (!file.is_open()) {
+    // acquired before the previous cartridge is released, so reloading the same game keeps its image
+    shared_ptr<const RomImage> image = RomCache::acquire(path);
+    if (!image) {
         cerr << "Failed to open file \"" << path << "\"" << endl;
         exit(1);
     }
+    release();
+    _image = image;
+    const uint8_t* header = _image->data();
 
-    uint8_t header[16];
-    file.read((char*)header, 16);
-
-    if (!(header[0] == 'N' && header[1] == 'E' && header[2] == 'S' && header[3] == 0x1A)) {
+    if (_image->size() < 16 || !(header[0] == 'N' && header[1] == 'E' && header[2] == 'S' && header[3] == 0x1A)) {
         cerr << "unkown format" << endl;
         exit(1);
     }
 
-    if ((header[7] & 0x0C) == 0x08) {
-        // NES 2.0
-        cerr << "NES 2.0 format unsupported" << endl;
-        exit(2);
-    }
+    bool NES2 = (header[7] & 0x0C) == 0x08;
+    // iNES headers with anything in bytes 12-15 (e.g. "DiskDude!") or in bits 2-3 of byte 7 were written by old tools
+    // that put junk in bytes 7-15, so only bytes 4-6 of them are used
+    bool archaic = !NES2 && ((header[7] & 0x0C) || header[12] || header[13] || header[14] || header[15]);
 
     _mirroring = (NameTableMirroring)(header[6] & 0x01);
+    if (header[6] & 0x08) {
+        _mirroring = FourScreen;
+    }
+    _battery = header[6] & 0x02;
+    _mapperNumber = (archaic ? 0 : header[7] & 0xF0) | ((header[6] & 0xF0) >> 4);
+
+    uint64_t PRG_ROM_size = header[4] * 0x4000;
+    uint64_t CHR_ROM_size = header[5] * 0x2000;
+    uint32_t CHR_RAM_size = 0;
+    // Most boards without a battery still have PRG RAM at $6000 (e.g. MMC1 games), so at least 8 KB is present
+    _PRG_RAM_size = 0x2000;
 
-    if (header[6] & 0x02) {
-        _battery_backed_RAM = (uint8_t*)malloc(0X2000);
-        memset(_battery_backed_RAM, 0, 0x2000);
+    if (NES2) {
+        _mapperNumber |= (header[8] & 0x0F) << 8;
+        _submapper = header[8] >> 4;
+        PRG_ROM_size = NES2ROMSize(header[4], header[9] & 0x0F, 0x4000);
+        CHR_ROM_size = NES2ROMSize(header[5], header[9] >> 4, 0x2000);
+        // volatile and non-volatile PRG RAM share $6000-$7FFF
+        _PRG_RAM_size = max<uint32_t>(_PRG_RAM_size, NES2RAMSize(header[10] & 0x0F) + NES2RAMSize(header[10] >> 4));
+        CHR_RAM_size = NES2RAMSize(header[11] & 0x0F) + NES2RAMSize(header[11] >> 4);
+        _region = (Region)(header[12] & 0x03);
+    } else if (!archaic) {
+        // iNES: byte 8 is the PRG RAM size in 8 KB units. Byte 9 bit 0 is the TV system, but few dumps set it, so it
+        // is only taken for PAL when the unofficial byte 10 says PAL as well
+        _PRG_RAM_size = max<uint32_t>(_PRG_RAM_size, header[8] * 0x2000);
+        _region = (header[9] & 0x01) && (header[10] & 0x03) == 2 ? PAL : NTSC;
     }
 
-    if (header[6] & 0x04) {
-        // _trainer = (uint8_t*)malloc(512);
-        // file.read((char*)_trainer, 512);
-        cerr << "Trainer unsupported" << endl;
-        exit(2);
+    // the trainer only goes into PRG RAM that holds no save
+    bool blank = true;
+    if (_battery) {
+        // game.nes -> game.sav
+        size_t dot = path.find_last_of('.');
+        bool extension = dot != string::npos && dot > path.find_last_of("/\\") + 1;
+        string savePath = (extension ? path.substr(0, dot) : path) + ".sav";
+        _save = SaveFile::open(savePath, _PRG_RAM_size);
+        if (_save) {
+            _PRG_RAM = _save->data();
+            blank = _save->created();
+        } else {
+            // another session of the game owns the file, or it can not be written; either way this one has its own
+            if (!SaveFile::isOpen(savePath)) {
+                cerr << "Failed to open save file \"" << savePath << "\", the game will not be saved" << endl;
+            }
+            _PRG_RAM = (uint8_t*)calloc(_PRG_RAM_size, 1);
+            blank = !SaveFile::read(savePath, _PRG_RAM, _PRG_RAM_size);
+        }
+    } else {
+        _PRG_RAM = (uint8_t*)calloc(_PRG_RAM_size, 1);
     }
 
-    if (header[6] & 0x08) {
-        // _mirroring = FourScreen;
-        std::cerr << "unsupported mirroing" << std::endl;
-        exit(2);
+    uint64_t offset = 16;
+    if (header[6] & 0x04) {
+        // 512-byte trainer at $7000-$71FF
+        if (_image->size() < offset + 512) {
+            cerr << "truncated ROM" << endl;
+            exit(1);
+        }
+        if (blank) {
+            memcpy(&_PRG_RAM[0x1000], _image->data() + offset, 512);
+        }
+        offset += 512;
     }
 
-    _mapper = Mapper::createMapper((header[7] & 0xF0) | ((header[6] & 0xF0) >> 4));
+    // the mappers switch PRG ROM in 8 KB banks and CHR ROM in 1 KB banks, so the sizes have to be whole banks
+    if (PRG_ROM_size == 0 || PRG_ROM_size % 0x2000 || CHR_ROM_size % 0x400) {
+        cerr << "invalid ROM size" << endl;
+        exit(1);
+    }
+    // compared one at a time, so sizes that no file holds can not overflow the sum
+    uint64_t available = _image->size() - offset;
+    if (PRG_ROM_size > available || CHR_ROM_size > available - PRG_ROM_size) {
+        cerr << "truncated ROM" << endl;
+        exit(1);
+    }
+    _PRG_ROM = {_image->data() + offset, PRG_ROM_size};
+    offset += PRG_ROM_size;
+    _CHR_ROM = {_image->data() + offset, CHR_ROM_size};
 
-    uint32_t _PRG_ROM_size = header[4] * 0x4000;
-    _PRG_ROM.resize(_PRG_ROM_size);
-    file.read((char*)&_PRG_ROM[0], _PRG_ROM_size);
+    if (CHR_ROM_size == 0) {
+        _CHR_RAM.assign(max<uint32_t>(CHR_RAM_size, 0x2000), 0);
+    }
 
-    uint32_t _CHR_ROM_size = header[5] * 0x2000;
-    _CHR_ROM.resize(_CHR_ROM_size);
-    file.read((char*)&_CHR_ROM[0], _CHR_ROM_size);
+    _mapper = Mapper::createMapper(_mapperNumber);
+    if (!_mapper) {
+        cerr << "unsupported mapper " << _mapperNumber << endl;
+        exit(2);
+    }
+    _mapper->reset();
 }
 
-}  // namespace NebulaEmu
\ No newline at end of file
+}  // namespace NebulaEmu
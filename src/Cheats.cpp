@@ -0,0 +1,128 @@
+#include "Cheats.h"
+
+#include <cctype>
+#include <cstring>
+#include <iostream>
+
+#include "Emulator.h"
+
+namespace NebulaEmu {
+
+namespace {
+
+// CPU cycles per frame rounded down, a frame never goes without its writes
+constexpr uint64_t NTSC_FRAME_CYCLES = 29780;
+constexpr uint64_t PAL_FRAME_CYCLES = 33247;
+
+}  // namespace
+
+bool Cheats::decode(const std::string& code, Patch& patch) {
+    static const char letters[] = "APZLGITYEOXUKSVN";
+    if (code.size() != 6 && code.size() != 8) {
+        return false;
+    }
+    uint8_t n[8];
+    for (size_t i = 0; i < code.size(); i++) {
+        const char* letter = strchr(letters, toupper((unsigned char)code[i]));
+        if (!letter || !*letter) {
+            return false;
+        }
+        n[i] = letter - letters;
+    }
+    patch.address = 0x8000 | (n[3] & 7) << 12 | (n[5] & 7) << 8 | (n[4] & 8) << 8 | (n[2] & 7) << 4 |
+                    (n[1] & 8) << 4 | (n[4] & 7) | (n[3] & 8);
+    patch.value = (n[1] & 7) << 4 | (n[0] & 8) << 4 | (n[0] & 7);
+    if (code.size() == 6) {
+        patch.value |= n[5] & 8;
+        patch.compare = -1;
+    } else {
+        patch.value |= n[7] & 8;
+        patch.compare = (n[7] & 7) << 4 | (n[6] & 8) << 4 | (n[6] & 7) | (n[5] & 8);
+    }
+    return true;
+}
+
+bool Cheats::addGameGenie(const std::string& code) {
+    Patch patch;
+    if (!decode(code, patch)) {
+        std::cerr << "invalid Game Genie code \"" << code << "\"" << std::endl;
+        return false;
+    }
+    addPatch(patch);
+    return true;
+}
+
+void Cheats::addPatch(const Patch& patch) {
+    _patches.push_back(patch);
+    update();
+}
+
+bool Cheats::addFreeze(uint16_t address, uint8_t value) {
+    if (address >= 0x800 && (address < 0x6000 || address >= 0x8000)) {
+        std::cerr << "can not freeze address $" << std::hex << address << std::dec << ", only RAM and PRG RAM"
+                  << std::endl;
+        return false;
+    }
+    _freezes.push_back({address, value});
+    update();
+    return true;
+}
+
+void Cheats::clear() {
+    _patches.clear();
+    _freezes.clear();
+    update();
+}
+
+void Cheats::reset() { update(); }
+
+void Cheats::update() {
+    Mapper* mapper = cartridge ? cartridge->getMapper() : nullptr;
+    if (!mapper) {
+        return;
+    }
+    mapper->clearPRGPatches();
+    _banks.clear();
+    // every bank a patch applies to gets a copy for the slot of the patch address, comparisons look at the ROM
+    uint32_t count = mapper->getPRGBankCount();
+    for (int slot = 0; slot < 4; slot++) {
+        for (uint32_t bank = 0; bank < count && !_patches.empty(); bank++) {
+            const uint8_t* ROM = mapper->getPRGROM(bank);
+            uint8_t* copy = nullptr;
+            for (auto& patch : _patches) {
+                uint16_t offset = patch.address & 0x1FFF;
+                if (((patch.address >> 13) & 0x3) != slot || (patch.compare >= 0 && ROM[offset] != patch.compare)) {
+                    continue;
+                }
+                if (!copy) {
+                    _banks.emplace_back(new uint8_t[0x2000]);
+                    copy = _banks.back().get();
+                    memcpy(copy, ROM, 0x2000);
+                }
+                copy[offset] = patch.value;
+            }
+            if (copy) {
+                mapper->patchPRGBank(slot, bank, copy);
+            }
+        }
+    }
+
+    if (_freezes.empty()) {
+        scheduler->cancel(Scheduler::Freeze);
+    } else if (!scheduler->pending(Scheduler::Freeze)) {
+        scheduler->schedule(Scheduler::Freeze, scheduler->now());
+    }
+}
+
+void Cheats::freeze(uint64_t time) {
+    if (_freezes.empty()) {
+        return;
+    }
+    for (auto& freeze : _freezes) {
+        cpu->write(freeze.address, freeze.value);
+    }
+    scheduler->schedule(Scheduler::Freeze,
+                        time + (cartridge->getRegion() == PAL ? PAL_FRAME_CYCLES : NTSC_FRAME_CYCLES));
+}
+
+}  // namespace NebulaEmu
@@ -0,0 +1,111 @@
+#include "Debugger.h"
+
+#include "Emulator.h"
+
+namespace NebulaEmu {
+
+void Debugger::setBreakpoint(uint16_t address, bool enabled) {
+    _breakpoints[address] = enabled;
+    update();
+}
+
+void Debugger::setWatchpoint(Bus bus, uint16_t address, int access, bool enabled) {
+    // every mirror, so the access checks stay a single bit
+    uint32_t first = address, end = address + 1, step = 1;
+    if (bus == PPUBus) {
+        first = address & 0x3FFF;
+        end = first + 1;
+    } else if (address < 0x2000) {
+        first = address & 0x7FF;
+        end = 0x2000;
+        step = 0x800;
+    } else if (address < 0x4000) {
+        first = address & 0x2007;
+        end = 0x4000;
+        step = 8;
+    }
+    for (uint32_t mirror = first; mirror < end; mirror += step) {
+        if (access & Read) {
+            _reads[bus][mirror] = enabled;
+        }
+        if (access & Write) {
+            _writes[bus][mirror] = enabled;
+        }
+    }
+    update();
+}
+
+void Debugger::clear() {
+    _breakpoints.reset();
+    for (int bus = 0; bus < 2; bus++) {
+        _reads[bus].reset();
+        _writes[bus].reset();
+    }
+    update();
+}
+
+Debugger::Stop Debugger::step() { return resume(Stepping, UINT64_MAX); }
+
+Debugger::Stop Debugger::stepOver() {
+    // JSR
+    if (cpu->peek(cpu->getPC()) == 0x20) {
+        _returnPC = cpu->getPC() + 3;
+        _returnSP = cpu->getSP();
+        return resume(SteppingOver, UINT64_MAX);
+    }
+    return resume(Stepping, UINT64_MAX);
+}
+
+Debugger::Stop Debugger::runToFrame(uint64_t frame) { return resume(Run, frame); }
+
+void Debugger::check(uint16_t PC, uint8_t SP) {
+    if (_stopped) {
+        return;
+    }
+    if (_breakpoints[PC]) {
+        _stopped = true;
+        _stop.reason = Breakpoint;
+    } else if (_mode == Stepping || (_mode == SteppingOver && PC == _returnPC && SP == _returnSP)) {
+        _stopped = true;
+        _stop.reason = Step;
+    }
+}
+
+void Debugger::hit(Bus bus, uint16_t address, Access access) {
+    if (_stopped) {
+        return;
+    }
+    _stopped = true;
+    _stop.reason = Watchpoint;
+    _stop.bus = bus;
+    _stop.access = access;
+    _stop.address = address;
+}
+
+Debugger::Stop Debugger::resume(Mode mode, uint64_t frame) {
+    _mode = mode;
+    _stopped = false;
+    _stop = Stop();
+    update();
+    // the CPU stops between two instructions, the PPU and APU are run up to it
+    while (!_stopped && ppu->getFrame() < frame) {
+        stepFrame();
+    }
+    if (!_stopped) {
+        _stop.reason = Frame;
+    }
+    _stop.PC = cpu->getPC();
+    _mode = Run;
+    update();
+    return _stop;
+}
+
+void Debugger::update() {
+    bool watching = false;
+    for (int bus = 0; bus < 2; bus++) {
+        watching = watching || _reads[bus].any() || _writes[bus].any();
+    }
+    setDebug(_mode != Run || watching || _breakpoints.any());
+}
+
+}  // namespace NebulaEmu
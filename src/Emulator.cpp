@@ -0,0 +1,425 @@
+#include "Emulator.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+
+#include "Hash.h"
+#include "Profiler.h"
+#include "Telemetry.h"
+
+namespace NebulaEmu {
+
+uint32_t* pixels = nullptr;
+uint16_t* indices = nullptr;
+
+Cartridge* cartridge = nullptr;
+APU* apu = nullptr;
+CPU* cpu = nullptr;
+PPU* ppu = nullptr;
+Controller* controller = nullptr;
+Scheduler* scheduler = nullptr;
+Cheats* cheats = nullptr;
+Debugger* debugger = nullptr;
+
+// the loops of the selected variant
+struct Core {
+    void (*step)(uint64_t cycles);
+    void (*stepTimed)(uint64_t cycles);
+    void (*stepFrame)();
+    void (*catchUp)(uint64_t cycle);
+};
+
+struct Session {
+    Cartridge cartridge;
+    APU apu;
+    CPU cpu;
+    PPU ppu;
+    Controller controller;
+    Scheduler scheduler;
+    Cheats cheats;
+    // 40 KB of bitmaps, only made for sessions that are debugged
+    std::unique_ptr<Debugger> debugger;
+
+    // the variant is selected again when one changes
+    SessionOptions options;
+    Core core;
+
+    // 5 APU cycles are 10 CPU cycles and 32 PPU dots on PAL, the two extra dots go to phases 1 and 3
+    int PALPhase = 0;
+
+    // APU cycles the PPU has stepped, the scheduler clock counts those of the APU
+    uint64_t PPUCycle = 0;
+    // while a batch runs the CPU is ahead of the PPU and APU, which catch up when it touches their registers
+    bool running = false;
+    // bytes of a state of the loaded cartridge, 0 until one is saved
+    size_t stateSize = 0;
+
+    // the RGBA frame and the audio ring follow the struct in the same allocation
+    uint32_t* pixels;
+    uint8_t* audio;
+};
+
+static Session* current = nullptr;
+
+// a power of two, compact sessions keep a little over 2 frames of samples
+static constexpr size_t AUDIO_SAMPLES = 65536;
+static constexpr size_t COMPACT_AUDIO_SAMPLES = 2048;
+
+Session* createSession(bool compact) {
+    size_t pixelBytes = compact ? 0 : SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t);
+    size_t audioBytes = compact ? COMPACT_AUDIO_SAMPLES : AUDIO_SAMPLES;
+    uint8_t* memory = (uint8_t*)::operator new(sizeof(Session) + pixelBytes + audioBytes);
+    // value initialization zeroes every component, so two sessions of the same game start identical
+    Session* session = new (memory) Session();
+    session->pixels = compact ? nullptr : (uint32_t*)(memory + sizeof(Session));
+    session->audio = memory + sizeof(Session) + pixelBytes;
+    memset(session->audio, 0, audioBytes);
+    session->apu.setBuffer(session->audio, audioBytes);
+    return session;
+}
+
+void selectSession(Session* session) {
+    current = session;
+    cartridge = session ? &session->cartridge : nullptr;
+    apu = session ? &session->apu : nullptr;
+    cpu = session ? &session->cpu : nullptr;
+    ppu = session ? &session->ppu : nullptr;
+    controller = session ? &session->controller : nullptr;
+    scheduler = session ? &session->scheduler : nullptr;
+    cheats = session ? &session->cheats : nullptr;
+    debugger = session ? session->debugger.get() : nullptr;
+    pixels = session ? session->pixels : nullptr;
+}
+
+Session* currentSession() { return current; }
+
+Debugger* attachDebugger() {
+    if (!current->debugger) {
+        current->debugger = std::make_unique<Debugger>();
+        debugger = current->debugger.get();
+    }
+    return debugger;
+}
+
+void destroySession(Session* session) {
+    if (!session) {
+        return;
+    }
+    if (session == current) {
+        selectSession(nullptr);
+    }
+    session->~Session();
+    ::operator delete(session);
+}
+
+void init(bool compact) {
+    Session* previous = current;
+    selectSession(createSession(compact));
+    destroySession(previous);
+#ifdef NEBULA_PROFILE
+    if (!profiler) {
+        profiler = new Profiler();
+    }
+#endif
+}
+
+template <class V>
+static void stepPPU() {
+    ppu->step<V>();
+    ppu->step<V>();
+    ppu->step<V>();
+    ppu->step<V>();
+    ppu->step<V>();
+    ppu->step<V>();
+    if constexpr (V::region == PAL) {
+        int& PALPhase = current->PALPhase;
+        PALPhase = PALPhase == 4 ? 0 : PALPhase + 1;
+        if (PALPhase == 1 || PALPhase == 3) {
+            ppu->step<V>();
+        }
+    }
+}
+
+// Phase A of an APU cycle runs the scheduler and the APU, then the CPU runs 2 cycles, then phase B steps the PPU. The
+// CPU runs ahead in batches instead: nothing it sees changes before the next scheduled event, and the APU and PPU are
+// run up to its cycle when it touches their registers or the mapper.
+static void runAPU(uint64_t cycle) {
+    while (scheduler->now() < 2 * cycle) {
+        scheduler->advance(2);
+        apu->step();
+    }
+}
+
+template <class V>
+static void runPPU(uint64_t cycle) {
+    uint64_t& PPUCycle = current->PPUCycle;
+    while (PPUCycle < cycle) {
+        stepPPU<V>();
+        PPUCycle++;
+    }
+}
+
+// an access on CPU cycle c comes after phase A of APU cycle c / 2 and before its phase B
+template <class V>
+static void catchUpVariant(uint64_t cycle) {
+    runPPU<V>(cycle / 2);
+    runAPU(cycle / 2 + 1);
+}
+
+// the CPU stops on the cycle after the APU cycle whose phase B steps the next PPU event
+static void scheduleRaster() {
+    uint32_t dots = ppu->getEventDots();
+    uint64_t cycles;
+    if (cartridge->getRegion() == PAL) {
+        uint64_t periods = (dots - 1) / 32;
+        dots -= periods * 32;
+        cycles = periods * 5;
+        int phase = current->PALPhase;
+        for (;;) {
+            phase = phase == 4 ? 0 : phase + 1;
+            cycles++;
+            uint32_t stepped = phase == 1 || phase == 3 ? 7 : 6;
+            if (dots <= stepped) {
+                break;
+            }
+            dots -= stepped;
+        }
+    } else {
+        cycles = (dots + 5) / 6;
+    }
+    scheduler->schedule(Scheduler::Raster, 2 * (current->PPUCycle + cycles + 1));
+}
+
+// Runs until the CPU cycle until, or the end of the frame, in batches that end at the scheduler deadline. Every exit
+// leaves the PPU and APU on the same cycle.
+template <class V, bool Timed>
+static void runVariant(uint64_t until, bool frameEnd) {
+    uint64_t frame = ppu->getFrame();
+    current->running = true;
+    for (;;) {
+        scheduleRaster();
+        uint64_t begin = Timed ? telemetry->now() : 0;
+        cpu->run<V>(until);
+        uint64_t CPUEnd = Timed ? telemetry->now() : 0;
+        uint64_t stop = std::min(until, scheduler->deadline());
+        if constexpr (V::debug) {
+            if (debugger->stopped()) {
+                stop = std::min(stop, cpu->getCycles());
+                runPPU<V>(stop / 2);
+                runAPU(stop / 2);
+                break;
+            }
+        }
+        runPPU<V>(stop / 2);
+        uint64_t PPUEnd = Timed ? telemetry->now() : 0;
+        bool done = stop == until || (frameEnd && ppu->getFrame() != frame);
+        // the events due on the stop cycle run with the next batch
+        runAPU(done ? stop / 2 : stop / 2 + 1);
+        if constexpr (Timed) {
+            uint64_t APUEnd = telemetry->now();
+            telemetry->addBatch(Telemetry::CPU, CPUEnd - begin);
+            telemetry->addBatch(Telemetry::PPU, PPUEnd - CPUEnd);
+            telemetry->addBatch(Telemetry::APU, APUEnd - PPUEnd);
+        }
+        if (done) {
+            break;
+        }
+    }
+    current->running = false;
+}
+
+template <class V>
+static void stepVariant(uint64_t cycles) {
+    runVariant<V, false>(2 * (current->PPUCycle + cycles), false);
+}
+
+template <class V>
+static void stepTimedVariant(uint64_t cycles) {
+    runVariant<V, true>(2 * (current->PPUCycle + cycles), false);
+}
+
+template <class V>
+static void stepFrameVariant() {
+    if constexpr (V::debug) {
+        debugger->clearStop();
+    }
+    runVariant<V, false>(Scheduler::NEVER, true);
+}
+
+template <class V>
+static void selectCore() {
+    current->core = {stepVariant<V>, stepTimedVariant<V>, stepFrameVariant<V>, catchUpVariant<V>};
+}
+
+// turn the runtime options into template arguments one at a time
+template <Region R, bool A12, bool Render, bool Profile>
+static void selectTrace(bool trace) {
+    trace ? selectCore<Variant<R, A12, Render, Profile, true, false>>()
+          : selectCore<Variant<R, A12, Render, Profile, false, false>>();
+}
+
+template <Region R, bool A12, bool Render>
+static void selectProfile([[maybe_unused]] bool profile, bool trace, bool debug) {
+    if (debug) {
+        selectCore<Variant<R, A12, Render, false, false, true>>();
+        return;
+    }
+#ifdef NEBULA_PROFILE
+    if (profile) {
+        selectTrace<R, A12, Render, true>(trace);
+        return;
+    }
+#endif
+    selectTrace<R, A12, Render, false>(trace);
+}
+
+template <Region R, bool A12>
+static void selectRender(bool render, const SessionOptions& options) {
+    render ? selectProfile<R, A12, true>(options.profile, options.trace, options.debug)
+           : selectProfile<R, A12, false>(options.profile, options.trace, options.debug);
+}
+
+template <Region R>
+static void selectA12(bool A12, const SessionOptions& options) {
+    A12 ? selectRender<R, true>(options.render, options) : selectRender<R, false>(options.render, options);
+}
+
+static void selectVariant(const SessionOptions& options) {
+    // options changed before a cartridge is loaded are picked up by powerOn
+    if (!cartridge->getMapper()) {
+        return;
+    }
+    bool A12 = cartridge->getMapper()->watchesA12();
+    // multi-region and Dendy carts run with NTSC timing
+    if (cartridge->getRegion() == PAL) {
+        selectA12<PAL>(A12, options);
+    } else {
+        selectA12<NTSC>(A12, options);
+    }
+}
+
+void powerOn(std::string path, SessionOptions options) {
+    cartridge->load(path);
+    current->stateSize = 0;
+    // breakpoints may have been set before the cartridge, the debugger keeps checking them
+    bool debug = current->options.debug;
+    current->options = options;
+    current->options.debug |= debug;
+    selectVariant(current->options);
+    current->PALPhase = 0;
+    current->PPUCycle = 0;
+    scheduler->reset();
+    apu->reset();
+    cpu->powerOn();
+    ppu->powerOn();
+    cheats->reset();
+}
+
+void reset() {
+    // the clocks keep running, so the scheduled events stay in the time of the CPU
+    apu->reset();
+    cpu->reset();
+    ppu->reset();
+    cheats->reset();
+}
+
+void step(uint64_t cycles) { current->core.step(cycles); }
+
+void stepTimed(uint64_t cycles) { current->core.stepTimed(cycles); }
+
+void stepFrame() { current->core.stepFrame(); }
+
+void catchUp(uint64_t cycle) {
+    if (current->running) {
+        current->core.catchUp(cycle);
+    }
+}
+
+void rescheduleRaster() {
+    if (current->running) {
+        scheduleRaster();
+    }
+}
+
+void setRender(bool render) {
+    if (current->options.render != render) {
+        current->options.render = render;
+        selectVariant(current->options);
+    }
+}
+
+void setDebug(bool debug) {
+    if (current->options.debug != debug) {
+        current->options.debug = debug;
+        selectVariant(current->options);
+    }
+}
+
+// ends, when saving, gets where each StateComponent stops in the buffer
+static void serialize(State& state, size_t* ends = nullptr) {
+    auto end = [&](StateComponent component) {
+        if (ends) {
+            ends[component] = state.data().size();
+        }
+    };
+    state(current->PALPhase, current->PPUCycle);
+    scheduler->serialize(state);
+    end(TimingState);
+    cpu->serialize(state);
+    end(CPUState);
+    ppu->serialize(state);
+    end(PPUState);
+    apu->serialize(state);
+    end(APUState);
+    controller->serialize(state);
+    end(InputState);
+    // last, the mapper repoints the nametable pages of the PPU
+    cartridge->serialize(state);
+    end(CartridgeState);
+}
+
+void saveState(State& state) {
+    state.beginSave();
+    serialize(state);
+    current->stateSize = state.data().size();
+}
+
+bool loadState(State& state) {
+    if (!current->stateSize) {
+        State scratch;
+        saveState(scratch);
+    }
+    // a state of another cartridge or version would be applied half way
+    if (state.data().size() != current->stateSize) {
+        std::cerr << "The state does not belong to the loaded cartridge" << std::endl;
+        return false;
+    }
+    state.beginLoad();
+    serialize(state);
+    return !state.failed();
+}
+
+const char* getComponentName(int component) {
+    static const char* names[STATE_COMPONENTS] = {"timing", "CPU", "PPU", "APU", "input", "cartridge"};
+    return component >= 0 && component < STATE_COMPONENTS ? names[component] : "none";
+}
+
+void hashState(State& state, StateHash& hash) {
+    size_t ends[STATE_COMPONENTS];
+    state.beginSave();
+    serialize(state, ends);
+    current->stateSize = state.data().size();
+    const uint8_t* data = state.data().data();
+    size_t begin = 0;
+    for (int i = 0; i < STATE_COMPONENTS; i++) {
+        hash.components[i] = hash64(data + begin, ends[i] - begin, i);
+        begin = ends[i];
+    }
+    hash.machine = hash64(hash.components, sizeof(hash.components));
+}
+
+}  // namespace NebulaEmu
@@ -0,0 +1,111 @@
+#include "Hash.h"
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace NebulaEmu {
+
+static constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+static constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+static constexpr uint64_t PRIME3 = 0x165667B19E3779F9ull;
+static constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ull;
+static constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5ull;
+static constexpr uint32_t PRIME32 = 0x9E3779B1u;
+
+// the lanes are scrambled every SCRAMBLE_STRIPES stripes of 32 bytes, so a long input can not cancel out products
+static constexpr size_t SCRAMBLE_STRIPES = 16;
+
+static inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * PRIME2, 31) * PRIME1; }
+
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+// The stripes go through 4 lanes of 64 bits: each lane adds the product of the low and high halves of its word
+// xored with the key, and the word of its neighbour. Both paths give the same lanes.
+#ifdef __SSE2__
+static void accumulate(uint64_t* lanes, const uint64_t* key, const uint8_t*& p, const uint8_t* end) {
+    __m128i acc[2] = {_mm_loadu_si128((const __m128i*)lanes), _mm_loadu_si128((const __m128i*)(lanes + 2))};
+    __m128i keys[2] = {_mm_loadu_si128((const __m128i*)key), _mm_loadu_si128((const __m128i*)(key + 2))};
+    const __m128i prime = _mm_set1_epi32(PRIME32);
+    for (size_t stripe = 1; p + 32 <= end; p += 32, stripe++) {
+        for (int i = 0; i < 2; i++) {
+            __m128i data = _mm_loadu_si128((const __m128i*)(p + i * 16));
+            __m128i keyed = _mm_xor_si128(data, keys[i]);
+            // pmuludq multiplies the low halves of the two 64-bit lanes
+            __m128i product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(3, 3, 1, 1)));
+            __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+            acc[i] = _mm_add_epi64(acc[i], _mm_add_epi64(product, swapped));
+        }
+        if (stripe % SCRAMBLE_STRIPES == 0) {
+            for (int i = 0; i < 2; i++) {
+                __m128i a = _mm_xor_si128(_mm_xor_si128(acc[i], _mm_srli_epi64(acc[i], 47)), keys[i]);
+                __m128i low = _mm_mul_epu32(a, prime);
+                __m128i high = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+                acc[i] = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+            }
+        }
+    }
+    _mm_storeu_si128((__m128i*)lanes, acc[0]);
+    _mm_storeu_si128((__m128i*)(lanes + 2), acc[1]);
+}
+#else
+static void accumulate(uint64_t* lanes, const uint64_t* key, const uint8_t*& p, const uint8_t* end) {
+    for (size_t stripe = 1; p + 32 <= end; p += 32, stripe++) {
+        for (int i = 0; i < 4; i++) {
+            uint64_t data = read64(p + i * 8);
+            uint64_t keyed = data ^ key[i];
+            lanes[i] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+            lanes[i ^ 1] += data;
+        }
+        if (stripe % SCRAMBLE_STRIPES == 0) {
+            for (int i = 0; i < 4; i++) {
+                lanes[i] = (lanes[i] ^ (lanes[i] >> 47) ^ key[i]) * PRIME32;
+            }
+        }
+    }
+}
+#endif
+
+uint64_t hash64(const void* data, size_t size, uint64_t seed) {
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        uint64_t lanes[4] = {PRIME3, PRIME4, PRIME2, PRIME5};
+        uint64_t key[4] = {PRIME1 + seed, PRIME2 - seed, PRIME3 + seed, PRIME4 - seed};
+        accumulate(lanes, key, p, end);
+        h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = (h ^ round(0, lanes[i])) * PRIME1 + PRIME4;
+        }
+    } else {
+        h = seed + PRIME5;
+    }
+    h += size;
+
+    for (; p + 8 <= end; p += 8) {
+        h = rotl(h ^ round(0, read64(p)), 27) * PRIME1 + PRIME4;
+    }
+    for (; p < end; p++) {
+        h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+    }
+
+    // avalanche
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+}  // namespace NebulaEmu
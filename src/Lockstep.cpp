@@ -0,0 +1,152 @@
+#include "Lockstep.h"
+
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+namespace NebulaEmu {
+
+namespace {
+
+// a bit per component whose hashes differ, frame if any
+Lockstep::Divergence diff(uint64_t frame, const StateHash& a, const StateHash& b) {
+    Lockstep::Divergence divergence;
+    for (int i = 0; i < STATE_COMPONENTS; i++) {
+        if (a.components[i] != b.components[i]) {
+            divergence.components |= 1 << i;
+        }
+    }
+    if (divergence.components) {
+        divergence.frame = frame;
+    }
+    return divergence;
+}
+
+uint64_t splitmix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+void setButtons(uint64_t seed, uint64_t frame) {
+    controller->setButtons(0, Lockstep::input(seed, frame, 0));
+    controller->setButtons(1, Lockstep::input(seed, frame, 1));
+}
+
+}  // namespace
+
+string Lockstep::Divergence::describe() const {
+    string text = "frame " + to_string(frame) + " (";
+    bool first = true;
+    for (int i = 0; i < STATE_COMPONENTS; i++) {
+        if (components & (1 << i)) {
+            text += first ? "" : ", ";
+            text += getComponentName(i);
+            first = false;
+        }
+    }
+    return text + ")";
+}
+
+uint8_t Lockstep::input(uint64_t seed, uint64_t frame, int port) {
+    uint64_t bits = splitmix((seed * 2 + port) ^ splitmix(frame / 8));
+    // start and select once in 8 patterns, never both directions of an axis
+    uint8_t buttons = bits & ~(Controller::Start | Controller::Select);
+    if ((bits >> 8 & 7) == 0) {
+        buttons |= (bits >> 11 & 1) ? Controller::Start : Controller::Select;
+    }
+    if ((buttons & Controller::Up) && (buttons & Controller::Down)) {
+        buttons &= ~Controller::Down;
+    }
+    if ((buttons & Controller::Left) && (buttons & Controller::Right)) {
+        buttons &= ~Controller::Right;
+    }
+    return buttons;
+}
+
+Lockstep::Divergence Lockstep::compare(Session* a, Session* b, uint64_t frames, uint64_t seed) {
+    Session* selected = currentSession();
+    Session* sessions[2] = {a, b};
+    State state;
+    Divergence divergence;
+    for (uint64_t frame = 0; frame < frames && !divergence.found(); frame++) {
+        StateHash hashes[2];
+        for (int i = 0; i < 2; i++) {
+            selectSession(sessions[i]);
+            setButtons(seed, frame);
+            stepFrame();
+            hashState(state, hashes[i]);
+        }
+        divergence = diff(frame, hashes[0], hashes[1]);
+    }
+    selectSession(selected);
+    return divergence;
+}
+
+unique_ptr<Lockstep> Lockstep::record(const string& path, uint64_t seed) {
+    unique_ptr<Lockstep> lockstep(new Lockstep());
+    lockstep->_file = fopen(path.c_str(), "wb");
+    if (!lockstep->_file) {
+        cerr << "Failed to create hash log \"" << path << "\"" << endl;
+        return nullptr;
+    }
+    lockstep->_seed = seed;
+    uint32_t size = RECORD_SIZE;
+    fwrite("NBSH", 1, 4, lockstep->_file);
+    fwrite(&size, sizeof(size), 1, lockstep->_file);
+    fwrite(&seed, sizeof(seed), 1, lockstep->_file);
+    return lockstep;
+}
+
+unique_ptr<Lockstep> Lockstep::check(const string& path) {
+    unique_ptr<Lockstep> lockstep(new Lockstep());
+    lockstep->_file = fopen(path.c_str(), "rb");
+    if (!lockstep->_file) {
+        cerr << "Failed to open hash log \"" << path << "\"" << endl;
+        return nullptr;
+    }
+    char magic[4];
+    uint32_t size = 0;
+    if (fread(magic, 1, 4, lockstep->_file) != 4 || memcmp(magic, "NBSH", 4) != 0 ||
+        fread(&size, sizeof(size), 1, lockstep->_file) != 1 || size != RECORD_SIZE ||
+        fread(&lockstep->_seed, sizeof(lockstep->_seed), 1, lockstep->_file) != 1) {
+        cerr << "\"" << path << "\" is not a hash log of this version" << endl;
+        return nullptr;
+    }
+    lockstep->_checking = true;
+    return lockstep;
+}
+
+Lockstep::~Lockstep() {
+    if (_file) {
+        fclose(_file);
+    }
+}
+
+void Lockstep::setInput() { setButtons(_seed, _frame); }
+
+bool Lockstep::frame() {
+    if (_divergence.found()) {
+        return false;
+    }
+    StateHash hash;
+    hashState(_state, hash);
+    _frame++;
+    if (!_checking) {
+        fwrite(hash.components, RECORD_SIZE, 1, _file);
+        _frames++;
+        return true;
+    }
+    StateHash logged;
+    if (fread(logged.components, RECORD_SIZE, 1, _file) != 1) {
+        // the log ended, the frames after are not checked
+        return true;
+    }
+    _divergence = diff(_frames, logged, hash);
+    _frames++;
+    return !_divergence.found();
+}
+
+}  // namespace NebulaEmu
@@ -1,60 +1,401 @@
 #include <assert.h>
 
+#include <algorithm>
 #include <iostream>
 
+#include "CPU.h"
 #include "Cartridge.h"
+#include "PPU.h"
 namespace NebulaEmu {
 
 extern Cartridge* cartridge;
+extern CPU* cpu;
+extern PPU* ppu;
+
+// writes to CHR ROM land here
+static uint8_t CHRWriteSink[0x400];
 
 Mapper* Mapper::createMapper(uint32_t num) {
     switch (num) {
         case 0:
             return new MapperNROM();
+        case 1:
+            return new MapperMMC1();
+        case 2:
+            return new MapperUxROM();
+        case 3:
+            return new MapperCNROM();
+        case 4:
+            return new MapperMMC3();
         default:
             return nullptr;
     }
 }
 
-uint8_t MapperNROM::readPRG(uint16_t addr) {
+uint8_t* Mapper::getSRAMPtr(uint16_t addr) {
+    assert(cartridge->_PRG_RAM && "access not exist memory");
+    return &cartridge->_PRG_RAM[addr - 0x6000];
+}
+
+uint8_t Mapper::readSRAM(uint16_t addr) {
+    assert(cartridge->_PRG_RAM && "access not exist memory");
+    return cartridge->_PRG_RAM[addr - 0x6000];
+}
+
+void Mapper::writeSRAM(uint16_t addr, uint8_t data) {
+    assert(cartridge->_PRG_RAM && "access not exist memory");
+    cartridge->_PRG_RAM[addr - 0x6000] = data;
+    if (cartridge->_save) {
+        cartridge->_save->markDirty();
+    }
+}
+
+void Mapper::setMirroring(NameTableMirroring mirroring) {
+    _mirroring = mirroring;
+    // the mapper is reset before the PPU exists on the first load, PPU::reset picks the mode up then
+    if (ppu) {
+        ppu->setMirroring(mirroring);
+    }
+}
+
+void Mapper::serialize(State& state) {
+    state(_mirroring);
+    if (state.loading()) {
+        setMirroring(_mirroring);
+    }
+}
+
+uint32_t Mapper::getPRGBankCount() { return cartridge->_PRG_ROM.size() / 0x2000; }
+
+const uint8_t* Mapper::getPRGROM(uint32_t bank) { return &cartridge->_PRG_ROM[bank * 0x2000]; }
+
+void Mapper::patchPRGBank(int slot, int bank, const uint8_t* data) {
+    uint32_t count = getPRGBankCount();
+    if (_PRGPatches.empty()) {
+        _PRGPatches.resize(4 * count);
+    }
+    _PRGPatches[slot * count + bank] = data;
+    setPRGBank8K(slot, _PRGBankNumbers[slot]);
+}
+
+void Mapper::clearPRGPatches() {
+    _PRGPatches.clear();
+    for (int slot = 0; slot < 4; slot++) {
+        setPRGBank8K(slot, _PRGBankNumbers[slot]);
+    }
+}
+
+void Mapper::setPRGBank8K(int slot, int bank) {
+    int count = cartridge->_PRG_ROM.size() / 0x2000;
+    bank %= count;
+    if (bank < 0) {
+        bank += count;
+    }
+    _PRGBankNumbers[slot] = bank;
+    const uint8_t* patch = _PRGPatches.empty() ? nullptr : _PRGPatches[slot * count + bank];
+    _PRGBanks[slot] = patch ? patch : &cartridge->_PRG_ROM[bank * 0x2000];
+}
+
+void Mapper::setPRGBank16K(int slot, int bank) {
+    setPRGBank8K(slot * 2, bank * 2);
+    setPRGBank8K(slot * 2 + 1, bank * 2 + 1);
+}
+
+void Mapper::setPRGBank32K(int bank) {
+    setPRGBank16K(0, bank * 2);
+    setPRGBank16K(1, bank * 2 + 1);
+}
+
+void Mapper::setCHRBank1K(int slot, int bank) {
+    if (cartridge->_CHR_ROM.empty()) {
+        auto& CHR = cartridge->_CHR_RAM;
+        int count = CHR.size() / 0x400;
+        bank %= count;
+        if (bank < 0) {
+            bank += count;
+        }
+        _CHRBanks[slot] = _CHRWriteBanks[slot] = &CHR[bank * 0x400];
+    } else {
+        auto& CHR = cartridge->_CHR_ROM;
+        int count = CHR.size() / 0x400;
+        bank %= count;
+        if (bank < 0) {
+            bank += count;
+        }
+        _CHRBanks[slot] = &CHR[bank * 0x400];
+        _CHRWriteBanks[slot] = CHRWriteSink;
+    }
+}
+
+void Mapper::setCHRBank4K(int slot, int bank) {
+    for (int i = 0; i < 4; i++) {
+        setCHRBank1K(slot * 4 + i, bank * 4 + i);
+    }
+}
+
+void Mapper::setCHRBank8K(int bank) {
+    setCHRBank4K(0, bank * 2);
+    setCHRBank4K(1, bank * 2 + 1);
+}
+
+void MapperNROM::reset() {
     // CPU $8000-$BFFF: First 16 KB of ROM.
     // CPU $C000-$FFFF: Last 16 KB of ROM (NROM-256) or mirror of $8000-$BFFF (NROM-128).
-    if (cartridge->_PRG_ROM.size() > 0x4000) {  // NROM-256
-        return cartridge->_PRG_ROM[addr - 0x8000];
-    } else {  // NROM-128
-        return cartridge->_PRG_ROM[(addr - 0x8000) & 0x3fff];
+    setPRGBank16K(0, 0);
+    setPRGBank16K(1, -1);
+    setCHRBank8K(0);
+    setMirroring(cartridge->_mirroring);
+}
+
+void MapperNROM::writePRG(uint16_t addr, uint8_t data) {
+    // NROM has no register, games writing to ROM get no effect on real hardware
+    (void)addr;
+    (void)data;
+}
+
+void MapperMMC1::reset() {
+    _shift = 0;
+    _shiftCount = 0;
+    // the last bank is mapped at $C000 on power on
+    _control = 0x0C;
+    _CHRBank0 = _CHRBank1 = _PRGBank = 0;
+    setMirroring(cartridge->_mirroring);
+    updateBanks();
+}
+
+void MapperMMC1::writePRG(uint16_t addr, uint8_t data) {
+    // Writing a value with bit 7 set clears the shift register and locks the PRG ROM bank mode to 3
+    if (data & 0x80) {
+        _shift = 0;
+        _shiftCount = 0;
+        _control |= 0x0C;
+        updateBanks();
+        return;
+    }
+
+    // the register is loaded one bit at a time, lsb first, and copied on the fifth write
+    _shift |= (data & 1) << _shiftCount;
+    if (++_shiftCount < 5) {
+        return;
+    }
+
+    switch ((addr >> 13) & 0x3) {
+        case 0:  // $8000-$9FFF
+            _control = _shift;
+            break;
+        case 1:  // $A000-$BFFF
+            _CHRBank0 = _shift;
+            break;
+        case 2:  // $C000-$DFFF
+            _CHRBank1 = _shift;
+            break;
+        case 3:  // $E000-$FFFF
+            _PRGBank = _shift & 0x0F;
+            break;
+    }
+    _shift = 0;
+    _shiftCount = 0;
+    updateBanks();
+}
+
+void MapperMMC1::serialize(State& state) {
+    Mapper::serialize(state);
+    state(_shift, _shiftCount, _control, _CHRBank0, _CHRBank1, _PRGBank);
+    if (state.loading()) {
+        updateBanks();
     }
 }
 
-uint8_t MapperNROM::readCHR(uint16_t addr) { return cartridge->_CHR_ROM[addr]; }
+void MapperMMC1::updateBanks() {
+    switch (_control & 0x3) {
+        case 0:
+            setMirroring(SingleScreenLower);
+            break;
+        case 1:
+            setMirroring(SingleScreenUpper);
+            break;
+        case 2:
+            setMirroring(Vertical);
+            break;
+        case 3:
+            setMirroring(Horizontal);
+            break;
+    }
 
-void MapperNROM::wirtePRG(uint16_t addr, uint8_t data) {
-    (void)data;
-    std::cerr << "write only-read memory at " << addr << std::endl;
-    exit(1);
+    // SUROM/SXROM: bit 4 of the CHR bank selects the 256 KB half of a 512 KB PRG ROM
+    int outer = 0;
+    if (cartridge->_PRG_ROM.size() > 0x40000) {
+        outer = _CHRBank0 & 0x10;
+    }
+    switch ((_control >> 2) & 0x3) {
+        case 0:
+        case 1:
+            setPRGBank32K((outer | _PRGBank) >> 1);
+            break;
+        case 2:
+            setPRGBank16K(0, outer);
+            setPRGBank16K(1, outer | _PRGBank);
+            break;
+        case 3:
+            setPRGBank16K(0, outer | _PRGBank);
+            setPRGBank16K(1, outer | 0x0F);
+            break;
+    }
+
+    if (_control & 0x10) {
+        setCHRBank4K(0, _CHRBank0);
+        setCHRBank4K(1, _CHRBank1);
+    } else {
+        setCHRBank8K(_CHRBank0 >> 1);
+    }
 }
 
-void MapperNROM::wirteCHR(uint16_t addr, uint8_t data) {
-    (void)data;
-    std::cerr << "write only-read memory at " << addr << std::endl;
-    exit(1);
+void MapperUxROM::reset() {
+    // CPU $8000-$BFFF: 16 KB switchable PRG ROM bank
+    // CPU $C000-$FFFF: 16 KB PRG ROM bank, fixed to the last bank
+    _bank = 0;
+    setPRGBank16K(0, 0);
+    setPRGBank16K(1, -1);
+    setCHRBank8K(0);
+    setMirroring(cartridge->_mirroring);
 }
 
-uint8_t* Mapper::getSRAMPtr(uint16_t addr) {
-    assert(cartridge->_battery_backed_RAM && "access not exist memory");
-    return &cartridge->_battery_backed_RAM[addr - 0x6000];
+void MapperUxROM::writePRG(uint16_t addr, uint8_t data) {
+    (void)addr;
+    _bank = data;
+    setPRGBank16K(0, data);
 }
 
-uint8_t Mapper::readSRAM(uint16_t addr) {
-    assert(cartridge->_battery_backed_RAM && "access not exist memory");
-    return cartridge->_battery_backed_RAM[addr - 0x6000];
+void MapperUxROM::serialize(State& state) {
+    Mapper::serialize(state);
+    state(_bank);
+    if (state.loading()) {
+        setPRGBank16K(0, _bank);
+    }
 }
 
-void Mapper::writeSRAM(uint16_t addr, uint8_t data) {
-    assert(cartridge->_battery_backed_RAM && "access not exist memory");
-    cartridge->_battery_backed_RAM[addr - 0x6000] = data;
+void MapperCNROM::reset() {
+    _bank = 0;
+    setPRGBank16K(0, 0);
+    setPRGBank16K(1, -1);
+    setCHRBank8K(0);
+    setMirroring(cartridge->_mirroring);
+}
+
+void MapperCNROM::writePRG(uint16_t addr, uint8_t data) {
+    (void)addr;
+    // PPU $0000-$1FFF: 8 KB switchable CHR ROM bank
+    _bank = data;
+    setCHRBank8K(data);
 }
 
-NameTableMirroring Mapper::getNameTableMirroing() { return cartridge->_mirroring; }
+void MapperCNROM::serialize(State& state) {
+    Mapper::serialize(state);
+    state(_bank);
+    if (state.loading()) {
+        setCHRBank8K(_bank);
+    }
+}
+
+void MapperMMC3::reset() {
+    _bankSelect = 0;
+    // R6 and R7 start at the first two banks, the CHR registers at an identity layout
+    uint8_t registers[8] = {0, 2, 4, 5, 6, 7, 0, 1};
+    std::copy(registers, registers + 8, _registers);
+    _IRQLatch = _IRQCounter = 0;
+    _IRQReload = _IRQEnable = false;
+    setMirroring(cartridge->_mirroring);
+    updateBanks();
+}
+
+void MapperMMC3::writePRG(uint16_t addr, uint8_t data) {
+    bool even = !(addr & 1);
+    switch ((addr >> 13) & 0x3) {
+        case 0:  // $8000-$9FFF
+            if (even) {
+                _bankSelect = data;
+            } else {
+                _registers[_bankSelect & 0x7] = data;
+            }
+            updateBanks();
+            break;
+        case 1:  // $A000-$BFFF
+            // mirroring is hardwired on four-screen boards; odd addresses protect PRG RAM, which is not emulated
+            if (even && cartridge->_mirroring != FourScreen) {
+                setMirroring(data & 1 ? Horizontal : Vertical);
+            }
+            break;
+        case 2:  // $C000-$DFFF
+            if (even) {
+                _IRQLatch = data;
+            } else {
+                // the counter is reloaded on the next rising edge of A12
+                _IRQCounter = 0;
+                _IRQReload = true;
+            }
+            break;
+        case 3:  // $E000-$FFFF
+            _IRQEnable = !even;
+            // writing to $E000 also acknowledges any pending interrupt
+            if (even) {
+                cpu->clearIRQ(MapperIRQ);
+            }
+            break;
+    }
+}
+
+void MapperMMC3::updateBanks() {
+    if (_bankSelect & 0x40) {
+        setPRGBank8K(0, -2);
+        setPRGBank8K(2, _registers[6]);
+    } else {
+        setPRGBank8K(0, _registers[6]);
+        setPRGBank8K(2, -2);
+    }
+    setPRGBank8K(1, _registers[7]);
+    setPRGBank8K(3, -1);
+
+    // with inversion the 2 KB banks are at $1000 and the 1 KB banks at $0000
+    int invert = (_bankSelect & 0x80) ? 4 : 0;
+    setCHRBank1K(0 ^ invert, _registers[0] & 0xFE);
+    setCHRBank1K(1 ^ invert, _registers[0] | 0x01);
+    setCHRBank1K(2 ^ invert, _registers[1] & 0xFE);
+    setCHRBank1K(3 ^ invert, _registers[1] | 0x01);
+    setCHRBank1K(4 ^ invert, _registers[2]);
+    setCHRBank1K(5 ^ invert, _registers[3]);
+    setCHRBank1K(6 ^ invert, _registers[4]);
+    setCHRBank1K(7 ^ invert, _registers[5]);
+}
+
+void MapperMMC3::serialize(State& state) {
+    Mapper::serialize(state);
+    state(_bankSelect, _registers, _IRQLatch, _IRQCounter, _IRQReload, _IRQEnable);
+    if (state.loading()) {
+        updateBanks();
+    }
+}
+
+void MapperMMC3::clockA12() {
+    if (_IRQCounter == 0 || _IRQReload) {
+        _IRQCounter = _IRQLatch;
+        _IRQReload = false;
+    } else {
+        _IRQCounter--;
+    }
+    if (_IRQCounter == 0 && _IRQEnable) {
+        cpu->setIRQ(MapperIRQ);
+    }
+}
+
+int MapperMMC3::getIRQClocks() {
+    if (!_IRQEnable) {
+        return 0;
+    }
+    // a reload takes one edge, then the counter counts down from the latch
+    if (_IRQCounter == 0 || _IRQReload) {
+        return _IRQLatch + 1;
+    }
+    return _IRQCounter;
+}
 
 }  // namespace NebulaEmu
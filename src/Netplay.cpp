@@ -0,0 +1,243 @@
+#include "Netplay.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "Emulator.h"
+
+namespace NebulaEmu {
+
+#ifndef _WIN32
+
+namespace {
+
+// a datagram socket bound to the local address and sending to the peer, UDP or Unix domain
+class SocketTransport : public Transport {
+public:
+    SocketTransport(int socket, sockaddr_storage peer, socklen_t peerSize, std::string unlinkPath)
+        : _socket(socket), _peer(peer), _peerSize(peerSize), _unlinkPath(unlinkPath) {}
+
+    ~SocketTransport() {
+        close(_socket);
+        if (!_unlinkPath.empty()) {
+            unlink(_unlinkPath.c_str());
+        }
+    }
+
+    // a peer that is not up yet refuses the packet, it is sent again with the next frame
+    void send(const void* data, size_t size) { sendto(_socket, data, size, 0, (sockaddr*)&_peer, _peerSize); }
+
+    size_t receive(void* data, size_t capacity) {
+        ssize_t size = recv(_socket, data, capacity, MSG_DONTWAIT);
+        return size > 0 ? size : 0;
+    }
+
+private:
+    int _socket;
+    sockaddr_storage _peer;
+    socklen_t _peerSize;
+    std::string _unlinkPath;
+};
+
+std::unique_ptr<Transport> openUDP(const std::string& localPort, const std::string& host, const std::string& port) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* peer;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &peer) != 0) {
+        std::cerr << "Can not resolve netplay peer " << host << ":" << port << std::endl;
+        return nullptr;
+    }
+    int fd = socket(peer->ai_family, SOCK_DGRAM, 0);
+    sockaddr_storage local = {};
+    local.ss_family = peer->ai_family;
+    uint16_t number = htons(atoi(localPort.c_str()));
+    if (peer->ai_family == AF_INET6) {
+        ((sockaddr_in6*)&local)->sin6_port = number;
+    } else {
+        ((sockaddr_in*)&local)->sin_port = number;
+    }
+    socklen_t localSize = peer->ai_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+    if (fd < 0 || bind(fd, (sockaddr*)&local, localSize) != 0) {
+        std::cerr << "Can not bind netplay port " << localPort << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        freeaddrinfo(peer);
+        return nullptr;
+    }
+    sockaddr_storage address = {};
+    memcpy(&address, peer->ai_addr, peer->ai_addrlen);
+    socklen_t size = peer->ai_addrlen;
+    freeaddrinfo(peer);
+    return std::make_unique<SocketTransport>(fd, address, size, "");
+}
+
+std::unique_ptr<Transport> openUnix(const std::string& localPath, const std::string& peerPath) {
+    sockaddr_un local = {}, peer = {};
+    if (localPath.size() >= sizeof(local.sun_path) || peerPath.size() >= sizeof(peer.sun_path)) {
+        std::cerr << "Netplay socket path too long" << std::endl;
+        return nullptr;
+    }
+    local.sun_family = peer.sun_family = AF_UNIX;
+    strcpy(local.sun_path, localPath.c_str());
+    strcpy(peer.sun_path, peerPath.c_str());
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    // a socket file left by a previous session
+    unlink(localPath.c_str());
+    if (fd < 0 || bind(fd, (sockaddr*)&local, sizeof(local)) != 0) {
+        std::cerr << "Can not bind netplay socket \"" << localPath << "\"" << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return nullptr;
+    }
+    sockaddr_storage address = {};
+    memcpy(&address, &peer, sizeof(peer));
+    return std::make_unique<SocketTransport>(fd, address, sizeof(peer), localPath);
+}
+
+}  // namespace
+
+std::unique_ptr<Transport> Transport::open(const std::string& spec) {
+    std::vector<std::string> parts;
+    size_t begin = 0;
+    while (true) {
+        size_t colon = spec.find(':', begin);
+        parts.push_back(spec.substr(begin, colon - begin));
+        if (colon == std::string::npos) {
+            break;
+        }
+        begin = colon + 1;
+    }
+    if (parts.size() == 4 && parts[0] == "udp") {
+        return openUDP(parts[1], parts[2], parts[3]);
+    }
+    if (parts.size() == 3 && parts[0] == "unix") {
+        return openUnix(parts[1], parts[2]);
+    }
+    std::cerr << "invalid netplay transport \"" << spec << "\", expected udp:LOCAL_PORT:HOST:PORT or "
+              << "unix:LOCAL_PATH:PEER_PATH" << std::endl;
+    return nullptr;
+}
+
+#else
+
+std::unique_ptr<Transport> Transport::open(const std::string& spec) {
+    (void)spec;
+    std::cerr << "netplay sockets are not supported on Windows" << std::endl;
+    return nullptr;
+}
+
+#endif
+
+namespace {
+
+// "NBNP", the frame of the first input, the number of remote inputs received, the input count and the inputs
+constexpr size_t HEADER_SIZE = 13;
+
+void put32(uint8_t* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out[i] = value >> (i * 8);
+    }
+}
+
+uint32_t get32(const uint8_t* in) { return in[0] | in[1] << 8 | in[2] << 16 | (uint32_t)in[3] << 24; }
+
+}  // namespace
+
+Netplay::Netplay(std::unique_ptr<Transport> transport, int player, uint32_t delay)
+    : _transport(std::move(transport)), _player(player), _localCount(delay), _states(MAX_ROLLBACK + 1) {}
+
+bool Netplay::advance() {
+    uint8_t host = controller->getButtons(0);
+    receive();
+    // the peer is too far behind, keep sending so it catches up
+    if (_frame >= _remoteCount + MAX_ROLLBACK) {
+        send();
+        return false;
+    }
+    _local[_localCount++ % HISTORY] = host;
+    send();
+
+    if (_rollbackFrom < _frame) {
+        _rollbacks++;
+        loadState(_states[_rollbackFrom % _states.size()]);
+        setRender(false);
+        for (uint64_t frame = _rollbackFrom; frame < _frame; frame++) {
+            simulate(frame);
+            _resimulated++;
+        }
+        setRender(true);
+    }
+    _rollbackFrom = UINT64_MAX;
+    simulate(_frame++);
+
+    // joystick 0 holds the host input between frames
+    controller->setButtons(0, host);
+    return true;
+}
+
+void Netplay::simulate(uint64_t frame) {
+    saveState(_states[frame % _states.size()]);
+    uint8_t remote = 0;
+    if (frame < _remoteCount) {
+        remote = _remote[frame % HISTORY];
+    } else if (_remoteCount > 0) {
+        remote = _remote[(_remoteCount - 1) % HISTORY];
+    }
+    _predicted[frame % HISTORY] = remote;
+    controller->setButtons(_player, _local[frame % HISTORY]);
+    controller->setButtons(!_player, remote);
+    stepFrame();
+}
+
+// every local input the peer did not acknowledge yet
+void Netplay::send() {
+    uint8_t packet[HEADER_SIZE + HISTORY];
+    uint64_t first = std::max(_acknowledged, _localCount > HISTORY ? _localCount - HISTORY : 0);
+    uint8_t count = _localCount - first;
+    memcpy(packet, "NBNP", 4);
+    put32(packet + 4, first);
+    put32(packet + 8, _remoteCount);
+    packet[12] = count;
+    for (uint8_t i = 0; i < count; i++) {
+        packet[HEADER_SIZE + i] = _local[(first + i) % HISTORY];
+    }
+    _transport->send(packet, HEADER_SIZE + count);
+}
+
+void Netplay::receive() {
+    uint8_t packet[HEADER_SIZE + HISTORY];
+    size_t size;
+    while ((size = _transport->receive(packet, sizeof(packet))) != 0) {
+        if (size < HEADER_SIZE || memcmp(packet, "NBNP", 4) != 0 || size != HEADER_SIZE + packet[12]) {
+            continue;
+        }
+        uint64_t first = get32(packet + 4);
+        _acknowledged = std::max<uint64_t>(_acknowledged, get32(packet + 8));
+        // inputs are taken in order, a gap is filled by a later packet
+        for (uint64_t frame = first; frame < first + packet[12]; frame++) {
+            if (frame != _remoteCount) {
+                continue;
+            }
+            uint8_t input = packet[HEADER_SIZE + frame - first];
+            _remote[frame % HISTORY] = input;
+            if (frame < _frame && _predicted[frame % HISTORY] != input) {
+                _rollbackFrom = std::min(_rollbackFrom, frame);
+            }
+            _remoteCount++;
+        }
+    }
+}
+
+}  // namespace NebulaEmu
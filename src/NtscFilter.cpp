@@ -0,0 +1,187 @@
+#include "NtscFilter.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "PPU.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace NebulaEmu {
+
+namespace {
+
+// voltages of the low and high half of the square wave for the 4 luma levels, black and white, emphasis attenuation
+const float levels[8] = {0.350f, 0.518f, 0.962f, 1.550f, 1.094f, 1.506f, 1.962f, 1.962f};
+const float black = 0.518f;
+const float white = 1.962f;
+const float attenuation = 0.746f;
+
+// normalized level of a sample of pixel 0bEEELLCCCC at a subcarrier phase
+float signal(int pixel, int phase) {
+    int color = pixel & 0x0F;
+    int level = color > 13 ? 1 : (pixel >> 4) & 3;
+    int emphasis = pixel >> 6;
+    float low = levels[level];
+    float high = levels[4 + level];
+    if (color == 0) {
+        low = high;
+    } else if (color > 12) {
+        high = low;
+    }
+    auto inPhase = [&](int c) { return (c + phase) % 12 < 6; };
+    float v = inPhase(color) ? high : low;
+    if (((emphasis & 1) && inPhase(0)) || ((emphasis & 2) && inPhase(4)) || ((emphasis & 4) && inPhase(8))) {
+        v *= attenuation;
+    }
+    return (v - black) / (white - black);
+}
+
+// Hann window centered on the middle of the current pixel, samples 3 and 4
+float window(int sample, float width) {
+    float d = sample - 3.5f;
+    return fabs(d) < width / 2 ? 0.5f + 0.5f * cos(2 * M_PI * d / width) : 0;
+}
+
+// burst phase and chroma gain of the decoder, fitted so solid colours land on the RGB palette of the PPU
+const float hue = 120 * M_PI / 180;
+const float saturation = 0.8f;
+
+}  // namespace
+
+NtscFilter::NtscFilter() {
+    float lumaSum = 0, chromaSum = 0;
+    for (int sample = -8; sample < 16; sample++) {
+        lumaSum += window(sample, 12);
+        chromaSum += window(sample, 24);
+    }
+    for (int phase = 0; phase < 3; phase++) {
+        for (int tap = 0; tap < 3; tap++) {
+            for (int pixel = 0; pixel < 512; pixel++) {
+                float y = 0, i = 0, q = 0;
+                for (int s = 0; s < 8; s++) {
+                    int sample = (tap - 1) * 8 + s;
+                    int p = (phase * 4 + sample + 24) % 12;
+                    float v = signal(pixel, p);
+                    y += window(sample, 12) * v / lumaSum;
+                    i += window(sample, 24) * v * cos(M_PI * p / 6 + hue) * 2 * saturation / chromaSum;
+                    q += window(sample, 24) * v * sin(M_PI * p / 6 + hue) * 2 * saturation / chromaSum;
+                }
+                float r = y + 0.956f * i + 0.621f * q;
+                float g = y - 0.272f * i - 0.647f * q;
+                float b = y - 1.106f * i + 1.703f * q;
+                int16_t* k = _kernels[phase][tap][pixel];
+                k[0] = tap == 1 ? 255 * 16 : 0;
+                k[1] = lround(b * 255 * 16);
+                k[2] = lround(g * 255 * 16);
+                k[3] = lround(r * 255 * 16);
+            }
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        _inputs[i].resize(SCREEN_WIDTH * SCREEN_HEIGHT);
+        _outputs[i].resize(SCREEN_WIDTH * SCREEN_HEIGHT, 0x000000FF);
+    }
+    _input = _inputs[0].data();
+    _pending = _inputs[1].data();
+    _processing = _inputs[2].data();
+    _back = _outputs[0].data();
+    _ready = _outputs[1].data();
+    _front = _outputs[2].data();
+    _worker = thread(&NtscFilter::workerLoop, this);
+}
+
+NtscFilter::~NtscFilter() {
+    {
+        lock_guard<mutex> lock(_mutex);
+        _quit = true;
+    }
+    _wake.notify_one();
+    _worker.join();
+}
+
+// a frame the worker did not start yet is replaced
+uint16_t* NtscFilter::submit(uint16_t* frame, int phase) {
+    {
+        lock_guard<mutex> lock(_mutex);
+        swap(frame, _pending);
+        _pendingPhase = phase;
+        _hasPending = true;
+    }
+    _wake.notify_one();
+    return frame;
+}
+
+const uint32_t* NtscFilter::output() {
+    lock_guard<mutex> lock(_mutex);
+    if (_hasReady) {
+        swap(_front, _ready);
+        _hasReady = false;
+    }
+    return _front;
+}
+
+void NtscFilter::workerLoop() {
+    unique_lock<mutex> lock(_mutex);
+    while (true) {
+        _wake.wait(lock, [&] { return _quit || _hasPending; });
+        if (_quit) {
+            return;
+        }
+        swap(_processing, _pending);
+        _hasPending = false;
+        int phase = _pendingPhase;
+        lock.unlock();
+        filter(_processing, phase, _back);
+        lock.lock();
+        swap(_back, _ready);
+        _hasReady = true;
+    }
+}
+
+// Pixel x of line y starts at phase (frame phase + 4 * y + 8 * (x + 1)) % 12, so the phase of the kernels cycles
+// through 3 values along the line. The line is padded with black on both sides.
+void NtscFilter::filter(const uint16_t* frame, int phase, uint32_t* out) {
+    uint16_t line[SCREEN_WIDTH + 2];
+    line[0] = line[SCREEN_WIDTH + 1] = 0x0F;
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        copy(frame + y * SCREEN_WIDTH, frame + (y + 1) * SCREEN_WIDTH, line + 1);
+        int first = (phase + 4 * y + 8) % 12 / 4;
+        uint32_t* row = out + y * SCREEN_WIDTH;
+#ifdef __SSE2__
+        // 2 pixels per 128-bit sum, the phase of the next pixel is 2 steps further
+        auto pair = [&](int x) {
+            const uint16_t* p = line + x;
+            int k0 = (first + 2 * x) % 3, k1 = (k0 + 2) % 3;
+            __m128i previous = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)_kernels[k0][0][p[0]]),
+                                                  _mm_loadl_epi64((const __m128i*)_kernels[k1][0][p[1]]));
+            __m128i current = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)_kernels[k0][1][p[1]]),
+                                                 _mm_loadl_epi64((const __m128i*)_kernels[k1][1][p[2]]));
+            __m128i next = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)_kernels[k0][2][p[2]]),
+                                              _mm_loadl_epi64((const __m128i*)_kernels[k1][2][p[3]]));
+            return _mm_srai_epi16(_mm_adds_epi16(_mm_adds_epi16(previous, current), next), 4);
+        };
+        for (int x = 0; x < SCREEN_WIDTH; x += 4) {
+            _mm_storeu_si128((__m128i*)(row + x), _mm_packus_epi16(pair(x), pair(x + 2)));
+        }
+#else
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            int k = (first + 2 * x) % 3;
+            uint32_t pixel = 0;
+            for (int channel = 0; channel < 4; channel++) {
+                int sum = _kernels[k][0][line[x]][channel] + _kernels[k][1][line[x + 1]][channel] +
+                          _kernels[k][2][line[x + 2]][channel];
+                pixel |= clamp(sum >> 4, 0, 255) << (channel * 8);
+            }
+            row[x] = pixel;
+        }
+#endif
+    }
+}
+
+}  // namespace NebulaEmu
@@ -0,0 +1,261 @@
+#include "Observation.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "Emulator.h"
+#include "PPU.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace NebulaEmu {
+
+namespace {
+
+// BT.601 luma of the 64 palette entries, and of every pair of them: pairs[a | b << 6] holds the luma of a then b in
+// memory order, so one lookup gives two pixels
+struct GreyTable {
+    uint8_t luma[64];
+    uint16_t pairs[64 * 64];
+
+    GreyTable() {
+        for (int i = 0; i < 64; i++) {
+            uint32_t color = systemPalette[i];
+            uint32_t r = color >> 24, g = (color >> 16) & 0xFF, b = (color >> 8) & 0xFF;
+            luma[i] = (r * 299 + g * 587 + b * 114 + 500) / 1000;
+        }
+        for (int i = 0; i < 64 * 64; i++) {
+            uint8_t pair[2] = {luma[i & 0x3F], luma[i >> 6]};
+            memcpy(&pairs[i], pair, 2);
+        }
+    }
+};
+
+const GreyTable greyTable;
+
+// sums[x] += the luma of line[x], or = on the first row of a box; a box is at most 240 rows of 255 so the sums fit in
+// 16 bits. The lookups go through memory a whole line at a time, SSE2 builds the pair indexes and adds the lumas 16
+// pixels at once.
+template <bool First>
+void accumulate(uint16_t* sums, const uint8_t* line) {
+    alignas(16) uint16_t indexes[SCREEN_WIDTH / 2];
+    alignas(16) uint16_t grey[SCREEN_WIDTH / 2];
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i low = _mm_set1_epi16(0x3F);
+    const __m128i high = _mm_set1_epi16(0x3F << 6);
+    for (; x < SCREEN_WIDTH; x += 16) {
+        // the even pixel in bits 0-5 and the odd one in bits 6-11 of every 16-bit lane
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(line + x));
+        __m128i pair = _mm_or_si128(_mm_and_si128(pixels, low), _mm_and_si128(_mm_srli_epi16(pixels, 2), high));
+        _mm_store_si128((__m128i*)(indexes + x / 2), pair);
+    }
+#endif
+    for (; x < SCREEN_WIDTH; x += 2) {
+        indexes[x / 2] = (line[x] & 0x3F) | (line[x + 1] & 0x3F) << 6;
+    }
+    // four independent lookups an iteration, the loop itself would cost as much as a lookup
+    for (int i = 0; i < SCREEN_WIDTH / 2; i += 4) {
+        grey[i] = greyTable.pairs[indexes[i]];
+        grey[i + 1] = greyTable.pairs[indexes[i + 1]];
+        grey[i + 2] = greyTable.pairs[indexes[i + 2]];
+        grey[i + 3] = greyTable.pairs[indexes[i + 3]];
+    }
+
+    x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; x < SCREEN_WIDTH; x += 16) {
+        __m128i bytes = _mm_load_si128((const __m128i*)(grey + x / 2));
+        __m128i first = First ? zero : _mm_loadu_si128((const __m128i*)(sums + x));
+        __m128i second = First ? zero : _mm_loadu_si128((const __m128i*)(sums + x + 8));
+        _mm_storeu_si128((__m128i*)(sums + x), _mm_add_epi16(first, _mm_unpacklo_epi8(bytes, zero)));
+        _mm_storeu_si128((__m128i*)(sums + x + 8), _mm_add_epi16(second, _mm_unpackhi_epi8(bytes, zero)));
+    }
+#endif
+    for (; x < SCREEN_WIDTH; x++) {
+        sums[x] = (First ? 0 : sums[x]) + ((const uint8_t*)grey)[x];
+    }
+}
+
+// prefix[x] = sums[0] + ... + sums[x - 1] modulo 2^16, the columns of a box under 65536 sum to the difference of two
+// of them. SSE2 scans 8 columns at a time, only the carry between them is serial.
+void prefixSums(uint16_t* prefix, const uint16_t* sums) {
+    prefix[0] = 0;
+    int x = 0;
+#ifdef __SSE2__
+    __m128i carry = _mm_setzero_si128();
+    for (; x < SCREEN_WIDTH; x += 8) {
+        __m128i columns = _mm_loadu_si128((const __m128i*)(sums + x));
+        columns = _mm_add_epi16(columns, _mm_slli_si128(columns, 2));
+        columns = _mm_add_epi16(columns, _mm_slli_si128(columns, 4));
+        columns = _mm_add_epi16(columns, _mm_slli_si128(columns, 8));
+        _mm_storeu_si128((__m128i*)(prefix + x + 1), _mm_add_epi16(columns, carry));
+        __m128i last = _mm_shufflehi_epi16(columns, 0xFF);
+        carry = _mm_add_epi16(carry, _mm_unpackhi_epi64(last, last));
+    }
+#endif
+    for (; x < SCREEN_WIDTH; x++) {
+        prefix[x + 1] = prefix[x] + sums[x];
+    }
+}
+
+// boxes[x] = sums[2x] + sums[2x + 1], the boxes of a power of two columns are summed in pairs without prefix sums
+void pairColumns(uint32_t* boxes, const uint16_t* sums) {
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i low = _mm_set1_epi32(0xFFFF);
+    for (; x < SCREEN_WIDTH; x += 8) {
+        __m128i columns = _mm_loadu_si128((const __m128i*)(sums + x));
+        __m128i pairs = _mm_add_epi32(_mm_and_si128(columns, low), _mm_srli_epi32(columns, 16));
+        _mm_storeu_si128((__m128i*)(boxes + x / 2), pairs);
+    }
+#endif
+    for (; x < SCREEN_WIDTH; x += 2) {
+        boxes[x / 2] = sums[x] + sums[x + 1];
+    }
+}
+
+// boxes[i] = boxes[2i] + boxes[2i + 1] for the count boxes, in place
+void pairBoxes(uint32_t* boxes, uint32_t count) {
+    uint32_t i = 0;
+#ifdef __SSE2__
+    for (; i + 8 <= count; i += 8) {
+        __m128 first = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(boxes + i)));
+        __m128 second = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(boxes + i + 4)));
+        __m128i even = _mm_castps_si128(_mm_shuffle_ps(first, second, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i odd = _mm_castps_si128(_mm_shuffle_ps(first, second, _MM_SHUFFLE(3, 1, 3, 1)));
+        _mm_storeu_si128((__m128i*)(boxes + i / 2), _mm_add_epi32(even, odd));
+    }
+#endif
+    for (; i < count; i += 2) {
+        boxes[i / 2] = boxes[i] + boxes[i + 1];
+    }
+}
+
+// out[x] = boxes[x] / the pixels of the box, rounded. A box of n pixels sums to at most 255n and its reciprocal is
+// about 2^24 / n, so the product fits in 32 bits; SSE2 multiplies the even and odd lanes of 4 boxes at a time.
+void average(uint8_t* out, const uint32_t* boxes, const uint32_t* reciprocal, uint32_t width) {
+    uint32_t x = 0;
+#ifdef __SSE2__
+    const __m128i half = _mm_set1_epi64x(1u << 23);
+    for (; x + 4 <= width; x += 4) {
+        __m128i sums = _mm_loadu_si128((const __m128i*)(boxes + x));
+        __m128i scales = _mm_loadu_si128((const __m128i*)(reciprocal + x));
+        __m128i even = _mm_add_epi64(_mm_mul_epu32(sums, scales), half);
+        __m128i odd = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(sums, 32), _mm_srli_epi64(scales, 32)), half);
+        __m128i averages = _mm_or_si128(_mm_srli_epi64(even, 24), _mm_slli_epi64(_mm_srli_epi64(odd, 24), 32));
+        averages = _mm_packs_epi32(averages, averages);
+        uint32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(averages, averages));
+        memcpy(out + x, &bytes, 4);
+    }
+#endif
+    for (; x < width; x++) {
+        out[x] = (boxes[x] * reciprocal[x] + (1u << 23)) >> 24;
+    }
+}
+
+}  // namespace
+
+Observation::Observation(Mode mode, uint32_t width, uint32_t height, uint32_t stack)
+    : _mode(mode),
+      // every box needs at least a pixel of the screen
+      _width(clamp<uint32_t>(width, 1, SCREEN_WIDTH)),
+      _height(clamp<uint32_t>(height, 1, SCREEN_HEIGHT)),
+      _stack(max<uint32_t>(stack, 1)),
+      // 256 / width is then a power of two
+      _paired(SCREEN_WIDTH % _width == 0 && _width < SCREEN_WIDTH),
+      _columns(_width + 1),
+      _rows(_height + 1),
+      _reciprocals(_width * _height),
+      _frames(_width * _height * _stack * 2) {
+    for (uint32_t i = 0; i <= _width; i++) {
+        _columns[i] = i * SCREEN_WIDTH / _width;
+    }
+    for (uint32_t i = 0; i <= _height; i++) {
+        _rows[i] = i * SCREEN_HEIGHT / _height;
+    }
+    uint32_t largest = 0;
+    for (uint32_t y = 0; y < _height; y++) {
+        for (uint32_t x = 0; x < _width; x++) {
+            uint32_t pixels = (_rows[y + 1] - _rows[y]) * (_columns[x + 1] - _columns[x]);
+            _reciprocals[y * _width + x] = ((1u << 24) + pixels / 2) / pixels;
+            largest = max(largest, pixels);
+        }
+    }
+    _narrow = largest * 255 < 0x10000;
+}
+
+void Observation::update() {
+    size_t size = frameSize();
+    uint8_t* slot = &_frames[_head * size];
+    downsample(slot);
+    if (_count == 0) {
+        for (uint32_t i = 0; i < _stack * 2; i++) {
+            if (i != _head) {
+                memcpy(&_frames[i * size], slot, size);
+            }
+        }
+    } else {
+        memcpy(slot + _stack * size, slot, size);
+    }
+    _head = (_head + 1) % _stack;
+    _count++;
+}
+
+// members are copied to locals, stores through out could alias them
+void Observation::downsample(uint8_t* out) {
+    const uint8_t* screen = ppu->getScreen();
+    const uint32_t* columns = _columns.data();
+    const uint32_t* rows = _rows.data();
+    const uint32_t width = _width, height = _height;
+    if (_mode == Index) {
+        for (uint32_t y = 0; y < height; y++) {
+            const uint8_t* line = screen + (rows[y] + rows[y + 1]) / 2 * SCREEN_WIDTH;
+            for (uint32_t x = 0; x < width; x++) {
+                out[x] = line[(columns[x] + columns[x + 1]) / 2];
+            }
+            out += width;
+        }
+        return;
+    }
+
+    alignas(16) uint16_t sums[SCREEN_WIDTH];
+    uint16_t prefix[SCREEN_WIDTH + 1];
+    uint32_t boxes[SCREEN_WIDTH];
+    const uint32_t* reciprocal = _reciprocals.data();
+    const bool paired = _paired, narrow = _narrow;
+    for (uint32_t y = 0; y < height; y++) {
+        accumulate<true>(sums, screen + rows[y] * SCREEN_WIDTH);
+        for (uint32_t row = rows[y] + 1; row < rows[y + 1]; row++) {
+            accumulate<false>(sums, screen + row * SCREEN_WIDTH);
+        }
+        if (paired) {
+            pairColumns(boxes, sums);
+            for (uint32_t count = SCREEN_WIDTH / 2; count > width; count /= 2) {
+                pairBoxes(boxes, count);
+            }
+        } else if (narrow) {
+            prefixSums(prefix, sums);
+            for (uint32_t x = 0; x < width; x++) {
+                boxes[x] = (uint16_t)(prefix[columns[x + 1]] - prefix[columns[x]]);
+            }
+        } else {
+            for (uint32_t x = 0; x < width; x++) {
+                boxes[x] = 0;
+                for (uint32_t column = columns[x]; column < columns[x + 1]; column++) {
+                    boxes[x] += sums[column];
+                }
+            }
+        }
+        average(out, boxes, reciprocal, width);
+        out += width;
+        reciprocal += width;
+    }
+}
+
+}  // namespace NebulaEmu
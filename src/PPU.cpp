@@ -6,14 +6,17 @@
 
 #include "CPU.h"
 #include "Cartridge.h"
+#include "Profiler.h"
+#include "Telemetry.h"
 namespace NebulaEmu {
 
 extern Cartridge* cartridge;
 extern CPU* cpu;
 
 extern uint32_t* pixels;
+extern uint16_t* indices;
 
-const uint32_t systemPalette[] = {
+const uint32_t systemPalette[64] = {
     0x666666ff, 0x002a88ff, 0x1412a7ff, 0x3b00a4ff, 0x5c007eff, 0x6e0040ff, 0x6c0600ff, 0x561d00ff,
     0x333500ff, 0x0b4800ff, 0x005200ff, 0x004f08ff, 0x00404dff, 0x000000ff, 0x000000ff, 0x000000ff,
     0xadadadff, 0x155fd9ff, 0x4240ffff, 0x7527feff, 0xa01accff, 0xb71e7bff, 0xb53120ff, 0x994e00ff,
@@ -24,87 +27,132 @@ const uint32_t systemPalette[] = {
     0xe4e594ff, 0xcfef96ff, 0xbdf4abff, 0xb3f3ccff, 0xb5ebf2ff, 0xb8b8b8ff, 0x000000ff, 0x000000ff,
 };
 
+void PPU::powerOn() {
+    _oddFrame = false;
+    _framePhase = 0;
+    _scanline = 0;
+    _cycles = 0;
+    _bgPatternLow = _bgPatternHigh = 0;
+    _bgAttributeLow = _bgAttributeHigh = 0;
+    reset();
+}
+
 void PPU::reset() {
+    _mapper = cartridge->getMapper();
+    setMirroring(_mapper->getNameTableMirroing());
+
     _PPUCTRL.value = _PPUSTATUS.value = 0;
     _PPUMASK.value = 0x1E;
 
-    _oddFrame = false;
-
     _v = 0;
     _x = 0;
     _w = 0;
 
     _OAMADDR = 0;
 
-    _scanline = 261;
-    _cycles = 0;
+    updateA12Dot();
 };
 
+void PPU::convertScreen(uint32_t* out) {
+    const uint8_t* screen = &_screen[0][0];
+    for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+        out[i] = systemPalette[screen[i]];
+    }
+}
+
+void PPU::serialize(State& state) {
+    state(_PPUCTRL.value, _PPUMASK.value, _PPUSTATUS.value, _oddFrame, _v, _t, _x, _w, _OAMADDR, _dataBuffer);
+    state(_bgPatternLow, _bgPatternHigh, _bgAttributeLow, _bgAttributeHigh, _VRAM, _palette, _OAM);
+    state(_secondaryOAM, _spriteCount);
+    state(_scanline, _cycles, _frame, _framePhase);
+    if (state.loading()) {
+        updateA12Dot();
+    }
+}
+
+// Instead of watching every address put on the bus, the edge is derived from the fetch pattern of a rendering line:
+// dots 1-256 fetch background tiles, 257-320 sprite tiles and 321-336 the first two tiles of the next line. A12 is the
+// pattern table bit, so with background at $0000 and sprites at $1000 it rises once when the sprite fetches begin
+// (dot 260); with background at $1000 and sprites at $0000 it rises once when the next line prefetch begins (dot 324).
+// The nametable fetches between two pattern fetches are too short for the MMC3 filter to see A12 falling.
+void PPU::updateA12Dot() {
+    if (!_mapper->watchesA12()) {
+        _A12Dot = -1;
+        return;
+    }
+    // 8x16 sprites choose the table per tile, the empty slots fetch tile $FF from $1000
+    bool sprites = _PPUCTRL.bits.S || _PPUCTRL.bits.H;
+    if (!_PPUCTRL.bits.B && sprites) {
+        _A12Dot = 260;
+    } else if (_PPUCTRL.bits.B && !sprites) {
+        _A12Dot = 324;
+    } else {
+        // both tables at $0000: A12 never rises; both at $1000: it only falls during nametable fetches
+        _A12Dot = -1;
+    }
+}
+
+uint32_t PPU::getEventDots() {
+    int lines = cartridge->getRegion() == PAL ? 312 : 262;
+    int position = _scanline * 341 + _cycles;
+    // the frame wraps on the last dot of the pre-render line
+    int event = (lines - 1) * 341 + (lines == 312 ? 340 : 339);
+    if (position <= 241 * 341 + 1) {
+        event = 241 * 341 + 1;
+    }
+    int clocks = _A12Dot >= 0 && renderEnable() ? _mapper->getIRQClocks() : 0;
+    if (clocks) {
+        // the rendering lines are 0-239 and the pre-render line, counted as 240
+        int line = _cycles <= _A12Dot ? _scanline : _scanline + 1;
+        int rank = std::min(line, 240) + clocks - 1;
+        if (line < lines && rank <= 240) {
+            event = std::min(event, (rank < 240 ? rank : lines - 1) * 341 + _A12Dot);
+        }
+    }
+    return event >= position ? event - position + 1 : 1;
+}
+
+template <class V>
 void PPU::step() {
+    // PAL has 50 more lines of vertical blanking
+    constexpr int preRenderLine = V::region == PAL ? 311 : 261;
+
+    if constexpr (V::watchesA12) {
+        if (_cycles == _A12Dot && (_scanline < 240 || _scanline == preRenderLine) && renderEnable()) {
+            _mapper->clockA12();
+        }
+    }
+
     if (_scanline < 240) {  // Rendering
-        if (_cycles > 0 && _cycles <= 256) {
+        // without composition a pixel only matters for a sprite 0 hit, the evaluation keeps the sprites in OAM order
+        bool pixel = V::render || (!_PPUSTATUS.bits.S && _spriteCount && _secondaryOAM[0] == 0);
+        if (_cycles > 0 && _cycles <= 256 && pixel) {
             int x = _cycles - 1;
             int y = _scanline;
             bool bgOpaque = false;
             uint16_t paletteEntry = 0;
 
             // background enable
-            if (_PPUMASK.bits.b) {
-                int fineX = (_x + x) % 8;
-                if (_PPUMASK.bits.m || x >= 8) {
-                    uint16_t nameTableAddr = 0x2000 | (_v & 0x0FFF);
-                    uint16_t tileIndex = read(nameTableAddr);
-
-                    // 8*8 tile, get target line data by add fineY
-                    uint16_t patternTableAddr = tileIndex * 16 + ((_v >> 12) & 0x7);
-                    // add 0x1000 if high page
-                    patternTableAddr |= _PPUCTRL.bits.B << 12;
-
-                    paletteEntry = (read(patternTableAddr) >> (7 - fineX)) & 1;
-                    paletteEntry |= ((read(patternTableAddr + 8) >> (7 - fineX)) & 1) << 1;
-
-                    // The palette entry at $3F00 is the background colour and is used for transparency.
-                    // Addresses $3F04/$3F08/$3F0C are not used by the PPU when normally rendering
-                    bgOpaque = paletteEntry;
-
-                    // if bgOpaque is false, keep the palette entry as $3F00 for transparency
-                    // otherwise, continue to obtain the upper two bit
-                    if (bgOpaque) {
-                        uint16_t attributeTabelAddr = 0x23C0 | (_v & 0x0C00) | ((_v >> 4) & 0x38) | ((_v >> 2) & 0x07);
-                        auto attribute = read(attributeTabelAddr);
-                        // The layout of the byte is 33221100 where every two bits specifies the most significant two
-                        // colour bits for the specified square.
-                        // every suqre has 4 tile, map the tile to square to get the shift of attribute
-                        // |---------------------|
-                        // |          |          |
-                        // | Square 0 | Square 1 |
-                        // |          |          |
-                        // |----------+ ---------|
-                        // |          |          |
-                        // | Square 2 | Square 3 |
-                        // |          |          |
-                        // |---------------------|
-                        // Square bit 1:(coarse Y / 2) % 2
-                        // Square bit 0:(coarse X / 2) % 2
-                        // (bit 1|bit 0)*2 equals (bit 1|bit 0) << 1
-                        int shift = ((_v >> 4) & 4) | (_v & 2);
-                        paletteEntry |= ((attribute >> shift) & 0x3) << 2;
-                    }
-                }
-
-                if (fineX == 7) {
-                    if ((_v & 0x001F) == 31) {
-                        _v &= ~0x001F;
-                        _v ^= 0x400;
-                    } else {
-                        _v += 1;
-                    }
+            if (_PPUMASK.bits.b && (_PPUMASK.bits.m || x >= 8)) {
+                // fine X selects the tap of the shift registers
+                uint16_t tap = 0x8000 >> _x;
+                paletteEntry = ((_bgPatternLow & tap) ? 1 : 0) | ((_bgPatternHigh & tap) ? 2 : 0);
+
+                // The palette entry at $3F00 is the background colour and is used for transparency.
+                // Addresses $3F04/$3F08/$3F0C are not used by the PPU when normally rendering
+                bgOpaque = paletteEntry;
+
+                // if bgOpaque is false, keep the palette entry as $3F00 for transparency
+                // otherwise, continue to obtain the upper two bit
+                if (bgOpaque) {
+                    paletteEntry |= ((_bgAttributeLow & tap) ? 4 : 0) | ((_bgAttributeHigh & tap) ? 8 : 0);
                 }
             }
 
             // sprite enable
             if (_PPUMASK.bits.s && (_PPUMASK.bits.M || x >= 8)) {
-                for (auto i : _secondaryOAM) {
+                for (int sprite = 0; sprite < _spriteCount; sprite++) {
+                    uint8_t i = _secondaryOAM[sprite];
                     uint8_t topX = _OAM[i * 4 + 3];
 
                     if (x < topX || x >= topX + 8) {
@@ -178,25 +226,14 @@ void PPU::step() {
                     break;
                 }
             }
-            _buffer[y][x] = systemPalette[read(paletteEntry + 0x3F00)];
-        }
-        if (_cycles == 256 && _PPUMASK.bits.b) {
-            if ((_v & 0x7000) != 0x7000) {  // if fine Y < 7
-                _v += 0x1000;               // increment fine Y
-            } else {
-                _v &= ~0x7000;               // fine Y = 0
-                int y = (_v & 0x03E0) >> 5;  // let y = coarse Y
-                if (y == 29) {
-                    y = 0;             // coarse Y = 0
-                    _v ^= 0x0800;      // switch vertical nametable
-                } else if (y == 31) {  // coarse Y = 0, nametable not switched
-                    y = 0;
-                } else {  // increment coarse Y
-                    y += 1;
+            if constexpr (V::render) {
+                _screen[y][x] = read(paletteEntry + 0x3F00);
+                if (x == 0) {
+                    _emphasis[y] = _PPUMASK.bits.BGR;
                 }
-                _v = (_v & ~0x03E0) | (y << 5);  // put coarse Y back into v
             }
         }
+        stepBackground();
         if (_cycles == 257 && renderEnable()) {
             // If rendering is enabled, the PPU copies all bits related to horizontal position from t to v
             _v &= ~0x41f;
@@ -205,25 +242,38 @@ void PPU::step() {
         // update _secondaryOAM for next line
         if (_cycles == 340) {
             int height = (_PPUCTRL.bits.H) ? 16 : 8;
-            _secondaryOAM.clear();
+            _spriteCount = 0;
 
             for (int i = _OAMADDR / 4; i < 64; ++i) {
                 int topY = _OAM[i * 4];
                 if (_scanline >= topY && _scanline < topY + height) {
-                    if (_secondaryOAM.size() >= 8) {
+                    if (_spriteCount == 8) {
                         _PPUSTATUS.bits.O = true;
                         break;
                     }
-                    _secondaryOAM.push_back(i);
+                    _secondaryOAM[_spriteCount++] = i;
                 }
             }
         }
     } else if (_scanline == 240) {  // PostRender
         // update pixel once per frame
-        if (_cycles == 1) {
-            memcpy(pixels, _buffer, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
+        if (V::render && _cycles == 1) {
+            TelemetryScope scope(telemetry, Telemetry::FrameHandoff);
+            // compact sessions have no RGBA frame, they convert the screen when they need it
+            if (pixels) {
+                convertScreen(pixels);
+            }
+            if (indices) {
+                for (int line = 0; line < SCREEN_HEIGHT; line++) {
+                    uint16_t emphasis = _emphasis[line] << 6;
+                    for (int x = 0; x < SCREEN_WIDTH; x++) {
+                        indices[line * SCREEN_WIDTH + x] = _screen[line][x] | emphasis;
+                    }
+                }
+                _videoPhase = _framePhase;
+            }
         }
-    } else if (_scanline < 261) {  // Vertical blanking
+    } else if (_scanline < preRenderLine) {  // Vertical blanking
         if (_scanline == 241 && _cycles == 1) {
             _PPUSTATUS.bits.V = true;
             if (_PPUCTRL.bits.V) {
@@ -231,6 +281,8 @@ void PPU::step() {
             }
         }
     } else {  // PreRender
+        // fetches like a visible line, so the first two tiles of line 0 are in the shift registers
+        stepBackground();
         if (_cycles == 1) {
             _PPUSTATUS.bits.V = false;
             _PPUSTATUS.bits.S = false;
@@ -243,9 +295,10 @@ void PPU::step() {
             // If rendering is enabled, the PPU copies all bits related to vertical position from t to v:
             _v &= 0x41f;
             _v |= _t & ~0x41f;
-        } else if (_cycles == 339 && (_oddFrame & renderEnable())) {
-            // skipped end of the scanline
+        } else if (V::region == NTSC && _cycles == 339 && (_oddFrame & renderEnable())) {
+            // skipped end of the scanline, PAL does not skip; the next frame starts 8 subcarrier phases earlier
             _cycles++;
+            _framePhase = (_framePhase + 4) % 12;
         }
     }
 
@@ -253,11 +306,98 @@ void PPU::step() {
     if (_cycles == 341) {
         _cycles = 0;
         _scanline++;
-        if (_scanline == 262) {
+        if (_scanline == preRenderLine + 1) {
             _scanline = 0;
             _oddFrame = !_oddFrame;
+            // a dot is 8 of the 12 subcarrier phases, an NTSC frame of 89342 dots moves the phase by 4
+            _framePhase = (_framePhase + (preRenderLine + 1) * 341 * 8) % 12;
+            _frame++;
+            if constexpr (V::profile) {
+                PROFILE(endFrame());
+            }
+        }
+    }
+}
+
+#define INSTANTIATE_STEP(...) template void PPU::step<__VA_ARGS__>();
+NEBULA_FOR_EACH_VARIANT(INSTANTIATE_STEP)
+
+// The background pipeline of the visible and pre-render lines: the shift registers move one pixel per dot during
+// dots 1-256 and the next line prefetch (dots 321-336), and every 8 dots the next tile is fetched once into their low
+// bytes. The two tiles fetched at 321-336 are therefore in place when dot 1 of the next line is drawn.
+void PPU::stepBackground() {
+    if (!renderEnable()) {
+        return;
+    }
+    if ((_cycles > 0 && _cycles <= 256) || (_cycles >= 321 && _cycles <= 336)) {
+        _bgPatternLow <<= 1;
+        _bgPatternHigh <<= 1;
+        _bgAttributeLow <<= 1;
+        _bgAttributeHigh <<= 1;
+        if ((_cycles & 0x7) == 0) {
+            fetchTile();
         }
     }
+    if (_cycles == 256) {
+        incrementY();
+    }
+}
+
+void PPU::fetchTile() {
+    uint8_t tileIndex = nameTable(0x2000 | (_v & 0x0FFF));
+    uint8_t attribute = nameTable(0x23C0 | (_v & 0x0C00) | ((_v >> 4) & 0x38) | ((_v >> 2) & 0x07));
+
+    // 8*8 tile, get target line data by add fineY, add 0x1000 if high page
+    uint16_t patternTableAddr = (_PPUCTRL.bits.B << 12) | (tileIndex * 16 + ((_v >> 12) & 0x7));
+    _bgPatternLow |= _mapper->readCHR(patternTableAddr);
+    _bgPatternHigh |= _mapper->readCHR(patternTableAddr + 8);
+
+    // The layout of the byte is 33221100 where every two bits specifies the most significant two
+    // colour bits for the specified square.
+    // every suqre has 4 tile, map the tile to square to get the shift of attribute
+    // |---------------------|
+    // |          |          |
+    // | Square 0 | Square 1 |
+    // |          |          |
+    // |----------+ ---------|
+    // |          |          |
+    // | Square 2 | Square 3 |
+    // |          |          |
+    // |---------------------|
+    // Square bit 1:(coarse Y / 2) % 2
+    // Square bit 0:(coarse X / 2) % 2
+    // (bit 1|bit 0)*2 equals (bit 1|bit 0) << 1
+    int shift = ((_v >> 4) & 4) | (_v & 2);
+    attribute >>= shift;
+    // the attribute bits are the same for all 8 pixels of the tile
+    _bgAttributeLow |= (attribute & 1) ? 0xFF : 0;
+    _bgAttributeHigh |= (attribute & 2) ? 0xFF : 0;
+
+    // increment coarse X
+    if ((_v & 0x001F) == 31) {
+        _v &= ~0x001F;
+        _v ^= 0x400;
+    } else {
+        _v += 1;
+    }
+}
+
+void PPU::incrementY() {
+    if ((_v & 0x7000) != 0x7000) {  // if fine Y < 7
+        _v += 0x1000;               // increment fine Y
+    } else {
+        _v &= ~0x7000;               // fine Y = 0
+        int y = (_v & 0x03E0) >> 5;  // let y = coarse Y
+        if (y == 29) {
+            y = 0;             // coarse Y = 0
+            _v ^= 0x0800;      // switch vertical nametable
+        } else if (y == 31) {  // coarse Y = 0, nametable not switched
+            y = 0;
+        } else {  // increment coarse Y
+            y += 1;
+        }
+        _v = (_v & ~0x03E0) | (y << 5);  // put coarse Y back into v
+    }
 }
 
 uint8_t PPU::readPPUSTATUS() {
@@ -281,8 +421,7 @@ uint8_t PPU::readPPUDATA() {
     // When reading PPUDATA while the VRAM address is in the range 0–$3EFF (i.e., before the palettes), the read will
     // return the contents of an internal read buffer.
     if (_v < 0x3f00) {
-        static uint8_t dataBuffer = 0;
-        std::swap(data, dataBuffer);
+        std::swap(data, _dataBuffer);
     }
     return data;
 }
@@ -292,6 +431,8 @@ void PPU::writePPUCTRL(uint8_t data) {
 
     _t &= ~0xC00;
     _t |= _PPUCTRL.bits.NN << 10;
+
+    updateA12Dot();
 }
 
 void PPU::writePPUCMASK(uint8_t data) { _PPUMASK.value = data; }
@@ -350,46 +491,27 @@ void PPU::OAMDMA(uint8_t* addr) {
     }
 }
 
+void PPU::setMirroring(NameTableMirroring mirroring) {
+    // page of _VRAM for each of the four nametables
+    static const uint8_t layouts[][4] = {
+        {0, 0, 1, 1},  // Horizontal
+        {0, 1, 0, 1},  // Vertical
+        {0, 0, 0, 0},  // SingleScreenLower
+        {1, 1, 1, 1},  // SingleScreenUpper
+        {0, 1, 2, 3},  // FourScreen
+    };
+    for (int i = 0; i < 4; i++) {
+        _nameTables[i] = &_VRAM[layouts[mirroring][i] * 0x400];
+    }
+}
+
 uint8_t PPU::read(uint16_t addr) {
     addr &= 0x3FFF;
     if (addr < 0x2000) {
-        return cartridge->getMapper()->readCHR(addr);
+        return _mapper->readCHR(addr);
     } else if (addr < 0x3F00) {
-        // Mirrors 0x2000-0x2EFF
-        if (addr >= 0x3000) {
-            addr -= 0X1000;
-        }
-        if (addr < 0x2400) {  // L1
-            // NameTable0
-            return _VRAM[addr - 0x2000];
-        } else if (addr < 0x2800) {  // L2
-            switch (cartridge->getMapper()->getNameTableMirroing()) {
-                case Horizontal:
-                    // NameTable0
-                    return _VRAM[addr - 0x2400];
-                case Vertical:
-                    // NameTable1
-                    return _VRAM[addr - 0x2000];
-                default:
-                    std::cerr << "unsupported mirroing" << std::endl;
-                    exit(2);
-            }
-        } else if (addr < 0x2C00) {  // L3
-            switch (cartridge->getMapper()->getNameTableMirroing()) {
-                case Horizontal:
-                    // NameTable1
-                    return _VRAM[addr - 0x2400];
-                case Vertical:
-                    // NameTable0
-                    return _VRAM[addr - 0x2800];
-                default:
-                    std::cerr << "unsupported mirroing" << std::endl;
-                    exit(2);
-            }
-        } else {  // L4
-            // NameTable1
-            return _VRAM[addr - 0x2800];
-        }
+        // 0x3000-0x3EFF mirrors 0x2000-0x2EFF
+        return nameTable(addr);
     } else {
         addr = addr & 0x1f;
         //  Addresses $3F10/$3F14/$3F18/$3F1C are mirrors of $3F00/$3F04/$3F08/$3F0C.
@@ -404,54 +526,18 @@ void PPU::write(uint16_t addr, uint8_t data) {
     // mirrors 0x0000-0x3FFF
     addr &= 0x3FFF;
     if (addr < 0x2000) {
-        cartridge->getMapper()->wirteCHR(addr, data);
+        _mapper->writeCHR(addr, data);
     } else if (addr < 0x3F00) {
-        // Mirrors 0x2000-0x2EFF
-        if (addr >= 0x3000) {
-            addr -= 0X1000;
-        }
-        if (addr < 0x2400) {  // L1
-            // NameTable0
-            _VRAM[addr - 0x2000] = data;
-        } else if (addr < 0x2800) {  // L2
-            switch (cartridge->getMapper()->getNameTableMirroing()) {
-                case Horizontal:
-                    // NameTable0
-                    _VRAM[addr - 0x2400] = data;
-                    break;
-                case Vertical:
-                    // NameTable1
-                    _VRAM[addr - 0x2000] = data;
-                    break;
-                default:
-                    std::cerr << "unsupported mirroing" << std::endl;
-                    exit(2);
-            }
-        } else if (addr < 0x2C00) {  // L3
-            switch (cartridge->getMapper()->getNameTableMirroing()) {
-                case Horizontal:
-                    // NameTable1
-                    _VRAM[addr - 0x2400] = data;
-                    break;
-                case Vertical:
-                    // NameTable0
-                    _VRAM[addr - 0x2800] = data;
-                    break;
-                default:
-                    std::cerr << "unsupported mirroing" << std::endl;
-                    exit(2);
-            }
-        } else {  // L4
-            // NameTable1
-            _VRAM[addr - 0x2800] = data;
-        }
+        // 0x3000-0x3EFF mirrors 0x2000-0x2EFF
+        nameTable(addr) = data;
     } else {
         addr = addr & 0x1f;
         //  Addresses $3F10/$3F14/$3F18/$3F1C are mirrors of $3F00/$3F04/$3F08/$3F0C.
         if (addr >= 0x10 && addr % 4 == 0) {
             addr &= 0xf;
         }
-        _palette[addr] = data;
+        // the palette RAM is 6 bits wide
+        _palette[addr] = data & 0x3F;
     }
 }
 
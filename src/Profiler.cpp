@@ -0,0 +1,165 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+
+namespace NebulaEmu {
+
+Profiler* profiler = nullptr;
+
+Profiler::Profiler() : _executions(0x10000, 0) {
+    memset(&_frame, 0, sizeof(_frame));
+    memset(&_total, 0, sizeof(_total));
+}
+
+void Profiler::Counters::add(const Counters& other) {
+    for (int i = 0; i < 0x100; i++) {
+        opcodeExecutions[i] += other.opcodeExecutions[i];
+        opcodeCycles[i] += other.opcodeCycles[i];
+    }
+    for (int i = 0; i < 0x28; i++) {
+        registerReads[i] += other.registerReads[i];
+        registerWrites[i] += other.registerWrites[i];
+    }
+    OAMDMA += other.OAMDMA;
+    NMI += other.NMI;
+    IRQ += other.IRQ;
+}
+
+uint64_t Profiler::Counters::instructions() const {
+    uint64_t sum = 0;
+    for (auto n : opcodeExecutions) {
+        sum += n;
+    }
+    return sum;
+}
+
+uint64_t Profiler::Counters::cycles() const {
+    uint64_t sum = 0;
+    for (auto n : opcodeCycles) {
+        sum += n;
+    }
+    return sum;
+}
+
+void Profiler::endFrame() {
+    FrameSummary summary = {_frame.instructions(), _frame.cycles(), 0, 0, _frame.OAMDMA, _frame.NMI, _frame.IRQ};
+    for (int i = 0; i < 0x28; i++) {
+        summary.registerReads += _frame.registerReads[i];
+        summary.registerWrites += _frame.registerWrites[i];
+    }
+    _frames.push_back(summary);
+    _total.add(_frame);
+    memset(&_frame, 0, sizeof(_frame));
+}
+
+void Profiler::writeCounters(std::ostream& out, const Counters& counters) {
+    out << "{\"instructions\": " << counters.instructions() << ", \"cycles\": " << counters.cycles()
+        << ", \"oam_dma\": " << counters.OAMDMA << ", \"nmi\": " << counters.NMI << ", \"irq\": " << counters.IRQ;
+    out << ", \"opcodes\": {";
+    bool first = true;
+    for (int i = 0; i < 0x100; i++) {
+        if (counters.opcodeExecutions[i]) {
+            out << (first ? "" : ", ") << "\"" << std::hex << std::uppercase << std::setw(2) << std::setfill('0') << i
+                << std::dec << "\": [" << counters.opcodeExecutions[i] << ", " << counters.opcodeCycles[i] << "]";
+            first = false;
+        }
+    }
+    out << "}, \"registers\": {";
+    first = true;
+    for (int i = 0; i < 0x28; i++) {
+        if (counters.registerReads[i] || counters.registerWrites[i]) {
+            out << (first ? "" : ", ") << "\"" << std::hex << std::uppercase << registerAddress(i) << std::dec
+                << "\": [" << counters.registerReads[i] << ", " << counters.registerWrites[i] << "]";
+            first = false;
+        }
+    }
+    out << "}}";
+}
+
+// opcodes: [executions, cycles], registers: [reads, writes]
+void Profiler::writeJSON(std::ostream& out) {
+    out << "{\n  \"frames\": " << _frames.size() << ",\n  \"total\": ";
+    writeCounters(out, _total);
+    out << ",\n  \"current_frame\": ";
+    writeCounters(out, _frame);
+
+    out << ",\n  \"banks\": [";
+    for (size_t bank = 0; bank < _bankExecutions.size(); bank++) {
+        out << (bank ? ", " : "") << _bankExecutions[bank];
+    }
+    out << "],\n  \"addresses\": {";
+    bool first = true;
+    for (int addr = 0; addr < 0x10000; addr++) {
+        if (_executions[addr]) {
+            out << (first ? "" : ", ") << "\"" << std::hex << std::uppercase << addr << std::dec
+                << "\": " << _executions[addr];
+            first = false;
+        }
+    }
+    out << "},\n  \"per_frame\": [";
+    for (size_t i = 0; i < _frames.size(); i++) {
+        auto& f = _frames[i];
+        out << (i ? "," : "") << "\n    [" << f.instructions << ", " << f.cycles << ", " << f.registerReads << ", "
+            << f.registerWrites << ", " << f.OAMDMA << ", " << f.NMI << ", " << f.IRQ << "]";
+    }
+    out << "\n  ],\n  \"per_frame_columns\": [\"instructions\", \"cycles\", \"register_reads\", "
+           "\"register_writes\", \"oam_dma\", \"nmi\", \"irq\"]\n}\n";
+}
+
+void Profiler::writeReport(std::ostream& out) {
+    uint64_t frames = std::max<uint64_t>(_frames.size(), 1);
+    uint64_t cycles = std::max<uint64_t>(_total.cycles(), 1);
+    out << "frames: " << _frames.size() << "\n";
+    out << "instructions: " << _total.instructions() << " (" << _total.instructions() / frames << "/frame)\n";
+    out << "cycles: " << _total.cycles() << " (" << _total.cycles() / frames << "/frame)\n";
+    out << "NMI: " << _total.NMI << ", IRQ: " << _total.IRQ << ", OAM DMA: " << _total.OAMDMA << "\n";
+
+    std::vector<int> opcodes;
+    for (int i = 0; i < 0x100; i++) {
+        if (_total.opcodeExecutions[i]) {
+            opcodes.push_back(i);
+        }
+    }
+    std::sort(opcodes.begin(), opcodes.end(),
+              [&](int a, int b) { return _total.opcodeCycles[a] > _total.opcodeCycles[b]; });
+    out << "\nopcode  executions  cycles  %cycles\n";
+    for (auto op : opcodes) {
+        out << "  " << std::hex << std::uppercase << std::setw(2) << std::setfill('0') << op << std::dec
+            << std::setfill(' ') << std::setw(12) << _total.opcodeExecutions[op] << std::setw(12)
+            << _total.opcodeCycles[op] << std::setw(8) << std::fixed << std::setprecision(2)
+            << 100.0 * _total.opcodeCycles[op] / cycles << "\n";
+    }
+
+    out << "\nregister  reads  writes\n";
+    for (int i = 0; i < 0x28; i++) {
+        if (_total.registerReads[i] || _total.registerWrites[i]) {
+            out << "  $" << std::hex << std::uppercase << registerAddress(i) << std::dec << std::setw(10)
+                << _total.registerReads[i] << std::setw(10) << _total.registerWrites[i] << "\n";
+        }
+    }
+
+    out << "\nPRG bank  executions\n";
+    for (size_t bank = 0; bank < _bankExecutions.size(); bank++) {
+        if (_bankExecutions[bank]) {
+            out << std::setw(8) << bank << std::setw(12) << _bankExecutions[bank] << "\n";
+        }
+    }
+
+    std::vector<int> addresses;
+    for (int addr = 0; addr < 0x10000; addr++) {
+        if (_executions[addr]) {
+            addresses.push_back(addr);
+        }
+    }
+    std::sort(addresses.begin(), addresses.end(), [&](int a, int b) { return _executions[a] > _executions[b]; });
+    addresses.resize(std::min<size_t>(addresses.size(), 32));
+    out << "\nhottest addresses\n";
+    for (auto addr : addresses) {
+        out << "  $" << std::hex << std::uppercase << std::setw(4) << std::setfill('0') << addr << std::dec
+            << std::setfill(' ') << std::setw(12) << _executions[addr] << "\n";
+    }
+}
+
+}  // namespace NebulaEmu
@@ -0,0 +1,204 @@
+#include "RamSearch.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace NebulaEmu {
+
+namespace {
+
+constexpr uint32_t RAM_SIZE = 0x800;
+
+// the value of size at p, sign extended if isSigned
+int32_t load(const uint8_t* p, RamSearch::Size size, bool isSigned) {
+    if (size == RamSearch::Word) {
+        uint16_t value = p[0] | p[1] << 8;
+        return isSigned ? (int16_t)value : value;
+    }
+    return isSigned ? (int8_t)p[0] : p[0];
+}
+
+// the byte at a CPU address of RAM, with its mirrors, or PRG RAM, 0 elsewhere; the memory is read directly so nothing
+// sees a bus access
+uint8_t peek(uint16_t address) {
+    if (address < 0x2000) {
+        return cpu->getRAM()[address & (RAM_SIZE - 1)];
+    }
+    uint32_t offset = address - 0x6000;
+    if (address >= 0x6000 && offset < min<uint32_t>(cartridge->getPRGRAMSize(), 0x2000)) {
+        return cartridge->getPRGRAM()[offset];
+    }
+    return 0;
+}
+
+bool holds(RamSearch::Compare compare, int32_t a, int32_t b) {
+    switch (compare) {
+        case RamSearch::Equal:
+            return a == b;
+        case RamSearch::NotEqual:
+            return a != b;
+        case RamSearch::Less:
+            return a < b;
+        case RamSearch::Greater:
+            return a > b;
+        case RamSearch::LessEqual:
+            return a <= b;
+        case RamSearch::GreaterEqual:
+            return a >= b;
+    }
+    return false;
+}
+
+#ifdef __SSE2__
+// SSE2 only compares signed lanes, unsigned values are biased by half their range first
+__m128i greater(__m128i a, __m128i b, bool word) { return word ? _mm_cmpgt_epi16(a, b) : _mm_cmpgt_epi8(a, b); }
+
+__m128i equal(__m128i a, __m128i b, bool word) { return word ? _mm_cmpeq_epi16(a, b) : _mm_cmpeq_epi8(a, b); }
+
+// all ones in the lanes where compare(a, b) holds
+__m128i holds(RamSearch::Compare compare, __m128i a, __m128i b, bool word) {
+    const __m128i ones = _mm_set1_epi32(-1);
+    switch (compare) {
+        case RamSearch::Equal:
+            return equal(a, b, word);
+        case RamSearch::NotEqual:
+            return _mm_xor_si128(equal(a, b, word), ones);
+        case RamSearch::Less:
+            return greater(b, a, word);
+        case RamSearch::Greater:
+            return greater(a, b, word);
+        case RamSearch::LessEqual:
+            return _mm_xor_si128(greater(a, b, word), ones);
+        case RamSearch::GreaterEqual:
+            return _mm_xor_si128(greater(b, a, word), ones);
+    }
+    return _mm_setzero_si128();
+}
+
+// the 8 little endian words starting at p (half 0) or p + 8 (half 1)
+__m128i words(const uint8_t* p, int half) {
+    __m128i low = _mm_loadu_si128((const __m128i*)p);
+    __m128i high = _mm_loadu_si128((const __m128i*)(p + 1));
+    return half ? _mm_unpackhi_epi8(low, high) : _mm_unpacklo_epi8(low, high);
+}
+#endif
+
+}  // namespace
+
+RamSearch::RamSearch(Session* session) : _session(session) {
+    Session* selected = currentSession();
+    selectSession(session);
+    _size = RAM_SIZE + min<uint32_t>(cartridge->getPRGRAMSize(), 0x2000);
+    selectSession(selected);
+    // whole blocks of 16 and one more byte for the last word
+    uint32_t padded = (_size + 15) / 16 * 16 + 16;
+    _previous.resize(padded);
+    _current.resize(padded);
+    _candidates.resize(padded);
+    restart();
+}
+
+void RamSearch::restart() {
+    fill(_candidates.begin(), _candidates.end(), 0);
+    fill(_candidates.begin(), _candidates.begin() + _size, 0xFF);
+    Session* selected = currentSession();
+    selectSession(_session);
+    snapshot(_previous.data());
+    selectSession(selected);
+}
+
+void RamSearch::snapshot(uint8_t* out) {
+    memcpy(out, cpu->getRAM(), RAM_SIZE);
+    if (_size > RAM_SIZE) {
+        memcpy(out + RAM_SIZE, cartridge->getPRGRAM(), _size - RAM_SIZE);
+    }
+}
+
+size_t RamSearch::filter(const Predicate& predicate) {
+    Session* selected = currentSession();
+    selectSession(_session);
+    snapshot(_current.data());
+    selectSession(selected);
+
+    const uint8_t* current = _current.data();
+    const uint8_t* previous = _previous.data();
+    uint8_t* candidates = _candidates.data();
+    bool word = predicate.size == Word;
+    uint32_t end = _candidates.size() - 16;
+    uint32_t i = 0;
+#ifdef __SSE2__
+    __m128i bias = word ? _mm_set1_epi16(predicate.isSigned ? 0 : -0x8000)
+                        : _mm_set1_epi8(predicate.isSigned ? 0 : -0x80);
+    __m128i constantLanes =
+        _mm_xor_si128(word ? _mm_set1_epi16(predicate.value) : _mm_set1_epi8(predicate.value), bias);
+    for (; i < end; i += 16) {
+        __m128i mask;
+        if (word) {
+            __m128i halves[2];
+            for (int half = 0; half < 2; half++) {
+                __m128i a = _mm_xor_si128(words(current + i, half), bias);
+                __m128i b = predicate.previous ? _mm_xor_si128(words(previous + i, half), bias) : constantLanes;
+                halves[half] = holds(predicate.compare, a, b, true);
+            }
+            mask = _mm_packs_epi16(halves[0], halves[1]);
+        } else {
+            __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(current + i)), bias);
+            __m128i b = predicate.previous
+                            ? _mm_xor_si128(_mm_loadu_si128((const __m128i*)(previous + i)), bias)
+                            : constantLanes;
+            mask = holds(predicate.compare, a, b, false);
+        }
+        __m128i* out = (__m128i*)(candidates + i);
+        _mm_storeu_si128(out, _mm_and_si128(_mm_loadu_si128(out), mask));
+    }
+#endif
+    uint8_t value[2] = {(uint8_t)predicate.value, (uint8_t)(predicate.value >> 8)};
+    int32_t constant = load(value, predicate.size, predicate.isSigned);
+    for (; i < end; i++) {
+        int32_t a = load(current + i, predicate.size, predicate.isSigned);
+        int32_t b = predicate.previous ? load(previous + i, predicate.size, predicate.isSigned) : constant;
+        candidates[i] &= holds(predicate.compare, a, b) ? 0xFF : 0;
+    }
+    // a word does not continue from RAM into PRG RAM or past its end
+    if (word) {
+        candidates[RAM_SIZE - 1] = 0;
+        candidates[_size - 1] = 0;
+    }
+
+    swap(_previous, _current);
+    return count();
+}
+
+void RamSearch::filter(const vector<RamSearch*>& searches, const Predicate& predicate) {
+    for (auto search : searches) {
+        search->filter(predicate);
+    }
+}
+
+vector<uint16_t> RamSearch::candidates() {
+    vector<uint16_t> addresses;
+    for (uint32_t i = 0; i < _size; i++) {
+        if (_candidates[i]) {
+            addresses.push_back(i < RAM_SIZE ? i : 0x6000 + i - RAM_SIZE);
+        }
+    }
+    return addresses;
+}
+
+size_t RamSearch::count() { return std::count(_candidates.begin(), _candidates.end(), 0xFF); }
+
+int32_t RamSearch::read(uint16_t address, Size size, bool isSigned) {
+    Session* selected = currentSession();
+    selectSession(_session);
+    uint8_t bytes[2] = {peek(address), peek(address + 1)};
+    selectSession(selected);
+    return load(bytes, size, isSigned);
+}
+
+}  // namespace NebulaEmu
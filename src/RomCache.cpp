@@ -0,0 +1,85 @@
+#include "RomCache.h"
+
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <system_error>
+#include <unordered_map>
+
+namespace NebulaEmu {
+
+namespace {
+
+// what a path held when it was last opened, the image is reused without mapping or hashing the file while the size
+// and modification time stay the same
+struct Stamp {
+    uintmax_t size = 0;
+    std::filesystem::file_time_type modified;
+    std::weak_ptr<const RomImage> image;
+};
+
+}  // namespace
+
+static std::mutex cacheMutex;
+static std::unordered_multimap<uint64_t, std::weak_ptr<const RomImage>> cache;
+static std::unordered_map<std::string, Stamp> paths;
+
+std::shared_ptr<const RomImage> RomCache::acquire(const std::string& path) {
+    std::error_code error;
+    Stamp stamp;
+    stamp.size = std::filesystem::file_size(path, error);
+    if (!error) {
+        stamp.modified = std::filesystem::last_write_time(path, error);
+    }
+    if (!error) {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        auto known = paths.find(path);
+        if (known != paths.end() && known->second.size == stamp.size && known->second.modified == stamp.modified) {
+            if (auto shared = known->second.image.lock()) {
+                return shared;
+            }
+        }
+    }
+
+    std::shared_ptr<const RomImage> image = RomImage::open(path);
+    if (!image) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    // a path that can not be stamped is hashed on every load
+    auto remember = [&](const std::shared_ptr<const RomImage>& shared) {
+        if (!error) {
+            stamp.image = shared;
+            paths[path] = stamp;
+        }
+        return shared;
+    };
+    auto range = cache.equal_range(image->hash());
+    for (auto it = range.first; it != range.second;) {
+        auto shared = it->second.lock();
+        if (!shared) {
+            it = cache.erase(it);
+            continue;
+        }
+        // the content is compared as well, a hash collision must not hand out another game
+        if (shared->size() == image->size() && memcmp(shared->data(), image->data(), image->size()) == 0) {
+            // the new mapping is dropped here
+            return remember(shared);
+        }
+        ++it;
+    }
+    cache.emplace(image->hash(), image);
+    return remember(image);
+}
+
+size_t RomCache::size() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    size_t alive = 0;
+    for (auto& entry : cache) {
+        alive += !entry.second.expired();
+    }
+    return alive;
+}
+
+}  // namespace NebulaEmu
@@ -0,0 +1,64 @@
+#include "RomImage.h"
+
+#include "Hash.h"
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace NebulaEmu {
+
+#ifdef _WIN32
+
+std::unique_ptr<RomImage> RomImage::open(const std::string& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        return nullptr;
+    }
+    std::unique_ptr<RomImage> image(new RomImage());
+    image->_buffer.resize(file.tellg());
+    file.seekg(0);
+    file.read((char*)image->_buffer.data(), image->_buffer.size());
+    image->_data = image->_buffer.data();
+    image->_size = image->_buffer.size();
+    image->_hash = hash64(image->_data, image->_size);
+    return image;
+}
+
+RomImage::~RomImage() {}
+
+#else
+
+std::unique_ptr<RomImage> RomImage::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+    std::unique_ptr<RomImage> image(new RomImage());
+    image->_data = (const uint8_t*)addr;
+    image->_size = st.st_size;
+    image->_hash = hash64(image->_data, image->_size);
+    return image;
+}
+
+RomImage::~RomImage() { munmap((void*)_data, _size); }
+
+#endif
+
+}  // namespace NebulaEmu
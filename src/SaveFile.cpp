@@ -0,0 +1,170 @@
+#include "SaveFile.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace NebulaEmu {
+
+namespace {
+
+// the open save files by path; the mutex is held while the flusher writes one, so a file is never closed under it
+struct Registry {
+    std::mutex mutex;
+    std::map<std::string, SaveFile*> files;
+    bool flushing = false;
+};
+
+// never destroyed, cartridges may be deleted after the static destructors ran
+Registry& registry() {
+    static Registry* registry = new Registry();
+    return *registry;
+}
+
+}  // namespace
+
+std::unique_ptr<SaveFile> SaveFile::open(const std::string& path, size_t size) {
+    Registry& registry = NebulaEmu::registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    if (registry.files.count(path)) {
+        return nullptr;
+    }
+    std::unique_ptr<SaveFile> save = map(path, size);
+    if (!save) {
+        return nullptr;
+    }
+    registry.files[path] = save.get();
+    if (!registry.flushing) {
+        registry.flushing = true;
+        std::thread(&SaveFile::flusher).detach();
+    }
+    return save;
+}
+
+bool SaveFile::isOpen(const std::string& path) {
+    Registry& registry = NebulaEmu::registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    return registry.files.count(path) != 0;
+}
+
+bool SaveFile::read(const std::string& path, uint8_t* data, size_t size) {
+    Registry& registry = NebulaEmu::registry();
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        auto it = registry.files.find(path);
+        if (it != registry.files.end()) {
+            memcpy(data, it->second->_data, std::min(size, it->second->_size));
+            return true;
+        }
+    }
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    file.read((char*)data, size);
+    return true;
+}
+
+#ifdef _WIN32
+
+std::unique_ptr<SaveFile> SaveFile::map(const std::string& path, size_t size) {
+    std::unique_ptr<SaveFile> save(new SaveFile());
+    save->_buffer.assign(size, 0);
+    std::ifstream file(path, std::ios::binary);
+    if (file.is_open()) {
+        file.read((char*)save->_buffer.data(), size);
+    } else {
+        save->_created = true;
+    }
+    save->_path = path;
+    save->_data = save->_buffer.data();
+    save->_size = size;
+    return save;
+}
+
+void SaveFile::flush() {
+    std::ofstream file(_path, std::ios::binary | std::ios::trunc);
+    file.write((const char*)_data, _size);
+    if (!file) {
+        std::cerr << "Failed to write save file \"" << _path << "\"" << std::endl;
+    }
+}
+
+#else
+
+std::unique_ptr<SaveFile> SaveFile::map(const std::string& path, size_t size) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    bool created = fd >= 0;
+    if (!created) {
+        fd = ::open(path.c_str(), O_RDWR);
+    }
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || ((size_t)st.st_size < size && ftruncate(fd, size) < 0)) {
+        close(fd);
+        return nullptr;
+    }
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+    std::unique_ptr<SaveFile> save(new SaveFile());
+    save->_path = path;
+    save->_data = (uint8_t*)addr;
+    save->_size = size;
+    save->_created = created;
+    return save;
+}
+
+void SaveFile::flush() {
+    // the mapping is shared, so the kernel already owns the data; this only forces it to disk
+    if (msync(_data, _size, MS_SYNC) < 0) {
+        std::cerr << "Failed to write save file \"" << _path << "\"" << std::endl;
+    }
+}
+
+#endif
+
+SaveFile::~SaveFile() {
+    {
+        Registry& registry = NebulaEmu::registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.files.erase(_path);
+    }
+    flush();
+#ifndef _WIN32
+    munmap(_data, _size);
+#endif
+}
+
+void SaveFile::flusher() {
+    Registry& registry = NebulaEmu::registry();
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(FLUSH_INTERVAL_MS));
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (auto& entry : registry.files) {
+            // writes racing with the flush set the flag again and are picked up next time
+            if (entry.second->_dirty.exchange(false, std::memory_order_relaxed)) {
+                entry.second->flush();
+            }
+        }
+    }
+}
+
+}  // namespace NebulaEmu
@@ -0,0 +1,66 @@
+#include "Scheduler.h"
+
+#include "APU.h"
+#include "Cheats.h"
+
+namespace NebulaEmu {
+
+extern APU* apu;
+
+void Scheduler::reset() {
+    _now = 0;
+    for (auto& time : _times) {
+        time = NEVER;
+    }
+    _next = _deadline = NEVER;
+}
+
+void Scheduler::schedule(Event event, uint64_t time) {
+    _times[event] = time;
+    updateNext();
+}
+
+void Scheduler::cancel(Event event) {
+    _times[event] = NEVER;
+    updateNext();
+}
+
+void Scheduler::updateNext() {
+    _next = NEVER;
+    for (auto time : _times) {
+        _next = time < _next ? time : _next;
+    }
+    // rounded up to the end of an APU cycle, less the 2 cycles the CPU runs after it; an event scheduled in the past
+    // runs with the next advance
+    uint64_t due = _next > _now ? _next : _now + 1;
+    _deadline = _next == NEVER ? NEVER : ((due + 1) & ~1ull) - 2;
+}
+
+void Scheduler::dispatch() {
+    while (_next <= _now) {
+        int event = 0;
+        while (_times[event] != _next) {
+            event++;
+        }
+        // handlers get the time the event was due, so periodic events do not drift
+        uint64_t time = _times[event];
+        _times[event] = NEVER;
+        switch (event) {
+            case FrameCounter:
+                apu->frameCounterStep(time);
+                break;
+            case DMC:
+                apu->clockDMC(time);
+                break;
+            case Freeze:
+                cheats->freeze(time);
+                break;
+            case Raster:
+                // only there to end the batch, the next one predicts it again
+                break;
+        }
+        updateNext();
+    }
+}
+
+}  // namespace NebulaEmu
@@ -0,0 +1,125 @@
+#include "Telemetry.h"
+
+#include <cstdio>
+#include <iostream>
+
+#include "Cartridge.h"
+
+namespace NebulaEmu {
+
+extern Cartridge* cartridge;
+
+Telemetry* telemetry = nullptr;
+
+static constexpr uint64_t STATS_PERIOD = 1000000000;
+
+Telemetry::Telemetry(bool stats, const std::string& tracePath) : _stats(stats), _start(std::chrono::steady_clock::now()) {
+    if (!tracePath.empty()) {
+        _trace.open(tracePath);
+        if (!_trace.is_open()) {
+            std::cerr << "Failed to open trace file \"" << tracePath << "\"" << std::endl;
+        }
+        _trace << "{\"traceEvents\": [";
+        _trace << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"emulation\"}}";
+        _trace << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"audio\"}}";
+        _firstEvent = false;
+    }
+}
+
+Telemetry::~Telemetry() {
+    if (_trace.is_open()) {
+        _trace << "\n]}\n";
+    }
+}
+
+const char* Telemetry::sectionName(Section section) {
+    switch (section) {
+        case CPU:
+            return "CPU";
+        case PPU:
+            return "PPU";
+        case APU:
+            return "APU";
+        case FrameHandoff:
+            return "frame handoff";
+        case TextureUpload:
+            return "texture upload";
+        case Present:
+            return "present";
+        case AudioCallback:
+            return "audio callback";
+        default:
+            return "";
+    }
+}
+
+void Telemetry::add(Section section, uint64_t begin, uint64_t end) {
+    _measured[section] += end - begin;
+    if (!_trace.is_open()) {
+        return;
+    }
+    if (section == AudioCallback) {
+        std::lock_guard<std::mutex> lock(_pendingMutex);
+        _pendingAudio.emplace_back(begin, end);
+    } else {
+        writeEvent(sectionName(section), 1, begin, end);
+    }
+}
+
+void Telemetry::writeEvent(const char* name, int tid, uint64_t begin, uint64_t end) {
+    _trace << (_firstEvent ? "\n" : ",\n") << "{\"name\": \"" << name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tid
+           << ", \"ts\": " << begin / 1000.0 << ", \"dur\": " << (end - begin) / 1000.0 << "}";
+    _firstEvent = false;
+}
+
+void Telemetry::endFrame(uint64_t begin, uint64_t end) {
+    _frames++;
+    // a host frame taking longer than a frame of the region misses the deadline
+    if (end - begin > frameNanoseconds(cartridge->getRegion())) {
+        _missedDeadlines++;
+    }
+
+    if (_trace.is_open()) {
+        writeEvent("frame", 1, begin, end);
+        std::vector<std::pair<uint64_t, uint64_t>> audio;
+        {
+            std::lock_guard<std::mutex> lock(_pendingMutex);
+            audio.swap(_pendingAudio);
+        }
+        for (auto& span : audio) {
+            writeEvent(sectionName(AudioCallback), 2, span.first, span.second);
+        }
+        // the emulation time of the frame and the audio ring as counter tracks
+        _trace << ",\n{\"name\": \"emulation (ms)\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << end / 1000.0
+               << ", \"args\": {\"CPU\": " << _frameBatched[CPU] / 1e6 << ", \"PPU\": " << _frameBatched[PPU] / 1e6
+               << ", \"APU\": " << _frameBatched[APU] / 1e6 << "}}";
+        _trace << ",\n{\"name\": \"audio ring\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << end / 1000.0
+               << ", \"args\": {\"samples\": " << _audioRing << "}}";
+    }
+    for (int i = 0; i < SectionCount; i++) {
+        _batched[i] += _frameBatched[i];
+        _frameBatched[i] = 0;
+    }
+
+    if (!_stats || end - _lastStats < STATS_PERIOD) {
+        return;
+    }
+    // milliseconds per frame over the last period
+    auto perFrame = [&](Section section) { return (_batched[section] + _measured[section]) / 1e6 / _frames; };
+    fprintf(stderr,
+            "fps %.1f | CPU %.2f PPU %.2f APU %.2f handoff %.2f upload %.2f present %.2f audio %.2f ms/frame | "
+            "audio ring %llu underruns %llu overruns %llu | missed %llu\n",
+            _frames * 1e9 / (end - _lastStats), perFrame(CPU), perFrame(PPU), perFrame(APU), perFrame(FrameHandoff),
+            perFrame(TextureUpload), perFrame(Present), perFrame(AudioCallback), (unsigned long long)_audioRing,
+            (unsigned long long)_underruns.exchange(0), (unsigned long long)_overruns.exchange(0),
+            (unsigned long long)_missedDeadlines);
+    for (int i = 0; i < SectionCount; i++) {
+        _batched[i] = 0;
+        _measured[i] = 0;
+    }
+    _frames = 0;
+    _missedDeadlines = 0;
+    _lastStats = end;
+}
+
+}  // namespace NebulaEmu
@@ -0,0 +1,219 @@
+#include "Tracer.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+namespace NebulaEmu {
+
+Tracer* tracer = nullptr;
+
+enum AddressingMode { IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABX, ABY, IND, IZX, IZY, REL };
+
+static const struct {
+    const char* mnemonic;
+    AddressingMode mode;
+} opcodeTable[0x100] = {
+    {"BRK", IMP}, {"ORA", IZX}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"ORA", ZP}, {"ASL", ZP}, {"???", IMP},
+    {"PHP", IMP}, {"ORA", IMM}, {"ASL", ACC}, {"???", IMP}, {"???", IMP}, {"ORA", ABS}, {"ASL", ABS}, {"???", IMP},
+    {"BPL", REL}, {"ORA", IZY}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"ORA", ZPX}, {"ASL", ZPX}, {"???", IMP},
+    {"CLC", IMP}, {"ORA", ABY}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"ORA", ABX}, {"ASL", ABX}, {"???", IMP},
+    {"JSR", ABS}, {"AND", IZX}, {"???", IMP}, {"???", IMP}, {"BIT", ZP}, {"AND", ZP}, {"ROL", ZP}, {"???", IMP},
+    {"PLP", IMP}, {"AND", IMM}, {"ROL", ACC}, {"???", IMP}, {"BIT", ABS}, {"AND", ABS}, {"ROL", ABS}, {"???", IMP},
+    {"BMI", REL}, {"AND", IZY}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"AND", ZPX}, {"ROL", ZPX}, {"???", IMP},
+    {"SEC", IMP}, {"AND", ABY}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"AND", ABX}, {"ROL", ABX}, {"???", IMP},
+    {"RTI", IMP}, {"EOR", IZX}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"EOR", ZP}, {"LSR", ZP}, {"???", IMP},
+    {"PHA", IMP}, {"EOR", IMM}, {"LSR", ACC}, {"???", IMP}, {"JMP", ABS}, {"EOR", ABS}, {"LSR", ABS}, {"???", IMP},
+    {"BVC", REL}, {"EOR", IZY}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"EOR", ZPX}, {"LSR", ZPX}, {"???", IMP},
+    {"CLI", IMP}, {"EOR", ABY}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"EOR", ABX}, {"LSR", ABX}, {"???", IMP},
+    {"RTS", IMP}, {"ADC", IZX}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"ADC", ZP}, {"ROR", ZP}, {"???", IMP},
+    {"PLA", IMP}, {"ADC", IMM}, {"ROR", ACC}, {"???", IMP}, {"JMP", IND}, {"ADC", ABS}, {"ROR", ABS}, {"???", IMP},
+    {"BVS", REL}, {"ADC", IZY}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"ADC", ZPX}, {"ROR", ZPX}, {"???", IMP},
+    {"SEI", IMP}, {"ADC", ABY}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"ADC", ABX}, {"ROR", ABX}, {"???", IMP},
+    {"???", IMP}, {"STA", IZX}, {"???", IMP}, {"???", IMP}, {"STY", ZP}, {"STA", ZP}, {"STX", ZP}, {"???", IMP},
+    {"DEY", IMP}, {"???", IMP}, {"TXA", IMP}, {"???", IMP}, {"STY", ABS}, {"STA", ABS}, {"STX", ABS}, {"???", IMP},
+    {"BCC", REL}, {"STA", IZY}, {"???", IMP}, {"???", IMP}, {"STY", ZPX}, {"STA", ZPX}, {"STX", ZPY}, {"???", IMP},
+    {"TYA", IMP}, {"STA", ABY}, {"TXS", IMP}, {"???", IMP}, {"???", IMP}, {"STA", ABX}, {"???", IMP}, {"???", IMP},
+    {"LDY", IMM}, {"LDA", IZX}, {"LDX", IMM}, {"???", IMP}, {"LDY", ZP}, {"LDA", ZP}, {"LDX", ZP}, {"???", IMP},
+    {"TAY", IMP}, {"LDA", IMM}, {"TAX", IMP}, {"???", IMP}, {"LDY", ABS}, {"LDA", ABS}, {"LDX", ABS}, {"???", IMP},
+    {"BCS", REL}, {"LDA", IZY}, {"???", IMP}, {"???", IMP}, {"LDY", ZPX}, {"LDA", ZPX}, {"LDX", ZPY}, {"???", IMP},
+    {"CLV", IMP}, {"LDA", ABY}, {"TSX", IMP}, {"???", IMP}, {"LDY", ABX}, {"LDA", ABX}, {"LDX", ABY}, {"???", IMP},
+    {"CPY", IMM}, {"CMP", IZX}, {"???", IMP}, {"???", IMP}, {"CPY", ZP}, {"CMP", ZP}, {"DEC", ZP}, {"???", IMP},
+    {"INY", IMP}, {"CMP", IMM}, {"DEX", IMP}, {"???", IMP}, {"CPY", ABS}, {"CMP", ABS}, {"DEC", ABS}, {"???", IMP},
+    {"BNE", REL}, {"CMP", IZY}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"CMP", ZPX}, {"DEC", ZPX}, {"???", IMP},
+    {"CLD", IMP}, {"CMP", ABY}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"CMP", ABX}, {"DEC", ABX}, {"???", IMP},
+    {"CPX", IMM}, {"SBC", IZX}, {"???", IMP}, {"???", IMP}, {"CPX", ZP}, {"SBC", ZP}, {"INC", ZP}, {"???", IMP},
+    {"INX", IMP}, {"SBC", IMM}, {"NOP", IMP}, {"???", IMP}, {"CPX", ABS}, {"SBC", ABS}, {"INC", ABS}, {"???", IMP},
+    {"BEQ", REL}, {"SBC", IZY}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"SBC", ZPX}, {"INC", ZPX}, {"???", IMP},
+    {"SED", IMP}, {"SBC", ABY}, {"???", IMP}, {"???", IMP}, {"???", IMP}, {"SBC", ABX}, {"INC", ABX}, {"???", IMP},
+};
+
+// bytes taken by the operand of each addressing mode
+static const int operandLength[] = {0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 1, 1, 1};
+
+bool TraceTrigger::parse(const std::string& text, TraceTrigger& trigger) {
+    size_t colon = text.find(':');
+    if (colon == std::string::npos || colon + 1 == text.size()) {
+        return false;
+    }
+    std::string kind = text.substr(0, colon);
+    char* end;
+    if (kind == "pc") {
+        trigger.kind = PC;
+        trigger.value = strtoull(text.c_str() + colon + 1, &end, 16);
+    } else if (kind == "frame") {
+        trigger.kind = Frame;
+        trigger.value = strtoull(text.c_str() + colon + 1, &end, 10);
+    } else {
+        return false;
+    }
+    return *end == '\0';
+}
+
+static bool endsWith(const std::string& text, const char* suffix) {
+    size_t length = strlen(suffix);
+    return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+}
+
+std::unique_ptr<Tracer> Tracer::open(const std::string& path, TraceTrigger start, TraceTrigger stop) {
+    std::unique_ptr<Tracer> tracer(new Tracer());
+    std::string name = path;
+    if (endsWith(name, ".gz")) {
+        name.resize(name.size() - 3);
+        // single quotes keep the shell from interpreting the path
+        std::string quoted = "'";
+        for (char c : path) {
+            quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+        }
+        tracer->_file = popen(("gzip -c > " + quoted + "'").c_str(), "w");
+        tracer->_pipe = true;
+    } else {
+        tracer->_file = fopen(path.c_str(), "wb");
+    }
+    if (!tracer->_file) {
+        std::cerr << "Failed to open CPU trace \"" << path << "\"" << std::endl;
+        return nullptr;
+    }
+    tracer->_binary = endsWith(name, ".bin");
+    if (tracer->_binary) {
+        uint32_t size = sizeof(TraceRecord);
+        fwrite("NBTR", 1, 4, tracer->_file);
+        fwrite(&size, sizeof(size), 1, tracer->_file);
+    }
+    tracer->_start = start;
+    tracer->_stop = stop;
+    tracer->_ring.reset(new TraceRecord[CAPACITY]);
+    tracer->_thread = std::thread(&Tracer::writer, tracer.get());
+    return tracer;
+}
+
+Tracer::~Tracer() {
+    _quit.store(true, std::memory_order_release);
+    _thread.join();
+    if (_pipe) {
+        pclose(_file);
+    } else {
+        fclose(_file);
+    }
+}
+
+void Tracer::writer() {
+    while (true) {
+        // read the flag first, so the records pushed before it was set are drained below
+        bool quit = _quit.load(std::memory_order_acquire);
+        uint64_t head = _head.load(std::memory_order_acquire);
+        uint64_t tail = _tail.load(std::memory_order_relaxed);
+        if (head == tail) {
+            if (quit) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        for (; tail != head; tail++) {
+            write(_ring[tail & (CAPACITY - 1)]);
+            // hand the slots back in batches
+            if ((tail & 0xFF) == 0xFF) {
+                _tail.store(tail + 1, std::memory_order_release);
+            }
+        }
+        _tail.store(tail, std::memory_order_release);
+    }
+}
+
+void Tracer::write(const TraceRecord& record) {
+    if (_binary) {
+        fwrite(&record, sizeof(record), 1, _file);
+        return;
+    }
+
+    // C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7
+    auto& op = opcodeTable[record.bytes[0]];
+    int length = operandLength[op.mode];
+    uint16_t word = record.bytes[1] | record.bytes[2] << 8;
+
+    char bytes[16];
+    if (length == 0) {
+        snprintf(bytes, sizeof(bytes), "%02X", record.bytes[0]);
+    } else if (length == 1) {
+        snprintf(bytes, sizeof(bytes), "%02X %02X", record.bytes[0], record.bytes[1]);
+    } else {
+        snprintf(bytes, sizeof(bytes), "%02X %02X %02X", record.bytes[0], record.bytes[1], record.bytes[2]);
+    }
+
+    char operand[16] = "";
+    switch (op.mode) {
+        case IMP:
+            break;
+        case ACC:
+            snprintf(operand, sizeof(operand), "A");
+            break;
+        case IMM:
+            snprintf(operand, sizeof(operand), "#$%02X", record.bytes[1]);
+            break;
+        case ZP:
+            snprintf(operand, sizeof(operand), "$%02X", record.bytes[1]);
+            break;
+        case ZPX:
+            snprintf(operand, sizeof(operand), "$%02X,X", record.bytes[1]);
+            break;
+        case ZPY:
+            snprintf(operand, sizeof(operand), "$%02X,Y", record.bytes[1]);
+            break;
+        case ABS:
+            snprintf(operand, sizeof(operand), "$%04X", word);
+            break;
+        case ABX:
+            snprintf(operand, sizeof(operand), "$%04X,X", word);
+            break;
+        case ABY:
+            snprintf(operand, sizeof(operand), "$%04X,Y", word);
+            break;
+        case IND:
+            snprintf(operand, sizeof(operand), "($%04X)", word);
+            break;
+        case IZX:
+            snprintf(operand, sizeof(operand), "($%02X,X)", record.bytes[1]);
+            break;
+        case IZY:
+            snprintf(operand, sizeof(operand), "($%02X),Y", record.bytes[1]);
+            break;
+        case REL:
+            snprintf(operand, sizeof(operand), "$%04X", (uint16_t)(record.PC + 2 + (int8_t)record.bytes[1]));
+            break;
+    }
+
+    char instruction[24];
+    snprintf(instruction, sizeof(instruction), "%s %s", op.mnemonic, operand);
+
+    fprintf(_file, "%04X  %-8s  %-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3u,%3u CYC:%llu\n", record.PC, bytes,
+            instruction, record.A, record.X, record.Y, record.P, record.SP, record.scanline, record.dot,
+            (unsigned long long)record.cycle);
+}
+
+}  // namespace NebulaEmu
@@ -0,0 +1,316 @@
+#include "Upscaler.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "PPU.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace NebulaEmu {
+
+namespace {
+
+// The filters are written once against Lanes, 4 pixels in an SSE2 register or a single pixel without it. Comparisons
+// return all-ones masks, select() picks per lane.
+#ifdef __SSE2__
+struct Lanes {
+    static constexpr uint32_t N = 4;
+    __m128i v;
+
+    static Lanes load(const uint32_t* p) { return {_mm_loadu_si128((const __m128i*)p)}; }
+
+    friend Lanes operator==(Lanes a, Lanes b) { return {_mm_cmpeq_epi32(a.v, b.v)}; }
+    friend Lanes operator!=(Lanes a, Lanes b) {
+        return {_mm_xor_si128(_mm_cmpeq_epi32(a.v, b.v), _mm_set1_epi32(-1))};
+    }
+    friend Lanes operator&(Lanes a, Lanes b) { return {_mm_and_si128(a.v, b.v)}; }
+    friend Lanes operator|(Lanes a, Lanes b) { return {_mm_or_si128(a.v, b.v)}; }
+};
+
+Lanes select(Lanes mask, Lanes a, Lanes b) {
+    return {_mm_or_si128(_mm_and_si128(mask.v, a.v), _mm_andnot_si128(mask.v, b.v))};
+}
+
+void store(uint32_t* out, __m128i v) { _mm_storeu_si128((__m128i*)out, v); }
+
+// a0 b0 a1 b1 ...
+void store2(uint32_t* out, Lanes a, Lanes b) {
+    store(out, _mm_unpacklo_epi32(a.v, b.v));
+    store(out + 4, _mm_unpackhi_epi32(a.v, b.v));
+}
+
+// a0 b0 c0 a1 | b1 c1 a2 b2 | c2 a3 b3 c3
+void store3(uint32_t* out, Lanes a, Lanes b, Lanes c) {
+    __m128 abLow = _mm_castsi128_ps(_mm_unpacklo_epi32(a.v, b.v));
+    __m128 abHigh = _mm_castsi128_ps(_mm_unpackhi_epi32(a.v, b.v));
+    __m128 caLow = _mm_castsi128_ps(_mm_unpacklo_epi32(c.v, a.v));
+    __m128 caHigh = _mm_castsi128_ps(_mm_unpackhi_epi32(c.v, a.v));
+    __m128 bcLow = _mm_castsi128_ps(_mm_unpacklo_epi32(b.v, c.v));
+    __m128 bcHigh = _mm_castsi128_ps(_mm_unpackhi_epi32(b.v, c.v));
+    store(out, _mm_castps_si128(_mm_shuffle_ps(abLow, caLow, _MM_SHUFFLE(3, 0, 1, 0))));
+    store(out + 4, _mm_castps_si128(_mm_shuffle_ps(bcLow, abHigh, _MM_SHUFFLE(1, 0, 3, 2))));
+    store(out + 8, _mm_castps_si128(_mm_shuffle_ps(caHigh, bcHigh, _MM_SHUFFLE(3, 2, 3, 0))));
+}
+
+// a0 a0 a0 a0 a1 ...
+void store4(uint32_t* out, Lanes a) {
+    store(out, _mm_shuffle_epi32(a.v, _MM_SHUFFLE(0, 0, 0, 0)));
+    store(out + 4, _mm_shuffle_epi32(a.v, _MM_SHUFFLE(1, 1, 1, 1)));
+    store(out + 8, _mm_shuffle_epi32(a.v, _MM_SHUFFLE(2, 2, 2, 2)));
+    store(out + 12, _mm_shuffle_epi32(a.v, _MM_SHUFFLE(3, 3, 3, 3)));
+}
+
+// every byte times its 16-bit weight / 256, 4 pixels at a time
+void shadeRow(const uint32_t* in, uint32_t* out, const uint16_t* weights, uint32_t width) {
+    __m128i zero = _mm_setzero_si128();
+    for (uint32_t x = 0; x < width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + x));
+        __m128i lowWeights = _mm_loadu_si128((const __m128i*)(weights + x * 4));
+        __m128i highWeights = _mm_loadu_si128((const __m128i*)(weights + x * 4 + 8));
+        __m128i low = _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), lowWeights);
+        __m128i high = _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), highWeights);
+        store(out + x, _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8)));
+    }
+}
+#else
+struct Lanes {
+    static constexpr uint32_t N = 1;
+    uint32_t v;
+
+    static Lanes load(const uint32_t* p) { return {*p}; }
+
+    friend Lanes operator==(Lanes a, Lanes b) { return {a.v == b.v ? ~0u : 0u}; }
+    friend Lanes operator!=(Lanes a, Lanes b) { return {a.v != b.v ? ~0u : 0u}; }
+    friend Lanes operator&(Lanes a, Lanes b) { return {a.v & b.v}; }
+    friend Lanes operator|(Lanes a, Lanes b) { return {a.v | b.v}; }
+};
+
+Lanes select(Lanes mask, Lanes a, Lanes b) { return {(mask.v & a.v) | (~mask.v & b.v)}; }
+
+void store2(uint32_t* out, Lanes a, Lanes b) {
+    out[0] = a.v;
+    out[1] = b.v;
+}
+
+void store3(uint32_t* out, Lanes a, Lanes b, Lanes c) {
+    out[0] = a.v;
+    out[1] = b.v;
+    out[2] = c.v;
+}
+
+void store4(uint32_t* out, Lanes a) { out[0] = out[1] = out[2] = out[3] = a.v; }
+
+void shadeRow(const uint32_t* in, uint32_t* out, const uint16_t* weights, uint32_t width) {
+    const uint8_t* src = (const uint8_t*)in;
+    uint8_t* dst = (uint8_t*)out;
+    for (uint32_t i = 0; i < width * 4; i++) {
+        dst[i] = src[i] * weights[i] >> 8;
+    }
+}
+#endif
+
+//   B        E0 E1
+// D E F  ->  E2 E3
+//   H
+void scale2xRow(const uint32_t* up, const uint32_t* mid, const uint32_t* down, uint32_t* out0, uint32_t* out1,
+                uint32_t width) {
+    for (uint32_t x = 0; x < width; x += Lanes::N) {
+        Lanes B = Lanes::load(up + x);
+        Lanes D = Lanes::load(mid + x - 1);
+        Lanes E = Lanes::load(mid + x);
+        Lanes F = Lanes::load(mid + x + 1);
+        Lanes H = Lanes::load(down + x);
+        Lanes edge = (B != H) & (D != F);
+        store2(out0 + 2 * x, select(edge & (D == B), D, E), select(edge & (B == F), F, E));
+        store2(out1 + 2 * x, select(edge & (D == H), D, E), select(edge & (H == F), F, E));
+    }
+}
+
+// A B C      E0 E1 E2
+// D E F  ->  E3 E4 E5
+// G H I      E6 E7 E8
+void scale3xRow(const uint32_t* up, const uint32_t* mid, const uint32_t* down, uint32_t* out0, uint32_t* out1,
+                uint32_t* out2, uint32_t width) {
+    for (uint32_t x = 0; x < width; x += Lanes::N) {
+        Lanes A = Lanes::load(up + x - 1), B = Lanes::load(up + x), C = Lanes::load(up + x + 1);
+        Lanes D = Lanes::load(mid + x - 1), E = Lanes::load(mid + x), F = Lanes::load(mid + x + 1);
+        Lanes G = Lanes::load(down + x - 1), H = Lanes::load(down + x), I = Lanes::load(down + x + 1);
+        Lanes edge = (B != H) & (D != F);
+        Lanes DB = edge & (D == B), BF = edge & (B == F), DH = edge & (D == H), HF = edge & (H == F);
+        store3(out0 + 3 * x, select(DB, D, E), select((DB & (E != C)) | (BF & (E != A)), B, E), select(BF, F, E));
+        store3(out1 + 3 * x, select((DB & (E != G)) | (DH & (E != A)), D, E), E,
+               select((BF & (E != I)) | (HF & (E != C)), F, E));
+        store3(out2 + 3 * x, select(DH, D, E), select((DH & (E != I)) | (HF & (E != G)), H, E), select(HF, F, E));
+    }
+}
+
+void nearestRow(const uint32_t* in, uint32_t* out, uint32_t width, uint32_t scale) {
+    for (uint32_t x = 0; x < width; x += Lanes::N) {
+        Lanes v = Lanes::load(in + x);
+        switch (scale) {
+            case 2:
+                store2(out + 2 * x, v, v);
+                break;
+            case 3:
+                store3(out + 3 * x, v, v, v);
+                break;
+            default:
+                store4(out + 4 * x, v);
+                break;
+        }
+    }
+}
+
+}  // namespace
+
+Upscaler::Upscaler(Filter filter, uint32_t scale, uint32_t threads) : _filter(filter), _scale(scale) {
+    if (filter == Smooth && scale == 4) {
+        _half.resize(SCREEN_WIDTH * 2 * SCREEN_HEIGHT * 2);
+    }
+
+    // pixels are 0xRRGGBBAA, so A, B, G, R in memory
+    uint32_t width = SCREEN_WIDTH * scale;
+    _weights.resize(scale, vector<uint16_t>(width * 4));
+    for (uint32_t row = 0; row < scale; row++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t line = row == scale - 1 ? (filter == CRT ? 160 : 128) : 256;
+            for (uint32_t channel = 0; channel < 4; channel++) {
+                uint32_t mask = filter != CRT || channel == 0 || 3 - channel == x % 3 ? 256 : 180;
+                _weights[row][x * 4 + channel] = channel == 0 ? 256 : line * mask >> 8;
+            }
+        }
+    }
+
+    threads = max(1u, threads);
+    _lines.resize(threads, vector<uint32_t>(max(3 * (SCREEN_WIDTH * 2 + 2), SCREEN_WIDTH * 4)));
+    for (uint32_t band = 1; band < threads; band++) {
+        _workers.emplace_back(&Upscaler::workerLoop, this, band);
+    }
+}
+
+Upscaler::~Upscaler() {
+    {
+        lock_guard<mutex> lock(_mutex);
+        _quit = true;
+    }
+    _start.notify_all();
+    for (auto& worker : _workers) {
+        worker.join();
+    }
+}
+
+void Upscaler::run(const uint32_t* src, uint32_t* dst, int pitch) {
+    if (_filter == Smooth && _scale == 4) {
+        dispatch({src, SCREEN_WIDTH, SCREEN_HEIGHT, _half.data(), SCREEN_WIDTH * 2, 2});
+        dispatch({_half.data(), SCREEN_WIDTH * 2, SCREEN_HEIGHT * 2, dst, (uint32_t)pitch / 4, 2});
+    } else {
+        dispatch({src, SCREEN_WIDTH, SCREEN_HEIGHT, dst, (uint32_t)pitch / 4, _scale});
+    }
+}
+
+bool Upscaler::parse(const string& name, Filter& filter) {
+    const pair<const char*, Filter> names[] = {
+        {"nearest", Nearest}, {"smooth", Smooth}, {"scanlines", Scanlines}, {"crt", CRT}};
+    for (auto& entry : names) {
+        if (name == entry.first) {
+            filter = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+// the calling thread takes band 0
+void Upscaler::dispatch(const Pass& pass) {
+    {
+        lock_guard<mutex> lock(_mutex);
+        _pass = pass;
+        _pending = _workers.size();
+        _generation++;
+    }
+    _start.notify_all();
+    work(0, pass);
+    unique_lock<mutex> lock(_mutex);
+    _done.wait(lock, [&] { return _pending == 0; });
+}
+
+void Upscaler::workerLoop(uint32_t band) {
+    uint64_t generation = 0;
+    unique_lock<mutex> lock(_mutex);
+    while (true) {
+        _start.wait(lock, [&] { return _quit || _generation != generation; });
+        if (_quit) {
+            return;
+        }
+        generation = _generation;
+        Pass pass = _pass;
+        lock.unlock();
+        work(band, pass);
+        lock.lock();
+        if (--_pending == 0) {
+            _done.notify_one();
+        }
+    }
+}
+
+void Upscaler::work(uint32_t band, const Pass& pass) {
+    uint32_t bands = _workers.size() + 1;
+    uint32_t begin = pass.height * band / bands;
+    uint32_t end = pass.height * (band + 1) / bands;
+    if (_filter == Smooth) {
+        smooth(pass, begin, end, _lines[band].data());
+    } else {
+        shade(pass, begin, end, _lines[band].data());
+    }
+}
+
+// the source rows around the current one are copied with the edge pixels repeated, so the kernels need no bounds
+void Upscaler::smooth(const Pass& pass, uint32_t begin, uint32_t end, uint32_t* lines) {
+    uint32_t stride = pass.width + 2;
+    uint32_t* rows[3] = {lines, lines + stride, lines + 2 * stride};
+    auto pad = [&](int y, uint32_t* line) {
+        const uint32_t* row = pass.src + clamp<int>(y, 0, pass.height - 1) * pass.width;
+        line[0] = row[0];
+        memcpy(line + 1, row, pass.width * sizeof(uint32_t));
+        line[pass.width + 1] = row[pass.width - 1];
+    };
+
+    pad((int)begin - 1, rows[0]);
+    pad(begin, rows[1]);
+    for (uint32_t y = begin; y < end; y++) {
+        pad(y + 1, rows[2]);
+        uint32_t* out = pass.dst + y * pass.scale * pass.pitch;
+        if (pass.scale == 2) {
+            scale2xRow(rows[0] + 1, rows[1] + 1, rows[2] + 1, out, out + pass.pitch, pass.width);
+        } else {
+            scale3xRow(rows[0] + 1, rows[1] + 1, rows[2] + 1, out, out + pass.pitch, out + 2 * pass.pitch,
+                       pass.width);
+        }
+        rotate(rows, rows + 1, rows + 3);
+    }
+}
+
+void Upscaler::shade(const Pass& pass, uint32_t begin, uint32_t end, uint32_t* line) {
+    uint32_t width = pass.width * pass.scale;
+    for (uint32_t y = begin; y < end; y++) {
+        uint32_t* out = pass.dst + y * pass.scale * pass.pitch;
+        if (_filter == Nearest) {
+            nearestRow(pass.src + y * pass.width, out, pass.width, pass.scale);
+            for (uint32_t row = 1; row < pass.scale; row++) {
+                memcpy(out + row * pass.pitch, out, width * sizeof(uint32_t));
+            }
+            continue;
+        }
+        nearestRow(pass.src + y * pass.width, line, pass.width, pass.scale);
+        for (uint32_t row = 0; row < pass.scale; row++) {
+            shadeRow(line, out + row * pass.pitch, _weights[row].data(), width);
+        }
+    }
+}
+
+}  // namespace NebulaEmu
@@ -1,14 +1,21 @@
 #include <SDL2/SDL.h>
 #include <getopt.h>
 
+#include <algorithm>
 #include <chrono>
+#include <fstream>
 #include <iostream>
-
-#include "APU.h"
-#include "CPU.h"
-#include "Cartridge.h"
-#include "Controller.h"
-#include "PPU.h"
+#include <thread>
+
+#include "Capture.h"
+#include "Emulator.h"
+#include "Lockstep.h"
+#include "Netplay.h"
+#include "NtscFilter.h"
+#include "Profiler.h"
+#include "Telemetry.h"
+#include "Tracer.h"
+#include "Upscaler.h"
 
 using namespace std;
 
@@ -16,46 +23,45 @@ namespace NebulaEmu {
 
 uint32_t scale = 3;
 
-uint32_t* pixels = nullptr;
-
-Cartridge* cartridge = nullptr;
-APU* apu = nullptr;
-CPU* cpu = nullptr;
-PPU* ppu = nullptr;
-Controller* controller = nullptr;
-
-void init() {
-    cartridge = new Cartridge();
-    apu = new APU();
-    cpu = new CPU();
-    ppu = new PPU();
-    controller = new Controller();
-    pixels = (uint32_t*)malloc(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
-}
+// scales on the CPU into a texture of the window size, the GPU stretches the 256x240 texture otherwise
+Upscaler* upscaler = nullptr;
+
+// composite video filter running on its own thread, the frame shown is the last one it finished
+NtscFilter* ntsc = nullptr;
+
+// rollback session with the peer, frames are paced by the host clock instead of cycles
+Netplay* netplay = nullptr;
 
 void audioCallback(void* userdata, uint8_t* stream, int len) {
     (void)userdata;
+    TelemetryScope scope(telemetry, Telemetry::AudioCallback);
     static uint64_t index = 0;
+    if (telemetry) {
+        telemetry->audioRing(apu->getSampleIndex() - index);
+    }
     if (apu->getSampleIndex() <= index + len) {
         SDL_memset(stream, 128, len);
+        if (telemetry) {
+            telemetry->audioUnderrun();
+        }
         return;
     }
 
     // synchronize
-    if (apu->getSampleIndex() - index >= apu->getBuffer().size()) {
-        index += apu->getBuffer().size();
+    if (apu->getSampleIndex() - index >= apu->getBufferSize()) {
+        index += apu->getBufferSize();
+        if (telemetry) {
+            telemetry->audioOverrun();
+        }
         return;
     }
 
-    SDL_memcpy(stream, apu->getBuffer().data() + index % apu->getBuffer().size(), len);
+    SDL_memcpy(stream, apu->getBuffer() + index % apu->getBufferSize(), len);
     index += len;
 }
 
-void run(string path) {
-    cartridge->load(path);
-    apu->reset();
-    cpu->reset();
-    ppu->reset();
+void run(string path, SessionOptions options) {
+    powerOn(path, options);
 
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_GAMECONTROLLER);
 
@@ -64,8 +70,9 @@ void run(string path) {
 
     SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
 
-    SDL_Texture* texture =
-        SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+    uint32_t textureScale = upscaler ? scale : 1;
+    SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
+                                             SCREEN_WIDTH * textureScale, SCREEN_HEIGHT * textureScale);
 
     SDL_AudioSpec spec;
     spec.freq = 44100;
@@ -97,33 +104,59 @@ void run(string path) {
     // The PPU operates at approximately 5.369318 MHz (master clock divided by 4).
     // The CPU completes one cycle in 1/1.789772 MHz = 559ns
     // The sequencer is clocked on every other CPU cycle, so 2 CPU cycles = 1 APU cycle
-    chrono::nanoseconds cycleDuration(559 * 2);
+    // PAL: the master clock is 26.601712 MHz and the CPU divides it by 16, 1/1.662607 MHz = 601ns
+    chrono::nanoseconds cycleDuration((cartridge->getRegion() == PAL ? 601 : 559) * 2);
+    chrono::nanoseconds frameDuration(frameNanoseconds(cartridge->getRegion()));
 
     bool quit = false;
     SDL_Event e;
+    uint64_t submittedFrame = ppu->getFrame();
     while (!quit) {
+        uint64_t frameBegin = telemetry ? telemetry->now() : 0;
         auto now = chrono::high_resolution_clock::now();
         elapsedTime += now - past;
         past = now;
-        while (elapsedTime > cycleDuration) {
-            apu->step();
-
-            cpu->step();
-            cpu->step();
-
-            ppu->step();
-            ppu->step();
-            ppu->step();
-            ppu->step();
-            ppu->step();
-            ppu->step();
-
-            elapsedTime -= cycleDuration;
+        if (netplay) {
+            while (elapsedTime > frameDuration && netplay->advance()) {
+                elapsedTime -= frameDuration;
+            }
+            // waiting for the peer does not pile up frames to catch up with
+            elapsedTime = min<chrono::high_resolution_clock::duration>(elapsedTime, frameDuration * 2);
+        }
+        uint64_t cycles = netplay ? 0 : elapsedTime / cycleDuration;
+        if (cycles) {
+            telemetry ? stepTimed(cycles) : step(cycles);
+            elapsedTime -= cycles * cycleDuration;
+        }
+        const uint32_t* frame = pixels;
+        if (ntsc) {
+            // the PPU only writes indices at the end of a frame
+            if (ppu->getFrame() != submittedFrame) {
+                submittedFrame = ppu->getFrame();
+                indices = ntsc->submit(indices, ppu->getVideoPhase());
+            }
+            frame = ntsc->output();
+        }
+        {
+            TelemetryScope scope(telemetry, Telemetry::TextureUpload);
+            void* texturePixels;
+            int pitch;
+            if (upscaler && SDL_LockTexture(texture, nullptr, &texturePixels, &pitch) == 0) {
+                upscaler->run(frame, (uint32_t*)texturePixels, pitch);
+                SDL_UnlockTexture(texture);
+            } else {
+                SDL_UpdateTexture(texture, nullptr, frame, SCREEN_WIDTH * sizeof(uint32_t));
+            }
+        }
+        {
+            TelemetryScope scope(telemetry, Telemetry::Present);
+            SDL_RenderClear(renderer);
+            SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+            SDL_RenderPresent(renderer);
+        }
+        if (telemetry) {
+            telemetry->endFrame(frameBegin, telemetry->now());
         }
-        SDL_UpdateTexture(texture, nullptr, pixels, SCREEN_WIDTH * sizeof(uint32_t));
-        SDL_RenderClear(renderer);
-        SDL_RenderCopy(renderer, texture, nullptr, nullptr);
-        SDL_RenderPresent(renderer);
 
         while (SDL_PollEvent(&e) != 0) {
             if (e.type == SDL_QUIT) {
@@ -143,6 +176,45 @@ void run(string path) {
     SDL_Quit();
 }
 
+// Run a number of frames as fast as possible without a window or audio device, writing the capture if one is asked.
+// False if a capture file can not be opened.
+bool runHeadless(string path, SessionOptions options, uint64_t frames, const string& video, const string& audio,
+                 uint32_t captureThreads, Lockstep* lockstep) {
+    powerOn(path, options);
+
+    unique_ptr<Capture> capture;
+    if (!video.empty() || !audio.empty()) {
+        capture = Capture::open(video, audio, cartridge->getRegion(), captureThreads);
+        if (!capture) {
+            return false;
+        }
+    }
+
+    auto begin = chrono::steady_clock::now();
+    for (uint64_t frame = 0; frame < frames; frame++) {
+        if (lockstep) {
+            lockstep->setInput();
+        }
+        stepFrame();
+        if (lockstep && !lockstep->frame()) {
+            frames = frame + 1;
+            break;
+        }
+        if (capture) {
+            capture->frame(pixels);
+            capture->audio(apu->getBuffer(), apu->getBufferSize(), apu->getSampleIndex());
+        }
+    }
+    double emulated = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    uint64_t duplicates = capture ? capture->getDuplicates() : 0;
+    // waits for the writers
+    capture.reset();
+    double total = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    printf("%llu frames in %.2f s (%.0f fps), %llu identical to the previous one, capture done after %.2f s\n",
+           (unsigned long long)frames, emulated, frames / emulated, (unsigned long long)duplicates, total);
+    return true;
+}
+
 }  // namespace NebulaEmu
 
 
@@ -155,14 +227,106 @@ void run(string path) {
 
 int main(int argc, char** argv) {
     string path;
+    string profilePath;
+    string tracePath;
+    string CPUTracePath;
+    NebulaEmu::TraceTrigger traceStart, traceStop;
+    bool stats = false;
+    bool filtered = false;
+    bool composite = false;
+    bool headless = false;
+    uint64_t frames = 600;
+    string videoPath;
+    string audioPath;
+    uint32_t captureThreads = max(1u, thread::hardware_concurrency());
+    string netplaySpec;
+    int player = 0;
+    uint32_t inputDelay = 0;
+    vector<string> cheatCodes;
+    vector<string> freezes;
+    string hashLogPath;
+    string hashCheckPath;
+    uint64_t inputSeed = 1;
+    NebulaEmu::Upscaler::Filter filter;
+    uint32_t filterThreads = min(4u, max(1u, thread::hardware_concurrency()));
+    // long options without a short form
+    enum {
+        TRACE_START = 256,
+        TRACE_STOP,
+        SCALE,
+        FILTER,
+        FILTER_THREADS,
+        NTSC,
+        HEADLESS,
+        FRAMES,
+        VIDEO,
+        AUDIO,
+        CAPTURE_THREADS,
+        NETPLAY,
+        PLAYER,
+        INPUT_DELAY,
+        CHEAT,
+        FREEZE,
+        HASH_LOG,
+        HASH_CHECK,
+        INPUT_SEED,
+    };
     const struct option table[] = {
         {"help", no_argument, NULL, 'h'},
+        {"cpu-trace", required_argument, NULL, 'c'},
+        {"trace-start", required_argument, NULL, TRACE_START},
+        {"trace-stop", required_argument, NULL, TRACE_STOP},
+        {"profile", required_argument, NULL, 'p'},
+        {"stats", no_argument, NULL, 's'},
+        {"trace", required_argument, NULL, 't'},
+        {"scale", required_argument, NULL, SCALE},
+        {"filter", required_argument, NULL, FILTER},
+        {"filter-threads", required_argument, NULL, FILTER_THREADS},
+        {"ntsc", no_argument, NULL, NTSC},
+        {"headless", no_argument, NULL, HEADLESS},
+        {"frames", required_argument, NULL, FRAMES},
+        {"video", required_argument, NULL, VIDEO},
+        {"audio", required_argument, NULL, AUDIO},
+        {"capture-threads", required_argument, NULL, CAPTURE_THREADS},
+        {"netplay", required_argument, NULL, NETPLAY},
+        {"player", required_argument, NULL, PLAYER},
+        {"input-delay", required_argument, NULL, INPUT_DELAY},
+        {"cheat", required_argument, NULL, CHEAT},
+        {"freeze", required_argument, NULL, FREEZE},
+        {"hash-log", required_argument, NULL, HASH_LOG},
+        {"hash-check", required_argument, NULL, HASH_CHECK},
+        {"input-seed", required_argument, NULL, INPUT_SEED},
         {0, 0, NULL, 0},
     };
 
     auto displayHelpMessage = [&]() {
         printf("Usage: %s [OPTION...] path\n\n", argv[0]);
-        printf("\t-h,--help\tDisplay available options\n");
+        printf("\t-h,--help\t\tDisplay available options\n");
+        printf("\t-c,--cpu-trace FILE\tLog every instruction to FILE in nestest format\n");
+        printf("\t\t\t\t(binary if FILE ends with .bin, gzip compressed if it ends with .gz)\n");
+        printf("\t--trace-start COND\tStart the CPU trace at pc:ADDR (hex) or frame:N\n");
+        printf("\t--trace-stop COND\tStop the CPU trace at pc:ADDR (hex) or frame:N\n");
+        printf("\t-p,--profile FILE\tWrite the profile to FILE on exit, as JSON if FILE ends with .json\n");
+        printf("\t\t\t\t(needs a build configured with -DNEBULA_PROFILE=ON)\n");
+        printf("\t-s,--stats\t\tPrint host frame timing, audio ring fill and missed deadlines every second\n");
+        printf("\t-t,--trace FILE\t\tWrite a Chrome trace_event timeline of the host frames to FILE\n");
+        printf("\t--scale N\t\tWindow size, 1 to 4 times 256x240 (default 3)\n");
+        printf("\t--filter NAME\t\tScale on the CPU with nearest, smooth, scanlines or crt instead of the GPU\n");
+        printf("\t--filter-threads N\tThreads scaling each frame (default up to 4)\n");
+        printf("\t--ntsc\t\t\tSimulate the NTSC composite signal, before any --filter\n");
+        printf("\t--headless\t\tRun --frames frames as fast as possible without a window\n");
+        printf("\t--frames N\t\tFrames of a headless run (default 600)\n");
+        printf("\t--video FILE\t\tCapture headless frames to FILE.y4m or a FILE_NNNNNN.png sequence\n");
+        printf("\t--audio FILE\t\tCapture the audio of a headless run to a WAV file\n");
+        printf("\t--capture-threads N\tThreads compressing PNG frames (default one per core)\n");
+        printf("\t--netplay SPEC\t\tRollback netplay over udp:LOCAL_PORT:HOST:PORT or unix:LOCAL_PATH:PEER_PATH\n");
+        printf("\t--player N\t\tNetplay joystick of the local player, 1 or 2 (default 1)\n");
+        printf("\t--input-delay N\t\tFrames of netplay input delay, fewer rollbacks (0 to 4, default 0)\n");
+        printf("\t--cheat CODE\t\tApply a 6 or 8 letter Game Genie code, can be repeated\n");
+        printf("\t--freeze ADDR:VALUE\tWrite VALUE to RAM or PRG RAM at ADDR every frame (hex), can be repeated\n");
+        printf("\t--hash-log FILE\t\tWrite the state hashes of every headless frame, run with random input\n");
+        printf("\t--hash-check FILE\tRun a headless log again and report the first frame and component that differ\n");
+        printf("\t--input-seed N\t\tSeed of the random input of --hash-log (default 1)\n");
         printf("\n");
     };
 
@@ -171,7 +335,7 @@ int main(int argc, char** argv) {
         return 0;
     }
     int opt;
-    while ((opt = getopt_long(argc, argv, "-h", table, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "-hc:p:st:", table, NULL)) != -1) {
         switch (opt) {
             case 1:
                 path = optarg;
@@ -179,14 +343,212 @@ int main(int argc, char** argv) {
             case 'h':
                 displayHelpMessage();
                 break;
+            case 'c':
+                CPUTracePath = optarg;
+                break;
+            case TRACE_START:
+            case TRACE_STOP:
+                if (!NebulaEmu::TraceTrigger::parse(optarg, opt == TRACE_START ? traceStart : traceStop)) {
+                    cerr << "invalid trace condition \"" << optarg << "\", expected pc:ADDR or frame:N" << endl;
+                    return 1;
+                }
+                break;
+            case 'p':
+#ifdef NEBULA_PROFILE
+                profilePath = optarg;
+                break;
+#else
+                cerr << "profiling is disabled in this build, configure with -DNEBULA_PROFILE=ON" << endl;
+                return 1;
+#endif
+            case 's':
+                stats = true;
+                break;
+            case 't':
+                tracePath = optarg;
+                break;
+            case SCALE:
+                NebulaEmu::scale = clamp(atoi(optarg), 1, 4);
+                break;
+            case FILTER:
+                if (!NebulaEmu::Upscaler::parse(optarg, filter)) {
+                    cerr << "unknown filter \"" << optarg << "\", expected nearest, smooth, scanlines or crt" << endl;
+                    return 1;
+                }
+                filtered = true;
+                break;
+            case FILTER_THREADS:
+                filterThreads = max(1, atoi(optarg));
+                break;
+            case NTSC:
+                composite = true;
+                break;
+            case HEADLESS:
+                headless = true;
+                break;
+            case FRAMES:
+                frames = strtoull(optarg, NULL, 10);
+                break;
+            case VIDEO:
+                videoPath = optarg;
+                break;
+            case AUDIO:
+                audioPath = optarg;
+                break;
+            case CAPTURE_THREADS:
+                captureThreads = max(1, atoi(optarg));
+                break;
+            case NETPLAY:
+                netplaySpec = optarg;
+                break;
+            case PLAYER:
+                player = clamp(atoi(optarg), 1, 2) - 1;
+                break;
+            case INPUT_DELAY:
+                inputDelay = clamp(atoi(optarg), 0, 4);
+                break;
+            case CHEAT:
+                cheatCodes.push_back(optarg);
+                break;
+            case FREEZE:
+                freezes.push_back(optarg);
+                break;
+            case HASH_LOG:
+                hashLogPath = optarg;
+                break;
+            case HASH_CHECK:
+                hashCheckPath = optarg;
+                break;
+            case INPUT_SEED:
+                inputSeed = strtoull(optarg, NULL, 10);
+                break;
             default:
                 return 1;
         }
     }
 
-    NebulaEmu::init();
+    if (!headless && (!videoPath.empty() || !audioPath.empty())) {
+        cerr << "--video and --audio capture headless runs, add --headless" << endl;
+        return 1;
+    }
+    if (!headless && (!hashLogPath.empty() || !hashCheckPath.empty())) {
+        cerr << "--hash-log and --hash-check hash headless runs, add --headless" << endl;
+        return 1;
+    }
+    if (!hashLogPath.empty() && !hashCheckPath.empty()) {
+        cerr << "--hash-log and --hash-check can not be combined" << endl;
+        return 1;
+    }
+
+    // a headless run without video never needs the RGBA frame
+    NebulaEmu::init(headless && videoPath.empty());
 
-    NebulaEmu::run(path);
+    for (auto& code : cheatCodes) {
+        if (!NebulaEmu::cheats->addGameGenie(code)) {
+            return 1;
+        }
+    }
+    for (auto& freeze : freezes) {
+        unsigned address, value;
+        char end;
+        if (sscanf(freeze.c_str(), "%x:%x%c", &address, &value, &end) != 2 || address > 0xFFFF || value > 0xFF) {
+            cerr << "invalid freeze \"" << freeze << "\", expected ADDR:VALUE in hex" << endl;
+            return 1;
+        }
+        if (!NebulaEmu::cheats->addFreeze(address, value)) {
+            return 1;
+        }
+    }
+
+    if (stats || !tracePath.empty()) {
+        NebulaEmu::telemetry = new NebulaEmu::Telemetry(stats, tracePath);
+    }
+
+    unique_ptr<NebulaEmu::Tracer> CPUTracer;
+    if (!CPUTracePath.empty()) {
+        CPUTracer = NebulaEmu::Tracer::open(CPUTracePath, traceStart, traceStop);
+        if (!CPUTracer) {
+            return 1;
+        }
+        NebulaEmu::tracer = CPUTracer.get();
+    }
+
+    unique_ptr<NebulaEmu::Upscaler> upscaler;
+    if (filtered && NebulaEmu::scale > 1) {
+        upscaler = make_unique<NebulaEmu::Upscaler>(filter, NebulaEmu::scale, filterThreads);
+        NebulaEmu::upscaler = upscaler.get();
+    }
+
+    unique_ptr<NebulaEmu::NtscFilter> ntsc;
+    if (composite) {
+        ntsc = make_unique<NebulaEmu::NtscFilter>();
+        NebulaEmu::ntsc = ntsc.get();
+        NebulaEmu::indices = ntsc->input();
+    }
+
+    unique_ptr<NebulaEmu::Netplay> netplay;
+    if (!netplaySpec.empty()) {
+        unique_ptr<NebulaEmu::Transport> transport = NebulaEmu::Transport::open(netplaySpec);
+        if (!transport) {
+            return 1;
+        }
+        netplay = make_unique<NebulaEmu::Netplay>(move(transport), player, inputDelay);
+        NebulaEmu::netplay = netplay.get();
+    }
+
+    unique_ptr<NebulaEmu::Lockstep> lockstep;
+    if (!hashLogPath.empty()) {
+        lockstep = NebulaEmu::Lockstep::record(hashLogPath, inputSeed);
+    } else if (!hashCheckPath.empty()) {
+        lockstep = NebulaEmu::Lockstep::check(hashCheckPath);
+    }
+    if ((!hashLogPath.empty() || !hashCheckPath.empty()) && !lockstep) {
+        return 1;
+    }
+
+    NebulaEmu::SessionOptions options;
+    options.profile = !profilePath.empty();
+    options.trace = NebulaEmu::tracer != nullptr;
+    if (headless) {
+        options.render = !videoPath.empty();
+        if (!NebulaEmu::runHeadless(path, options, frames, videoPath, audioPath, captureThreads, lockstep.get())) {
+            return 1;
+        }
+    } else {
+        NebulaEmu::run(path, options);
+    }
+
+    NebulaEmu::indices = nullptr;
+
+    if (netplay) {
+        printf("netplay: %llu frames, %llu rollbacks re-simulating %llu frames\n",
+               (unsigned long long)netplay->getFrame(), (unsigned long long)netplay->getRollbacks(),
+               (unsigned long long)netplay->getResimulated());
+    }
+
+    // flush the traces
+    delete NebulaEmu::telemetry;
+    NebulaEmu::telemetry = nullptr;
+    NebulaEmu::tracer = nullptr;
+    CPUTracer.reset();
+
+    if (!profilePath.empty()) {
+        ofstream out(profilePath);
+        if (profilePath.size() > 5 && profilePath.compare(profilePath.size() - 5, 5, ".json") == 0) {
+            NebulaEmu::profiler->writeJSON(out);
+        } else {
+            NebulaEmu::profiler->writeReport(out);
+        }
+    }
+
+    if (!hashCheckPath.empty()) {
+        auto& divergence = lockstep->getDivergence();
+        if (divergence.found()) {
+            printf("hash check: diverged at %s\n", divergence.describe().c_str());
+            return 1;
+        }
+        printf("hash check: %llu frames identical\n", (unsigned long long)lockstep->getFrames());
+    }
 
     return 0;
 }
\ No newline at end of file
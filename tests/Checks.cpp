@@ -0,0 +1,402 @@
+#include "Checks.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include "Cheats.h"
+#include "Emulator.h"
+#include "Lockstep.h"
+#include "RamSearch.h"
+#include "RomCache.h"
+#include "RomBuilder.h"
+#include "Tracer.h"
+
+using namespace std;
+
+namespace NebulaEmu {
+
+namespace {
+
+string path(const string& dir, const string& name) { return (filesystem::path(dir) / name).string(); }
+
+string writeRom(const string& dir, const string& name, RomBuilder& rom) {
+    vector<uint8_t> image = rom.build();
+    string romPath = path(dir, name);
+    ofstream(romPath, ios::binary).write((const char*)image.data(), image.size());
+    return romPath;
+}
+
+// the first lines of nestest.log, which starts at $C000 right after power-on
+string cpuTrace(const string& dir) {
+    RomBuilder rom;
+    rom.org(0xC000).label("reset");
+    rom.emitWord(0x4C, 0xC5F5);  // JMP $C5F5
+    rom.org(0xC5F5);
+    rom.emit(0xA2, 0x00);  // LDX #$00
+    rom.label("loop").jump(0x4C, "loop");
+    rom.setVectors("reset", "reset", "reset");
+    string romPath = writeRom(dir, "cpu.trace.nes", rom);
+
+    string logPath = path(dir, "cpu.trace.log");
+    unique_ptr<Tracer> trace = Tracer::open(logPath, {}, {});
+    if (!trace) {
+        return "can not write " + logPath;
+    }
+    tracer = trace.get();
+    SessionOptions options;
+    options.trace = true;
+    powerOn(romPath, options);
+    step(10);
+    tracer = nullptr;
+    // flushes the log
+    trace.reset();
+
+    const char* expected[] = {
+        "C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7",
+        "C5F5  A2 00     LDX #$00                        A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 30 CYC:10",
+    };
+    ifstream log(logPath);
+    for (const char* line : expected) {
+        string traced;
+        getline(log, traced);
+        if (traced != line) {
+            return "traced \"" + traced + "\", nestest.log has \"" + line + "\"";
+        }
+    }
+    return "";
+}
+
+// a state loads back into the same frame, a cut one is refused and leaves the session as it was
+string stateLoad(const string& dir) {
+    RomBuilder rom;
+    rom.org(0xC000).label("reset");
+    rom.emit(0xE6, 0x10);  // INC $10
+    rom.jump(0x4C, "reset");
+    rom.setVectors("reset", "reset", "reset");
+    powerOn(writeRom(dir, "state.load.nes", rom));
+    stepFrame();
+
+    State saved, now;
+    StateHash before, after;
+    saveState(saved);
+    hashState(now, before);
+    stepFrame();
+    if (!loadState(saved)) {
+        return "a state of the session was refused";
+    }
+    hashState(now, after);
+    if (before != after) {
+        return "the state did not load back";
+    }
+
+    State cut;
+    cut.beginSave();
+    cut.field((void*)saved.data().data(), saved.data().size() / 2);
+    stepFrame();
+    hashState(now, before);
+    if (loadState(cut)) {
+        return "half a state was loaded";
+    }
+    hashState(now, after);
+    if (before != after) {
+        return "a refused state changed the session";
+    }
+    return "";
+}
+
+// Game Genie codes decode to their documented patches, and a patch, a compare patch that matches, one that does not and
+// a freeze all reach the running program
+string cheatCodes(const string& dir) {
+    const struct {
+        const char* code;
+        bool valid;
+        uint16_t address;
+        uint8_t value;
+        int compare;
+    } codes[] = {
+        {"SXIOPO", true, 0x91D9, 0xAD, -1},
+        {"sxiopo", true, 0x91D9, 0xAD, -1},
+        {"ZEXPYGLA", true, 0x94A7, 0x02, 0x03},
+        {"SXIOPB", false, 0, 0, 0},
+        {"SXIOP", false, 0, 0, 0},
+        {"SXIOP\xE9", false, 0, 0, 0},
+    };
+    for (auto& c : codes) {
+        Cheats::Patch patch;
+        bool valid = Cheats::decode(c.code, patch);
+        if (valid != c.valid) {
+            return string(c.code) + (valid ? " decoded" : " did not decode");
+        }
+        if (valid && (patch.address != c.address || patch.value != c.value || patch.compare != c.compare)) {
+            char text[64];
+            snprintf(text, sizeof(text), "%04X:%02X?%d", patch.address, patch.value, patch.compare);
+            return string(c.code) + " decoded to " + text;
+        }
+    }
+
+    RomBuilder rom;
+    rom.org(0x9000).emit({0x11, 0x22, 0x66});
+    rom.org(0xC000).label("reset");
+    rom.emit(0xA9, 0x55).emit(0x85, 0x12);  // LDA #$55; STA $12
+    rom.label("loop");
+    for (uint8_t i = 0; i < 3; i++) {
+        rom.emitWord(0xAD, 0x9000 + i).emit(0x85, 0x10 + i * 4);  // LDA $9000+i; STA $10+4i
+    }
+    rom.emit(0xA5, 0x12).emit(0x85, 0x13);  // LDA $12; STA $13
+    rom.jump(0x4C, "loop");
+    rom.setVectors("reset", "reset", "reset");
+    powerOn(writeRom(dir, "cheats.nes", rom));
+
+    cheats->addPatch({0x9000, 0x33});
+    cheats->addPatch({0x9001, 0x44, 0x22});
+    cheats->addPatch({0x9002, 0x77, 0x00});
+    if (!cheats->addFreeze(0x0012, 0x99)) {
+        return "RAM could not be frozen";
+    }
+    stepFrame();
+    stepFrame();
+    const uint8_t* RAM = cpu->getRAM();
+    const struct {
+        const char* what;
+        uint16_t address;
+        uint8_t value;
+    } expected[] = {
+        {"patch", 0x10, 0x33},
+        {"matching compare patch", 0x14, 0x44},
+        {"other compare patch", 0x18, 0x66},
+        {"freeze", 0x13, 0x99},
+    };
+    for (auto& e : expected) {
+        if (RAM[e.address] != e.value) {
+            char text[64];
+            snprintf(text, sizeof(text), ", read $%02X instead of $%02X", RAM[e.address], e.value);
+            return string("the ") + e.what + text;
+        }
+    }
+    return "";
+}
+
+// every compare, size and signedness against a constant or the previous memory keeps the same addresses as a plain
+// loop over the bytes, and read() returns the values the loop sees
+string ramSearch(const string& dir) {
+    RomBuilder rom;
+    rom.org(0xC000).label("reset").jump(0x4C, "reset");
+    rom.setVectors("reset", "reset", "reset");
+    powerOn(writeRom(dir, "ram.search.nes", rom));
+    if (cartridge->getPRGRAMSize() < 0x2000) {
+        return "the cartridge has no PRG RAM";
+    }
+
+    // few distinct values around the sign and the ends, so that equality holds often
+    const uint8_t values[] = {0x00, 0x01, 0x7F, 0x80, 0x81, 0xFE, 0xFF};
+    uint32_t seed = 1;
+    vector<uint16_t> addresses;
+    for (uint32_t address = 0; address < 0x800; address++) {
+        addresses.push_back(address);
+    }
+    for (uint32_t address = 0x6000; address < 0x8000; address++) {
+        addresses.push_back(address);
+    }
+    // writes new memory and returns it, indexed like addresses
+    auto scramble = [&]() {
+        vector<uint8_t> memory;
+        for (uint16_t address : addresses) {
+            seed = seed * 1103515245 + 12345;
+            memory.push_back(values[(seed >> 16) % size(values)]);
+            cpu->write(address, memory.back());
+        }
+        return memory;
+    };
+    auto load = [](const vector<uint8_t>& memory, size_t i, RamSearch::Size size, bool isSigned) {
+        int32_t value = size == RamSearch::Word ? memory[i] | memory[i + 1] << 8 : memory[i];
+        int32_t sign = size == RamSearch::Word ? 0x8000 : 0x80;
+        return isSigned && value >= sign ? value - 2 * sign : value;
+    };
+
+    RamSearch search(currentSession());
+    const int32_t constants[] = {0x00, 0x7F, 0x80, 0xFF, 0x8001, 0xFFFF};
+    const int constantCount = size(constants);
+    for (int compare = RamSearch::Equal; compare <= RamSearch::GreaterEqual; compare++) {
+        for (auto size : {RamSearch::Byte, RamSearch::Word}) {
+            for (bool isSigned : {false, true}) {
+                for (int constant = -1; constant < constantCount; constant++) {
+                    RamSearch::Predicate predicate;
+                    predicate.compare = (RamSearch::Compare)compare;
+                    predicate.previous = constant < 0;
+                    predicate.value = constant < 0 ? 0 : constants[constant];
+                    predicate.size = size;
+                    predicate.isSigned = isSigned;
+
+                    vector<uint8_t> previous = scramble();
+                    search.restart();
+                    vector<uint8_t> current = scramble();
+                    search.filter(predicate);
+
+                    vector<uint8_t> value = {(uint8_t)predicate.value, (uint8_t)(predicate.value >> 8)};
+                    int32_t constantValue = load(value, 0, size, isSigned);
+                    vector<uint16_t> expected;
+                    for (size_t i = 0; i < addresses.size(); i++) {
+                        // a word does not cross the end of RAM or of PRG RAM
+                        if (size == RamSearch::Word && (addresses[i] == 0x7FF || addresses[i] == 0x7FFF)) {
+                            continue;
+                        }
+                        int32_t a = load(current, i, size, isSigned);
+                        int32_t b = predicate.previous ? load(previous, i, size, isSigned) : constantValue;
+                        bool holds[] = {a == b, a != b, a < b, a > b, a <= b, a >= b};
+                        if (holds[compare]) {
+                            expected.push_back(addresses[i]);
+                        }
+                        if (search.read(addresses[i], size, isSigned) != a) {
+                            char text[64];
+                            snprintf(text, sizeof(text), "read $%04X as %d instead of %d", addresses[i],
+                                     search.read(addresses[i], size, isSigned), a);
+                            return text;
+                        }
+                    }
+                    if (search.candidates() != expected) {
+                        char text[96];
+                        snprintf(text, sizeof(text), "compare %d of %s %s against %s%d kept %zu addresses, not %zu",
+                                 compare, isSigned ? "signed" : "unsigned", size == RamSearch::Word ? "words" : "bytes",
+                                 predicate.previous ? "previous " : "", predicate.value, search.candidates().size(),
+                                 expected.size());
+                        return text;
+                    }
+                }
+            }
+        }
+    }
+    return "";
+}
+
+// a compact and a full session agree frame by frame, also after one saved, ran on and loaded its state back, and a
+// byte of RAM poked into one of them is reported as a divergence
+string lockstepCompare(const string& dir) {
+    RomBuilder rom;
+    rom.org(0xC000).label("reset");
+    rom.emit(0xA9, 0x1E).emitWord(0x8D, 0x2001);  // LDA #$1E; STA $2001
+    rom.label("loop");
+    rom.emit(0xA9, 0x01).emitWord(0x8D, 0x4016);  // LDA #$01; STA $4016
+    rom.emit(0xA9, 0x00).emitWord(0x8D, 0x4016);  // LDA #$00; STA $4016
+    rom.emit(0xA2, 0x08);                         // LDX #$08
+    rom.label("buttons");
+    rom.emitWord(0xAD, 0x4016).emit({0x4A}).emit(0x26, 0x10);  // LDA $4016; LSR; ROL $10
+    rom.emit({0xCA}).branch(0xD0, "buttons");                   // DEX; BNE buttons
+    rom.emit(0xA5, 0x10).emit({0x18}).emit(0x65, 0x11).emit(0x85, 0x11);  // LDA $10; CLC; ADC $11; STA $11
+    rom.jump(0x4C, "loop");
+    rom.setVectors("reset", "reset", "reset");
+    string romPath = writeRom(dir, "lockstep.nes", rom);
+
+    Session* selected = currentSession();
+    Session* sessions[2] = {createSession(true), createSession(false)};
+    for (Session* session : sessions) {
+        selectSession(session);
+        powerOn(romPath);
+    }
+    string error;
+    Lockstep::Divergence divergence = Lockstep::compare(sessions[0], sessions[1], 120, 1);
+    if (divergence.found()) {
+        error = "identical runs diverged at " + divergence.describe();
+    }
+
+    if (error.empty()) {
+        selectSession(sessions[1]);
+        State saved;
+        saveState(saved);
+        for (uint64_t frame = 0; frame < 5; frame++) {
+            controller->setButtons(0, Lockstep::input(2, frame, 0));
+            stepFrame();
+        }
+        if (!loadState(saved)) {
+            error = "a state of the session was refused";
+        } else if ((divergence = Lockstep::compare(sessions[0], sessions[1], 120, 3)).found()) {
+            error = "runs diverged after a state was loaded back, at " + divergence.describe();
+        }
+    }
+
+    if (error.empty()) {
+        selectSession(sessions[1]);
+        cpu->write(0x0011, cpu->getRAM()[0x0011] ^ 0x40);
+        divergence = Lockstep::compare(sessions[0], sessions[1], 120, 4);
+        if (!divergence.found()) {
+            error = "a poked byte of RAM was not found";
+        } else if (divergence.frame != 0 || !(divergence.components & (1 << CPUState))) {
+            error = "a poked byte of RAM was reported at " + divergence.describe();
+        }
+    }
+
+    selectSession(selected);
+    for (Session* session : sessions) {
+        destroySession(session);
+    }
+    return error;
+}
+
+// a path opened again gets the same image back, until the file is rewritten
+string romCache(const string& dir) {
+    RomBuilder first, second;
+    first.org(0xC000).label("reset").jump(0x4C, "reset");
+    first.setVectors("reset", "reset", "reset");
+    second.org(0xC000).label("reset").emit({0xEA}).jump(0x4C, "reset");
+    second.setVectors("reset", "reset", "reset");
+    string romPath = writeRom(dir, "rom.cache.nes", first);
+
+    auto image = RomCache::acquire(romPath);
+    if (!image || RomCache::acquire(romPath) != image) {
+        return "the same file was opened twice";
+    }
+    auto modified = filesystem::last_write_time(romPath);
+    writeRom(dir, "rom.cache.nes", second);
+    // the same size, and a time that differs even where the file system keeps whole seconds
+    filesystem::last_write_time(romPath, modified + chrono::seconds(2));
+    vector<uint8_t> content = second.build();
+    auto rewritten = RomCache::acquire(romPath);
+    if (!rewritten || rewritten == image || rewritten->size() != content.size() ||
+        memcmp(rewritten->data(), content.data(), content.size()) != 0) {
+        return "a rewritten file got the old image";
+    }
+    return "";
+}
+
+// powering on again replaces the cartridge: the save of the first one is written back and read by the second, which
+// owns the file and writes it back in turn, and a game without a battery starts from blank PRG RAM
+string cartridgeReload(const string& dir) {
+    RomBuilder saved, plain;
+    saved.setBattery(true);
+    for (RomBuilder* rom : {&saved, &plain}) {
+        rom->org(0xC000).label("reset").jump(0x4C, "reset");
+        rom->setVectors("reset", "reset", "reset");
+    }
+    string savedPath = writeRom(dir, "reload.nes", saved);
+    string plainPath = writeRom(dir, "reload.plain.nes", plain);
+    filesystem::remove(path(dir, "reload.sav"));
+
+    powerOn(savedPath);
+    cpu->write(0x6000, 0x5A);
+    powerOn(savedPath);
+    if (cartridge->getPRGRAM()[0] != 0x5A) {
+        return "the save was not kept across a reload";
+    }
+    cpu->write(0x6000, 0xA5);
+    powerOn(plainPath);
+    if (cartridge->getPRGRAM()[0] != 0x00) {
+        return "a game without a battery got the PRG RAM of the one before";
+    }
+    char byte = 0;
+    ifstream(path(dir, "reload.sav"), ios::binary).read(&byte, 1);
+    if ((uint8_t)byte != 0xA5) {
+        return "the reloaded cartridge did not write its save";
+    }
+    return "";
+}
+
+}  // namespace
+
+vector<Check> builtinChecks() {
+    return {{"cpu.trace", cpuTrace}, {"state.load", stateLoad}, {"cheat.codes", cheatCodes}, {"ram.search", ramSearch},
+            {"lockstep.compare", lockstepCompare}, {"rom.cache", romCache},
+            {"cartridge.reload", cartridgeReload}};
+}
+
+}  // namespace NebulaEmu
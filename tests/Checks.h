@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace NebulaEmu {
+
+// A check of the core through its API rather than a ROM's own report. It runs in a process of its own like the ROMs,
+// can write its files to dir, and returns what went wrong, empty if it passed.
+struct Check {
+    std::string name;
+    std::string (*run)(const std::string& dir);
+};
+
+std::vector<Check> builtinChecks();
+
+}  // namespace NebulaEmu
@@ -0,0 +1,446 @@
+#include "TestRoms.h"
+
+#include "RomBuilder.h"
+
+using namespace std;
+
+namespace NebulaEmu {
+
+namespace {
+
+// Test program speaking the $6000 status protocol: $6000 holds $80 while running and the result code once done, with
+// $DE $B0 $61 at $6001-$6003 and a text at $6004. Every check fails with its own code, the text names the section.
+class StatusRom {
+public:
+    StatusRom() {
+        _rom.label("reset");
+        _rom.emit({0x78, 0xD8});  // SEI; CLD
+        _rom.emit(0xA2, 0xFF);    // LDX #$FF
+        _rom.emit({0x9A});        // TXS
+        store(0x4017, 0x40);      // frame IRQ off
+        store(0x2000, 0x00);
+        store(0x2001, 0x00);
+        store(0x6000, 0x80);
+        store(0x6001, 0xDE);
+        store(0x6002, 0xB0);
+        store(0x6003, 0x61);
+        store(0x6004, 0x00);
+    }
+
+    RomBuilder& rom() { return _rom; }
+
+    // LDA #value; STA addr
+    void store(uint16_t addr, uint8_t value) {
+        _rom.emit(0xA9, value);
+        _rom.emitWord(0x8D, addr);
+    }
+
+    void section(const string& text) {
+        for (size_t i = 0; i <= text.size(); i++) {
+            store(0x6004 + i, i < text.size() ? text[i] : 0);
+        }
+    }
+
+    // fails with the next code
+    void fail() {
+        _rom.emit(0xA9, _code++);  // LDA #code
+        _rom.jump(0x4C, "fail");
+    }
+
+    void expectA(uint8_t value) {
+        string ok = unique();
+        _rom.emit(0xC9, value);  // CMP #value
+        _rom.branch(0xF0, ok);   // BEQ
+        fail();
+        _rom.label(ok);
+    }
+
+    // A is preserved, the flags are not
+    void expectFlags(uint8_t mask, uint8_t value) {
+        string ok = unique();
+        _rom.emit({0x48, 0x08, 0x68});  // PHA; PHP; PLA
+        _rom.emit(0x29, mask);          // AND #mask
+        _rom.emit(0xC9, value);         // CMP #value
+        _rom.branch(0xF0, ok);          // BEQ
+        fail();
+        _rom.label(ok);
+        _rom.emit({0x68});  // PLA
+    }
+
+    void expectMemory(uint16_t addr, uint8_t value) {
+        _rom.emitWord(0xAD, addr);  // LDA addr
+        expectA(value);
+    }
+
+    // LDA addr; AND #mask; then compare
+    void expectBits(uint16_t addr, uint8_t mask, uint8_t value) {
+        _rom.emitWord(0xAD, addr);
+        _rom.emit(0x29, mask);
+        expectA(value);
+    }
+
+    void waitVBlank(int count = 1) {
+        for (int i = 0; i < count; i++) {
+            string wait = unique();
+            _rom.label(wait);
+            _rom.emitWord(0x2C, 0x2002);  // BIT $2002
+            _rom.branch(0x10, wait);      // BPL
+        }
+    }
+
+    // the end of the checks, interrupt handlers go after it
+    void pass() {
+        _rom.label("pass");
+        section("Passed");
+        store(0x6000, 0x00);
+        _rom.label("done").jump(0x4C, "done");
+        _rom.label("fail");
+        _rom.emitWord(0x8D, 0x6000);  // STA $6000
+        _rom.jump(0x4C, "done");
+        _rom.label("rti").emit({0x40});
+    }
+
+    TestRom build(const string& name, const string& nmi = "rti", const string& irq = "rti") {
+        _rom.setVectors(nmi, "reset", irq);
+        return {name, _rom.build()};
+    }
+
+private:
+    string unique() { return "_" + to_string(_labels++); }
+
+    RomBuilder _rom;
+    uint8_t _code = 1;
+    int _labels = 0;
+};
+
+TestRom cpuArithmetic() {
+    StatusRom t;
+    RomBuilder& rom = t.rom();
+
+    t.section("ADC");
+    rom.emit({0x18}).emit(0xA9, 0x50).emit(0x69, 0x50);  // CLC; LDA #$50; ADC #$50
+    t.expectFlags(0xC3, 0xC0);
+    t.expectA(0xA0);
+    rom.emit({0x18}).emit(0xA9, 0xFF).emit(0x69, 0x01);  // CLC; LDA #$FF; ADC #1
+    t.expectFlags(0xC3, 0x03);
+    t.expectA(0x00);
+    rom.emit({0x38}).emit(0xA9, 0x7F).emit(0x69, 0x00);  // SEC; LDA #$7F; ADC #0
+    t.expectFlags(0xC3, 0xC0);
+    t.expectA(0x80);
+
+    t.section("SBC");
+    rom.emit({0x38}).emit(0xA9, 0x50).emit(0xE9, 0xF0);  // SEC; LDA #$50; SBC #$F0
+    t.expectFlags(0xC3, 0x00);
+    t.expectA(0x60);
+    rom.emit({0x38}).emit(0xA9, 0x00).emit(0xE9, 0x01);  // SEC; LDA #0; SBC #1
+    t.expectFlags(0xC3, 0x80);
+    t.expectA(0xFF);
+    rom.emit({0x38}).emit(0xA9, 0x80).emit(0xE9, 0x01);  // SEC; LDA #$80; SBC #1
+    t.expectFlags(0xC3, 0x41);
+    t.expectA(0x7F);
+
+    t.section("CMP");
+    rom.emit(0xA9, 0x40).emit(0xC9, 0x41);  // LDA #$40; CMP #$41
+    t.expectFlags(0x83, 0x80);
+    rom.emit(0xC9, 0x40);  // CMP #$40
+    t.expectFlags(0x83, 0x03);
+
+    t.section("shifts");
+    rom.emit(0xA9, 0x81).emit({0x0A});  // LDA #$81; ASL A
+    t.expectFlags(0x83, 0x01);
+    t.expectA(0x02);
+    rom.emit({0x38, 0x6A});  // SEC; ROR A
+    t.expectFlags(0x83, 0x80);
+    t.expectA(0x81);
+
+    t.section("BIT");
+    t.store(0x0010, 0xC0);
+    rom.emit(0xA9, 0x00).emit(0x24, 0x10);  // LDA #0; BIT $10
+    t.expectFlags(0xC2, 0xC2);
+
+    t.section("INC DEC");
+    t.store(0x0010, 0xFF);
+    rom.emit(0xE6, 0x10);  // INC $10
+    t.expectFlags(0x82, 0x02);
+    t.expectMemory(0x0010, 0x00);
+    rom.emit(0xC6, 0x10);  // DEC $10
+    t.expectFlags(0x82, 0x80);
+    t.expectMemory(0x0010, 0xFF);
+
+    // the 2A03 has no BCD, D is only a flag
+    t.section("decimal");
+    rom.emit({0xF8, 0x18}).emit(0xA9, 0x09).emit(0x69, 0x01).emit({0xD8});  // SED; CLC; LDA #9; ADC #1; CLD
+    t.expectA(0x0A);
+
+    t.pass();
+    return t.build("cpu.arithmetic");
+}
+
+TestRom cpuAddressing() {
+    StatusRom t;
+    RomBuilder& rom = t.rom();
+
+    t.section("zero page,X wrap");
+    t.store(0x000F, 0x5A);
+    rom.emit(0xA2, 0x10).emit(0xB5, 0xFF);  // LDX #$10; LDA $FF,X
+    t.expectA(0x5A);
+
+    t.section("(zp,X) wrap");
+    t.store(0x00FF, 0x00);
+    t.store(0x0000, 0x03);
+    t.store(0x0300, 0x77);
+    rom.emit(0xA2, 0x00).emit(0xA1, 0xFF);  // LDX #0; LDA ($FF,X)
+    t.expectA(0x77);
+
+    t.section("(zp),Y page cross");
+    t.store(0x0020, 0xF0);
+    t.store(0x0021, 0x02);
+    t.store(0x0310, 0x66);
+    rom.emit(0xA0, 0x20).emit(0xB1, 0x20);  // LDY #$20; LDA ($20),Y
+    t.expectA(0x66);
+
+    // the high byte of the pointer comes from $0200, not $0300
+    t.section("JMP ($xxFF)");
+    t.store(0x02FF, 0x00);
+    t.store(0x0200, 0x90);
+    t.store(0x0300, 0xA0);
+    rom.emitWord(0x6C, 0x02FF);
+    rom.org(0xA000);
+    t.fail();
+    rom.org(0x9000);
+
+    t.section("JSR");
+    uint16_t ret = rom.here() + 2;
+    rom.jump(0x20, "subroutine");
+    t.fail();
+    rom.label("subroutine");
+    rom.emit({0x68});  // PLA
+    t.expectA(ret & 0xFF);
+    rom.emit({0x68});  // PLA
+    t.expectA(ret >> 8);
+
+    // 7 bytes to push the address and return, 5 bytes to fail
+    t.section("RTS");
+    uint16_t target = rom.here() + 12;
+    rom.emit(0xA9, (target - 1) >> 8).emit({0x48});    // LDA #hi; PHA
+    rom.emit(0xA9, (target - 1) & 0xFF).emit({0x48});  // LDA #lo; PHA
+    rom.emit({0x60});                                  // RTS
+    t.fail();
+
+    t.section("PHP PLP");
+    rom.emit(0xA9, 0x00).emit({0x48, 0x28, 0x08, 0x68});  // LDA #0; PHA; PLP; PHP; PLA
+    t.expectA(0x30);
+    rom.emit(0xA9, 0xFF).emit({0x48, 0x28, 0x08, 0x68});  // LDA #$FF; PHA; PLP; PHP; PLA
+    t.expectA(0xFF);
+    rom.emit({0xD8});  // CLD
+
+    // BRK skips its padding byte and pushes B, even with I set
+    t.section("BRK");
+    t.store(0x0012, 0x00);
+    rom.emit(0xA2, 0x00).emit({0x00, 0xE8, 0x8A});  // LDX #0; BRK; INX (padding); TXA
+    t.expectA(0x00);
+    t.expectBits(0x0012, 0x30, 0x30);
+
+    t.pass();
+    rom.label("irq");
+    rom.emit({0x68, 0x48}).emit(0x85, 0x12).emit({0x40});  // PLA; PHA; STA $12; RTI
+    return t.build("cpu.addressing", "rti", "irq");
+}
+
+TestRom ppuVBlank() {
+    StatusRom t;
+    RomBuilder& rom = t.rom();
+
+    t.section("VBlank flag");
+    t.waitVBlank(2);
+    t.expectBits(0x2002, 0x80, 0x00);
+
+    t.section("NMI");
+    t.store(0x0020, 0x00);
+    t.store(0x2000, 0x80);
+    rom.label("waitNMI");
+    rom.emit(0xA5, 0x20).emit(0xC9, 0x03);  // LDA $20; CMP #3
+    rom.branch(0xD0, "waitNMI");            // BNE
+    t.store(0x2000, 0x00);
+
+    t.pass();
+    rom.label("nmi").emit(0xE6, 0x20).emit({0x40});  // INC $20; RTI
+    return t.build("ppu.vblank", "nmi");
+}
+
+TestRom ppuMemory() {
+    StatusRom t;
+    RomBuilder& rom = t.rom();
+    auto address = [&](uint16_t addr) {
+        t.store(0x2006, addr >> 8);
+        t.store(0x2006, addr & 0xFF);
+    };
+
+    t.section("PPUDATA read buffer");
+    rom.emitWord(0xAD, 0x2002);  // LDA $2002
+    address(0x2000);
+    t.store(0x2007, 0x11);
+    t.store(0x2007, 0x22);
+    address(0x2000);
+    rom.emitWord(0xAD, 0x2007);
+    t.expectMemory(0x2007, 0x11);
+    t.expectMemory(0x2007, 0x22);
+
+    t.section("increment 32");
+    t.store(0x2000, 0x04);
+    address(0x2100);
+    t.store(0x2007, 0x33);
+    t.store(0x2007, 0x44);
+    t.store(0x2000, 0x00);
+    address(0x2120);
+    rom.emitWord(0xAD, 0x2007);
+    t.expectMemory(0x2007, 0x44);
+
+    t.section("horizontal mirroring");
+    address(0x2400);
+    rom.emitWord(0xAD, 0x2007);
+    t.expectMemory(0x2007, 0x11);
+
+    // palette reads skip the buffer, $3F10 mirrors $3F00
+    t.section("palette");
+    address(0x3F10);
+    t.store(0x2007, 0x2A);
+    address(0x3F00);
+    t.expectMemory(0x2007, 0x2A);
+
+    t.section("OAM");
+    t.store(0x2003, 0x05);
+    t.store(0x2004, 0x55);
+    t.store(0x2003, 0x05);
+    t.expectMemory(0x2004, 0x55);
+
+    t.pass();
+    return t.build("ppu.memory");
+}
+
+TestRom apuLengthCounter() {
+    StatusRom t;
+
+    // length index 3 loads 2, gone after one frame
+    t.section("pulse length");
+    t.store(0x4015, 0x01);
+    t.store(0x4000, 0x10);
+    t.store(0x4003, 0x18);
+    t.expectBits(0x4015, 0x01, 0x01);
+    t.waitVBlank(3);
+    t.expectBits(0x4015, 0x01, 0x00);
+
+    t.section("length halt");
+    t.store(0x4000, 0x30);
+    t.store(0x4003, 0x18);
+    t.waitVBlank(3);
+    t.expectBits(0x4015, 0x01, 0x01);
+
+    t.section("$4015 clear");
+    t.store(0x4015, 0x00);
+    t.expectBits(0x4015, 0x01, 0x00);
+
+    t.section("triangle noise length");
+    t.store(0x4015, 0x0C);
+    t.store(0x4008, 0x00);
+    t.store(0x400B, 0x18);
+    t.store(0x400C, 0x10);
+    t.store(0x400F, 0x18);
+    t.expectBits(0x4015, 0x0C, 0x0C);
+    t.waitVBlank(3);
+    t.expectBits(0x4015, 0x0C, 0x00);
+
+    t.pass();
+    return t.build("apu.length");
+}
+
+TestRom apuFrameIRQ() {
+    StatusRom t;
+    RomBuilder& rom = t.rom();
+
+    t.section("frame IRQ");
+    t.store(0x0031, 0x00);
+    t.store(0x4017, 0x00);
+    rom.emit({0x58});  // CLI
+    rom.label("waitIRQ");
+    rom.emit(0xA5, 0x31);         // LDA $31
+    rom.branch(0xF0, "waitIRQ");  // BEQ
+    rom.emit({0x78});             // SEI
+    t.expectBits(0x0030, 0x40, 0x40);
+    t.expectBits(0x4015, 0x40, 0x00);
+
+    t.section("IRQ inhibit");
+    t.store(0x4017, 0x40);
+    t.store(0x0031, 0x00);
+    rom.emit({0x58});  // CLI
+    t.waitVBlank(3);
+    rom.emit({0x78});  // SEI
+    t.expectMemory(0x0031, 0x00);
+
+    t.pass();
+    rom.label("irq");
+    rom.emit({0x48}).emitWord(0xAD, 0x4015);   // PHA; LDA $4015
+    rom.emit(0x85, 0x30).emit(0xE6, 0x31);     // STA $30; INC $31
+    rom.emit({0x68, 0x40});                    // PLA; RTI
+    return t.build("apu.frameirq", "rti", "irq");
+}
+
+// a scrolled screen of noise tiles with 64 sprites, checked by hash
+TestRom ppuRender() {
+    RomBuilder rom;
+    for (size_t i = 0; i < rom.CHR().size(); i++) {
+        rom.CHR()[i] = (i * 37 + (i >> 4)) & 0xFF;
+    }
+    auto store = [&](uint16_t addr, uint8_t value) {
+        rom.emit(0xA9, value);
+        rom.emitWord(0x8D, addr);
+    };
+
+    rom.label("reset");
+    rom.emit({0x78, 0xD8}).emit(0xA2, 0xFF).emit({0x9A});  // SEI; CLD; LDX #$FF; TXS
+    store(0x4017, 0x40);
+    store(0x2000, 0x00);
+    store(0x2001, 0x00);
+    for (int i = 0; i < 2; i++) {
+        string wait = "wait" + to_string(i);
+        rom.label(wait).emitWord(0x2C, 0x2002).branch(0x10, wait);  // BIT $2002; BPL
+    }
+    store(0x2006, 0x3F);
+    store(0x2006, 0x00);
+    for (int i = 0; i < 0x20; i++) {
+        store(0x2007, (i * 5 + 1) & 0x3F);
+    }
+
+    // both nametables and their attributes get X & 3
+    store(0x2006, 0x20);
+    store(0x2006, 0x00);
+    rom.emit(0xA0, 0x08).emit(0xA2, 0x00);  // LDY #8; LDX #0
+    rom.label("nametable");
+    rom.emit({0x8A}).emit(0x29, 0x03).emitWord(0x8D, 0x2007);  // TXA; AND #3; STA $2007
+    rom.emit({0xE8}).branch(0xD0, "nametable");                // INX; BNE
+    rom.emit({0x88}).branch(0xD0, "nametable");                // DEY; BNE
+
+    // sprite i is Y = 4i, tile 4i+1, attributes 4i+2 and X = 4i+3
+    rom.label("sprites");
+    rom.emit({0x8A}).emitWord(0x9D, 0x0200);  // TXA; STA $0200,X
+    rom.emit({0xE8}).branch(0xD0, "sprites");  // INX; BNE
+    store(0x4014, 0x02);
+
+    rom.emitWord(0xAD, 0x2002);  // LDA $2002
+    store(0x2005, 0x03);
+    store(0x2005, 0x05);
+    store(0x2000, 0x08);
+    store(0x2001, 0x1E);
+    rom.label("loop").jump(0x4C, "loop");
+    rom.label("rti").emit({0x40});
+    rom.setVectors("rti", "reset", "rti");
+    return {"ppu.render", rom.build(), 10, 0x62be121cc70ee55e};
+}
+
+}  // namespace
+
+vector<TestRom> builtinTestRoms() {
+    return {cpuArithmetic(), cpuAddressing(), ppuVBlank(), ppuMemory(), apuLengthCounter(), apuFrameIRQ(), ppuRender()};
+}
+
+}  // namespace NebulaEmu
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace NebulaEmu {
+
+// A test ROM assembled in-tree. It either reports through the $6000 status protocol or, if hashFrames is set, is
+// checked against the hash of the frame buffer after that many frames.
+struct TestRom {
+    std::string name;
+    std::vector<uint8_t> image;
+    uint32_t hashFrames = 0;
+    uint64_t hash = 0;
+};
+
+std::vector<TestRom> builtinTestRoms();
+
+}  // namespace NebulaEmu
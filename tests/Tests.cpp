@@ -0,0 +1,457 @@
+#include <getopt.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Checks.h"
+#include "Emulator.h"
+#include "Hash.h"
+#include "TestRoms.h"
+
+using namespace std;
+using namespace NebulaEmu;
+namespace fs = std::filesystem;
+
+namespace {
+
+enum Status { Pass, Fail, Error };
+
+const char* statusNames[] = {"PASS", "FAIL", "ERROR"};
+
+struct Job {
+    string name;
+    // directory of the ROM for external tests, "builtin" otherwise
+    string suite;
+    string path;
+    // hash mode if set, the expected hash is only checked when not recording
+    uint32_t hashFrames = 0;
+    uint64_t hash = 0;
+    // built-in checks run this instead of a ROM, path is their directory
+    string (*check)(const string& dir) = nullptr;
+};
+
+struct Outcome {
+    Status status = Error;
+    uint32_t frames = 0;
+    uint64_t hash = 0;
+    string message;
+    // everything the core printed
+    string output;
+    double seconds = 0;
+};
+
+uint32_t maxFrames = 3600;
+uint32_t recordFrames = 0;
+double timeout = 120;
+
+// a ROM using the status protocol keeps $6000 at $80 while running, $81 asks for a reset, anything else is the result
+Outcome run(const Job& job) {
+    init();
+    Outcome outcome;
+    if (job.check) {
+        outcome.message = job.check(job.path);
+        outcome.status = outcome.message.empty() ? Pass : Fail;
+        return outcome;
+    }
+    powerOn(job.path);
+
+    uint32_t hashFrames = recordFrames ? recordFrames : job.hashFrames;
+    uint32_t resetFrame = 0;
+    for (uint32_t frame = 1; frame <= max(maxFrames, hashFrames); frame++) {
+        stepFrame();
+        outcome.frames = frame;
+        if (hashFrames) {
+            if (frame < hashFrames) {
+                continue;
+            }
+            outcome.hash = hash64(pixels, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
+            outcome.status = recordFrames || outcome.hash == job.hash ? Pass : Fail;
+            if (outcome.status == Fail) {
+                char text[64];
+                snprintf(text, sizeof(text), "frame hash %016" PRIx64 ", expected %016" PRIx64, outcome.hash, job.hash);
+                outcome.message = text;
+            }
+            return outcome;
+        }
+
+        if (cpu->readByte(0x6001) != 0xDE || cpu->readByte(0x6002) != 0xB0 || cpu->readByte(0x6003) != 0x61) {
+            continue;
+        }
+        uint8_t status = cpu->readByte(0x6000);
+        if (status == 0x80) {
+            continue;
+        }
+        if (status == 0x81) {
+            // the reset button has to be held a little, about 100 ms
+            if (!resetFrame) {
+                resetFrame = frame + 6;
+            } else if (frame >= resetFrame) {
+                reset();
+                resetFrame = 0;
+            }
+            continue;
+        }
+        for (uint16_t addr = 0x6004; addr < 0x8000 && cpu->readByte(addr); addr++) {
+            outcome.message += (char)cpu->readByte(addr);
+        }
+        outcome.status = status ? Fail : Pass;
+        if (status) {
+            outcome.message = "code " + to_string(status) + (outcome.message.empty() ? "" : ": ") + outcome.message;
+        }
+        return outcome;
+    }
+    outcome.message = "no result after " + to_string(maxFrames) + " frames";
+    return outcome;
+}
+
+string readAll(FILE* file) {
+    string text;
+    char buffer[4096];
+    rewind(file);
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        text.append(buffer, n);
+    }
+    fclose(file);
+    return text;
+}
+
+#ifndef _WIN32
+struct Worker {
+    pid_t pid;
+    size_t job;
+    FILE* result;
+    FILE* output;
+    chrono::steady_clock::time_point begin;
+};
+
+// the core lives in globals and exits on fatal errors, so every ROM runs in its own process
+Worker spawn(const vector<Job>& jobs, size_t index) {
+    Worker worker{0, index, tmpfile(), tmpfile(), chrono::steady_clock::now()};
+    fflush(stdout);
+    fflush(stderr);
+    worker.pid = fork();
+    if (worker.pid == 0) {
+        dup2(fileno(worker.output), STDOUT_FILENO);
+        dup2(fileno(worker.output), STDERR_FILENO);
+        Outcome outcome = run(jobs[index]);
+        fprintf(worker.result, "%d %u %016" PRIx64 "\n%s", outcome.status, outcome.frames, outcome.hash,
+                outcome.message.c_str());
+        fflush(worker.result);
+        fflush(stdout);
+        _exit(0);
+    }
+    if (worker.pid < 0) {
+        cerr << "fork failed" << endl;
+        exit(1);
+    }
+    return worker;
+}
+
+Outcome collect(Worker& worker, int status, bool timedOut) {
+    Outcome outcome;
+    string result = readAll(worker.result);
+    outcome.output = readAll(worker.output);
+    outcome.seconds = chrono::duration<double>(chrono::steady_clock::now() - worker.begin).count();
+    int kind;
+    if (timedOut) {
+        outcome.message = "timed out";
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        outcome.message = WIFSIGNALED(status) ? "killed by signal " + to_string(WTERMSIG(status))
+                                              : "exited with status " + to_string(WEXITSTATUS(status));
+    } else if (sscanf(result.c_str(), "%d %u %" SCNx64, &kind, &outcome.frames, &outcome.hash) == 3) {
+        outcome.status = (Status)kind;
+        size_t line = result.find('\n');
+        outcome.message = line == string::npos ? "" : result.substr(line + 1);
+    } else {
+        outcome.message = "no result";
+    }
+    return outcome;
+}
+#endif
+
+template <typename F>
+void runAll(const vector<Job>& jobs, vector<Outcome>& outcomes, unsigned parallel, F&& done) {
+#ifdef _WIN32
+    // no fork, the ROMs run one after another in this process
+    (void)parallel;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        auto begin = chrono::steady_clock::now();
+        outcomes[i] = run(jobs[i]);
+        outcomes[i].seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        done(i);
+    }
+#else
+    vector<Worker> workers;
+    size_t next = 0;
+    while (next < jobs.size() || !workers.empty()) {
+        while (next < jobs.size() && workers.size() < parallel) {
+            workers.push_back(spawn(jobs, next++));
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid > 0) {
+            auto it = find_if(workers.begin(), workers.end(), [&](Worker& w) { return w.pid == pid; });
+            if (it == workers.end()) {
+                continue;
+            }
+            outcomes[it->job] = collect(*it, status, false);
+            done(it->job);
+            workers.erase(it);
+            continue;
+        }
+        auto now = chrono::steady_clock::now();
+        for (auto it = workers.begin(); it != workers.end();) {
+            if (chrono::duration<double>(now - it->begin).count() < timeout) {
+                it++;
+                continue;
+            }
+            kill(it->pid, SIGKILL);
+            waitpid(it->pid, &status, 0);
+            outcomes[it->job] = collect(*it, status, true);
+            done(it->job);
+            it = workers.erase(it);
+        }
+        this_thread::sleep_for(chrono::milliseconds(2));
+    }
+#endif
+}
+
+// a sidecar foo.hash next to foo.nes holds "FRAMES HASH", the ROM is then checked by frame hash
+void addRom(vector<Job>& jobs, const fs::path& path, const fs::path& root) {
+    Job job;
+    job.path = path.string();
+    job.name = fs::relative(path, root).replace_extension().generic_string();
+    job.suite = root.filename().string();
+    ifstream sidecar(fs::path(path).replace_extension(".hash"));
+    if (sidecar) {
+        string hash;
+        sidecar >> job.hashFrames >> hash;
+        job.hash = stoull(hash, nullptr, 16);
+    }
+    jobs.push_back(job);
+}
+
+void addPath(vector<Job>& jobs, const fs::path& path) {
+    if (!fs::is_directory(path)) {
+        addRom(jobs, path, path.parent_path());
+        return;
+    }
+    vector<fs::path> roms;
+    for (auto& entry : fs::recursive_directory_iterator(path)) {
+        string extension = entry.path().extension().string();
+        transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        if (entry.is_regular_file() && extension == ".nes") {
+            roms.push_back(entry.path());
+        }
+    }
+    sort(roms.begin(), roms.end());
+    for (auto& rom : roms) {
+        addRom(jobs, rom, path);
+    }
+}
+
+string escapeXML(const string& text) {
+    string escaped;
+    for (char c : text) {
+        switch (c) {
+            case '<':
+                escaped += "&lt;";
+                break;
+            case '>':
+                escaped += "&gt;";
+                break;
+            case '&':
+                escaped += "&amp;";
+                break;
+            case '"':
+                escaped += "&quot;";
+                break;
+            default:
+                // control characters are not allowed in XML 1.0
+                escaped += (unsigned char)c < 0x20 && c != '\n' && c != '\t' ? '?' : c;
+                break;
+        }
+    }
+    return escaped;
+}
+
+string toJUnit(const vector<Job>& jobs, const vector<Outcome>& outcomes, double seconds) {
+    size_t failures = 0, errors = 0;
+    for (auto& outcome : outcomes) {
+        failures += outcome.status == Fail;
+        errors += outcome.status == Error;
+    }
+    ostringstream out;
+    out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+    out << "<testsuites name=\"NebulaEmuTests\" tests=\"" << jobs.size() << "\" failures=\"" << failures
+        << "\" errors=\"" << errors << "\" time=\"" << seconds << "\">\n";
+    out << "  <testsuite name=\"NebulaEmuTests\" tests=\"" << jobs.size() << "\" failures=\"" << failures
+        << "\" errors=\"" << errors << "\" time=\"" << seconds << "\">\n";
+    for (size_t i = 0; i < jobs.size(); i++) {
+        auto& outcome = outcomes[i];
+        out << "    <testcase classname=\"" << escapeXML(jobs[i].suite) << "\" name=\"" << escapeXML(jobs[i].name)
+            << "\" time=\"" << outcome.seconds << "\">\n";
+        if (outcome.status != Pass) {
+            const char* tag = outcome.status == Fail ? "failure" : "error";
+            out << "      <" << tag << " message=\"" << escapeXML(outcome.message) << "\"/>\n";
+        }
+        if (!outcome.output.empty()) {
+            out << "      <system-out>" << escapeXML(outcome.output) << "</system-out>\n";
+        }
+        out << "    </testcase>\n";
+    }
+    out << "  </testsuite>\n</testsuites>\n";
+    return out.str();
+}
+
+// built-in ROMs go to DIR with their hash sidecars, so other emulators can run them too
+void writeBuiltins(const fs::path& dir) {
+    fs::create_directories(dir);
+    for (auto& rom : builtinTestRoms()) {
+        ofstream((dir / (rom.name + ".nes")).string(), ios::binary)
+            .write((const char*)rom.image.data(), rom.image.size());
+        if (rom.hashFrames) {
+            char text[64];
+            snprintf(text, sizeof(text), "%u %016" PRIx64 "\n", rom.hashFrames, rom.hash);
+            ofstream((dir / (rom.name + ".hash")).string()) << text;
+        }
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    string output = "NebulaEmuTests.xml";
+    string filter;
+    bool builtin = true;
+    unsigned parallel = max(1u, thread::hardware_concurrency());
+    const struct option table[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"frames", required_argument, NULL, 'f'},
+        {"timeout", required_argument, NULL, 't'},
+        {"filter", required_argument, NULL, 'F'},
+        {"output", required_argument, NULL, 'o'},
+        {"record", required_argument, NULL, 'r'},
+        {"write", required_argument, NULL, 'w'},
+        {"no-builtin", no_argument, NULL, 'B'},
+        {0, 0, NULL, 0},
+    };
+
+    auto displayHelpMessage = [&]() {
+        printf("Usage: %s [OPTION...] [DIR|ROM...]\n\n", argv[0]);
+        printf("Runs test ROMs and the built-in checks of the core headlessly, each one in its own process. A ROM\n");
+        printf("passes through the $6000 status protocol, or by frame hash if a FRAMES HASH sidecar with the .hash\n");
+        printf("extension sits next to it.\n\n");
+        printf("\t-h,--help\t\tDisplay available options\n");
+        printf("\t-j,--jobs N\t\tROMs run in parallel (default: number of cores)\n");
+        printf("\t-f,--frames N\t\tFrames before a $6000 ROM without a result is an error (default 3600)\n");
+        printf("\t-t,--timeout SEC\tWall time before a ROM is killed (default 120)\n");
+        printf("\t-F,--filter NAME\tOnly run ROMs whose name contains NAME\n");
+        printf("\t-o,--output FILE\tWrite the JUnit report to FILE (default NebulaEmuTests.xml)\n");
+        printf("\t-r,--record N\t\tWrite the .hash sidecar of every ROM given after N frames instead of checking\n");
+        printf("\t-w,--write DIR\t\tWrite the built-in ROMs to DIR and exit\n");
+        printf("\t-B,--no-builtin\t\tSkip the built-in ROMs and checks\n");
+        printf("\n");
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hj:f:t:F:o:r:w:B", table, NULL)) != -1) {
+        switch (opt) {
+            case 'h':
+                displayHelpMessage();
+                return 0;
+            case 'j':
+                parallel = max(1, stoi(optarg));
+                break;
+            case 'f':
+                maxFrames = stoul(optarg);
+                break;
+            case 't':
+                timeout = stod(optarg);
+                break;
+            case 'F':
+                filter = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'r':
+                recordFrames = stoul(optarg);
+                builtin = false;
+                break;
+            case 'w':
+                writeBuiltins(optarg);
+                return 0;
+            case 'B':
+                builtin = false;
+                break;
+            default:
+                return 1;
+        }
+    }
+
+    vector<Job> jobs;
+    auto stamp = chrono::steady_clock::now().time_since_epoch().count();
+    fs::path builtinDir = fs::temp_directory_path() / ("NebulaEmuTests-" + to_string(stamp));
+    if (builtin) {
+        writeBuiltins(builtinDir);
+        for (auto& rom : builtinTestRoms()) {
+            jobs.push_back({rom.name, "builtin", (builtinDir / (rom.name + ".nes")).string(), rom.hashFrames, rom.hash});
+        }
+        for (auto& check : builtinChecks()) {
+            jobs.push_back({check.name, "builtin", builtinDir.string(), 0, 0, check.run});
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        if (!fs::exists(argv[i])) {
+            cerr << argv[i] << " does not exist" << endl;
+            return 1;
+        }
+        addPath(jobs, argv[i]);
+    }
+    jobs.erase(remove_if(jobs.begin(), jobs.end(), [&](Job& job) { return job.name.find(filter) == string::npos; }),
+               jobs.end());
+
+    init();
+
+    vector<Outcome> outcomes(jobs.size());
+    size_t passed = 0;
+    auto begin = chrono::steady_clock::now();
+    runAll(jobs, outcomes, parallel, [&](size_t i) {
+        auto& outcome = outcomes[i];
+        passed += outcome.status == Pass;
+        printf("%-5s %-48s %6u frames %7.2f s", statusNames[outcome.status], jobs[i].name.c_str(), outcome.frames,
+               outcome.seconds);
+        if (recordFrames && outcome.status == Pass) {
+            char text[64];
+            snprintf(text, sizeof(text), "%u %016" PRIx64 "\n", recordFrames, outcome.hash);
+            ofstream(fs::path(jobs[i].path).replace_extension(".hash").string()) << text;
+            printf("  recorded %016" PRIx64, outcome.hash);
+        }
+        printf("%s%s\n", outcome.message.empty() ? "" : "  ", outcome.message.c_str());
+        fflush(stdout);
+    });
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    fs::remove_all(builtinDir);
+
+    ofstream(output) << toJUnit(jobs, outcomes, seconds);
+    printf("\n%zu/%zu passed in %.2f s, report written to %s\n", passed, jobs.size(), seconds, output.c_str());
+    return passed == jobs.size() ? 0 : 1;
+}
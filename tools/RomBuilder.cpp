@@ -0,0 +1,117 @@
+#include "RomBuilder.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+namespace NebulaEmu {
+
+RomBuilder::RomBuilder(uint8_t PRGBanks, uint8_t CHRBanks, uint8_t mapper)
+    : _mapper(mapper), _PRG(PRGBanks * 0x4000, 0xEA), _CHR(CHRBanks * 0x2000, 0) {}
+
+RomBuilder& RomBuilder::org(uint16_t addr) {
+    _pc = addr;
+    return *this;
+}
+
+uint32_t RomBuilder::offset(uint16_t addr) {
+    if (addr < 0x8000) {
+        std::cerr << "RomBuilder: " << addr << " is not in PRG ROM" << std::endl;
+        exit(1);
+    }
+    // $8000-$BFFF is the first bank, $C000-$FFFF the last one
+    if (addr >= 0xC000) {
+        return _PRG.size() - 0x4000 + (addr - 0xC000);
+    }
+    return addr - 0x8000;
+}
+
+RomBuilder& RomBuilder::emit(std::initializer_list<uint8_t> bytes) {
+    for (auto b : bytes) {
+        _PRG[offset(_pc++)] = b;
+    }
+    return *this;
+}
+
+RomBuilder& RomBuilder::emit(uint8_t opcode, uint8_t operand) { return emit({opcode, operand}); }
+
+RomBuilder& RomBuilder::emitWord(uint8_t opcode, uint16_t operand) {
+    return emit({opcode, (uint8_t)(operand & 0xFF), (uint8_t)(operand >> 8)});
+}
+
+RomBuilder& RomBuilder::label(const std::string& name) {
+    _labels[name] = _pc;
+    return *this;
+}
+
+RomBuilder& RomBuilder::branch(uint8_t opcode, const std::string& name) {
+    emit({opcode, 0});
+    _fixups.push_back({(uint16_t)(_pc - 1), name, true});
+    return *this;
+}
+
+RomBuilder& RomBuilder::jump(uint8_t opcode, const std::string& name) {
+    emit({opcode, 0, 0});
+    _fixups.push_back({(uint16_t)(_pc - 2), name, false});
+    return *this;
+}
+
+void RomBuilder::setVectors(const std::string& nmi, const std::string& reset, const std::string& irq) {
+    _vectors[0] = nmi;
+    _vectors[1] = reset;
+    _vectors[2] = irq;
+}
+
+uint16_t RomBuilder::address(const std::string& name) {
+    auto it = _labels.find(name);
+    if (it == _labels.end()) {
+        std::cerr << "RomBuilder: undefined label " << name << std::endl;
+        exit(1);
+    }
+    return it->second;
+}
+
+std::vector<uint8_t> RomBuilder::build() {
+    for (auto& fixup : _fixups) {
+        uint16_t target = address(fixup.name);
+        if (fixup.relative) {
+            int distance = target - (fixup.at + 1);
+            if (distance < -128 || distance > 127) {
+                std::cerr << "RomBuilder: branch to " << fixup.name << " out of range" << std::endl;
+                exit(1);
+            }
+            _PRG[offset(fixup.at)] = (uint8_t)distance;
+        } else {
+            _PRG[offset(fixup.at)] = target & 0xFF;
+            _PRG[offset(fixup.at + 1)] = target >> 8;
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (_vectors[i].empty()) {
+            continue;
+        }
+        uint16_t target = address(_vectors[i]);
+        _PRG[offset(0xFFFA + i * 2)] = target & 0xFF;
+        _PRG[offset(0xFFFB + i * 2)] = target >> 8;
+    }
+
+    std::vector<uint8_t> image = {'N', 'E', 'S', 0x1A};
+    image.push_back(_PRG.size() / 0x4000);
+    image.push_back(_CHR.size() / 0x2000);
+    image.push_back(((_mapper & 0x0F) << 4) | (_battery << 1) | _vertical);
+    image.push_back(_mapper & 0xF0);
+    image.resize(16, 0);
+    image.insert(image.end(), _PRG.begin(), _PRG.end());
+    image.insert(image.end(), _CHR.begin(), _CHR.end());
+    return image;
+}
+
+std::string RomBuilder::write(const std::string& name) {
+    auto path = (std::filesystem::temp_directory_path() / name).string();
+    auto image = build();
+    std::ofstream file(path, std::ios::binary);
+    file.write((const char*)image.data(), image.size());
+    return path;
+}
+
+}  // namespace NebulaEmu
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace NebulaEmu {
+
+// Assembles small iNES images in memory, so benchmarks and test ROMs can be generated in-tree instead of shipping
+// binaries. The cursor addresses the CPU view of PRG ROM ($8000-$FFFF), the last 16 KB is mapped at $C000.
+class RomBuilder {
+public:
+    explicit RomBuilder(uint8_t PRGBanks = 1, uint8_t CHRBanks = 1, uint8_t mapper = 0);
+
+    // move the cursor to a CPU address
+    RomBuilder& org(uint16_t addr);
+
+    uint16_t here() { return _pc; }
+
+    RomBuilder& emit(std::initializer_list<uint8_t> bytes);
+
+    // opcode with a one byte operand (immediate, zero page, indirect)
+    RomBuilder& emit(uint8_t opcode, uint8_t operand);
+
+    // opcode with an absolute operand
+    RomBuilder& emitWord(uint8_t opcode, uint16_t operand);
+
+    RomBuilder& label(const std::string& name);
+
+    // relative branch to a label, the label may be defined later
+    RomBuilder& branch(uint8_t opcode, const std::string& name);
+
+    // JMP/JSR to a label, the label may be defined later
+    RomBuilder& jump(uint8_t opcode, const std::string& name);
+
+    void setVectors(const std::string& nmi, const std::string& reset, const std::string& irq);
+
+    void setMirroring(bool vertical) { _vertical = vertical; }
+
+    void setBattery(bool battery) { _battery = battery; }
+
+    // PRG ROM, 16 KB per bank
+    std::vector<uint8_t>& PRG() { return _PRG; }
+
+    // CHR ROM, 8 KB per bank
+    std::vector<uint8_t>& CHR() { return _CHR; }
+
+    std::vector<uint8_t> build();
+
+    // write the image to the temporary directory and return its path
+    std::string write(const std::string& name);
+
+private:
+    uint32_t offset(uint16_t addr);
+
+    uint16_t address(const std::string& name);
+
+    struct Fixup {
+        uint16_t at;
+        std::string name;
+        bool relative;
+    };
+
+    uint8_t _mapper;
+    bool _vertical = false;
+    bool _battery = false;
+    uint16_t _pc = 0x8000;
+    std::vector<uint8_t> _PRG;
+    std::vector<uint8_t> _CHR;
+    std::map<std::string, uint16_t> _labels;
+    std::vector<Fixup> _fixups;
+    std::string _vectors[3];
+};
+
+}  // namespace NebulaEmu